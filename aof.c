@@ -0,0 +1,426 @@
+/*
+ * HashServer persistence -- see aof.h for the policies and the file format.
+ */
+
+// Imports
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "aof.h"
+#include "log.h"
+
+#define AOF_MAGIC "HSAOF1\n"    // with its NUL, the first 8 bytes of the file
+#define AOF_TICK_MS 10          // the flusher writes out what has piled up at least this often
+#define AOF_READ (1u << 20)     // stdio buffer for the replay
+
+// what comes before every record's key and value
+struct aof_header {
+    uint32_t checksum;  // of everything after it, see recordChecksum()
+    uint8_t op;         // QUEUE_OP_SET, QUEUE_OP_DEL or QUEUE_OP_EXPIRE
+    uint8_t unused[3];
+    uint32_t keyLen;
+    uint32_t valueLen;
+    uint32_t expire;    // unix time the pair expires at, 0 if it doesn't. only for SET and EXPIRE
+};
+
+static int aofFd = -1;
+static int fsyncPolicy;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;      // the flusher has something to do
+static pthread_cond_t synced = PTHREAD_COND_INITIALIZER;    // durable moved
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;      // the buffer was taken by the flusher
+static char *buffer;        // records waiting for the flusher
+static size_t bufferLen;
+static size_t bufferCap;
+static uint64_t appended;   // bytes of records appended so far, the log sequence number of the last one
+static uint64_t durable;    // bytes of records known to be on disk, as far as the policy promises anything
+static int broken;          // a write or fsync failed. nothing is logged from then on, and nothing more is durable
+static uint64_t fileEnd;    // where the last record written in full ends in the file
+static uint64_t logStart;   // where the first record appended since aof_open() goes in the file
+static int running;
+static pthread_t flusher;
+static uint64_t logId;      // tells this file from others, see aof_log_id()
+static uint64_t logEnd;     // size of the file once the flusher has stopped
+static __thread uint64_t threadLsn;     // where the calling thread's last record ends
+
+// ------------------------------- RECORDS -------------------------------
+
+static uint32_t recordChecksum(const struct aof_header *header, const char *key, const char *value) {
+    uint64_t h = queue_hash((const char *) header + sizeof(header->checksum),
+                            sizeof(*header) - sizeof(header->checksum));
+    h ^= queue_hash(key, header->keyLen) * 0x9E3779B97F4A7C15ull;
+    uint64_t v = queue_hash(value, header->valueLen);
+    h ^= (v << 21) | (v >> 43);
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+// buffers one change for the flusher. called by the store with the shard lock held, see queue_set_journal().
+void aof_append(void *arguements, int op, const char *key, size_t keyLen, const char *value, size_t valueLen,
+                uint32_t expire) {
+    (void) arguements;
+    struct aof_header header;
+    memset(&header, 0, sizeof(header));
+    header.op = (uint8_t) op;
+    header.keyLen = (uint32_t) keyLen;
+    header.valueLen = (uint32_t) valueLen;
+    header.expire = expire;
+    header.checksum = recordChecksum(&header, key, value);
+    size_t len = sizeof(header) + keyLen + valueLen;
+
+    pthread_mutex_lock(&lock);
+    while (running && !broken && bufferLen > AOF_MAX_BUFFER) {
+        pthread_cond_wait(&room, &lock);    // the disk can't keep up. better slow than out of memory
+    }
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (bufferLen + len > bufferCap && !broken) {
+        size_t cap = bufferCap ? bufferCap : AOF_READ;
+        while (cap < bufferLen + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(buffer, cap);
+        if (grown == NULL) {
+            // the log would miss this change from now on, which breaks it like a failed write does
+            broken = 1;
+            pthread_cond_broadcast(&synced);    // waiters give up
+            LOG(LOG_LEVEL_ERROR, "msg=\"aof out of memory, no more changes are logged\"");
+        } else {
+            buffer = grown;
+            bufferCap = cap;
+        }
+    }
+    if (broken) {
+        // the change still gets a sequence number, which never becomes durable, so whoever waits for it is told
+        appended += len;
+        threadLsn = appended;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    memcpy(buffer + bufferLen, &header, sizeof(header));
+    memcpy(buffer + bufferLen + sizeof(header), key, keyLen);
+    memcpy(buffer + bufferLen + sizeof(header) + keyLen, value, valueLen);
+    bufferLen += len;
+    appended += len;
+    threadLsn = appended;
+    if (fsyncPolicy == AOF_FSYNC_ALWAYS) {
+        pthread_cond_signal(&wake);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// ------------------------------- FLUSHER -------------------------------
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// background thread. the only one that writes to the file. while it writes and syncs one batch, the next one piles
+// up in the buffer, and goes out in a single write and fsync once this one is done.
+static void * aofFlusher(void *arguements) {
+    (void) arguements;
+    char *batch = NULL;     // the buffer before last, swapped back and forth with it
+    size_t batchCap = 0;
+    uint64_t written = 0;
+    double lastSync = nowMs();
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        if (bufferLen == 0 && running) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += AOF_TICK_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&wake, &lock, &until);
+        }
+        int stopping = !running;
+        int dead = broken;
+        char *data = buffer;
+        size_t dataCap = bufferCap;
+        size_t len = bufferLen;
+        uint64_t end = appended;
+        buffer = batch;
+        bufferCap = batchCap;
+        bufferLen = 0;
+        batch = data;
+        batchCap = dataCap;
+        pthread_cond_broadcast(&room);
+        pthread_mutex_unlock(&lock);
+
+        // once the log is broken, what was buffered before anybody noticed is dropped like everything after it
+        int failed = 0;
+        if (len > 0 && !dead) {
+            if (writeAll(aofFd, data, len) == 0) {
+                fileEnd += len;
+                written = end;
+            } else {
+                failed = 1;
+                LOG(LOG_LEVEL_ERROR, "msg=\"aof write error, no more changes are logged\" error=\"%s\"",
+                    strerror(errno));
+                // a short write leaves a torn record behind. the next start cuts the file off at the first torn
+                // record, so anything written after it would be lost then, and it goes right away
+                if (ftruncate(aofFd, (off_t) fileEnd) < 0) {
+                    LOG(LOG_LEVEL_ERROR, "msg=\"aof truncate error\" error=\"%s\"", strerror(errno));
+                }
+            }
+        }
+        double now = nowMs();
+        int sync = !dead && !failed && (fsyncPolicy == AOF_FSYNC_ALWAYS ? len > 0 :
+                   fsyncPolicy > 0 && (stopping || now - lastSync >= fsyncPolicy));
+        if (sync && fdatasync(aofFd) < 0) {
+            // after a failed fsync the kernel may have thrown the dirty pages away, so nothing in the file is sure
+            failed = 1;
+            LOG(LOG_LEVEL_ERROR, "msg=\"aof fsync error, no more changes are logged\" error=\"%s\"",
+                strerror(errno));
+        }
+        if (sync) {
+            lastSync = now;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (failed) {
+            broken = 1;
+            pthread_cond_broadcast(&synced);    // waiters give up
+            pthread_cond_broadcast(&room);
+        } else if (!broken && (sync || fsyncPolicy == AOF_FSYNC_NEVER)) {
+            __atomic_store_n(&durable, written, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&synced);
+        }
+        if (stopping && bufferLen == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    free(batch);
+    return NULL;
+}
+
+// ------------------------------- WAITING FOR THE DISK -------------------------------
+
+// where the calling thread's last record ends. 0 if it never appended one.
+uint64_t aof_thread_lsn(void) {
+    return threadLsn;
+}
+
+// whether every record up to lsn is as safe as the policy makes it. always true without an append-only file.
+int aof_durable(uint64_t lsn) {
+    return fsyncPolicy != AOF_FSYNC_ALWAYS || __atomic_load_n(&durable, __ATOMIC_ACQUIRE) >= lsn;
+}
+
+// waits until aof_durable(lsn). returns 0, or -1 if that will never be: the file could not be written or synced (or
+// the server is shutting down), and the changes up to lsn must not be acknowledged.
+int aof_wait(uint64_t lsn) {
+    if (aof_durable(lsn)) {
+        return 0;
+    }
+    pthread_mutex_lock(&lock);
+    while (running && !broken && durable < lsn) {
+        pthread_cond_wait(&synced, &lock);
+    }
+    int done = durable >= lsn;
+    pthread_mutex_unlock(&lock);
+    return done ? 0 : -1;
+}
+
+// ------------------------------- SETUP AND REPLAY -------------------------------
+
+// "always", "never" or a number of milliseconds. returns the policy, or AOF_FSYNC_ALWAYS - 1 if text is none of them.
+int aof_parse_policy(const char *text) {
+    if (strcmp(text, "always") == 0) {
+        return AOF_FSYNC_ALWAYS;
+    }
+    if (strcmp(text, "never") == 0) {
+        return AOF_FSYNC_NEVER;
+    }
+    char *end;
+    long ms = strtol(text, &end, 10);
+    return end == text || *end != '\0' || ms < 1 || ms > 3600000 ? AOF_FSYNC_ALWAYS - 1 : (int) ms;
+}
+
+static void replayRecord(struct queue *Q, const struct aof_header *header, const char *key, const char *value,
+                         uint32_t now) {
+    if (header->op == QUEUE_OP_DEL || (header->expire != 0 && header->expire <= now)) {
+        queue_remove_value(Q, key, header->keyLen, NULL, NULL);    // an expired SET leaves nothing behind either
+    } else if (header->op == QUEUE_OP_EXPIRE) {
+        queue_expire(Q, key, header->keyLen, (long) (header->expire - now));
+    } else if (header->expire != 0) {
+        queue_setex(Q, key, header->keyLen, value, header->valueLen, header->expire - now);
+    } else {
+        queue_set(Q, key, header->keyLen, value, header->valueLen);
+    }
+}
+
+// replays the records in file into Q. returns the offset the last good record ends at.
+static long replay(FILE *file, struct queue *Q, unsigned long *records) {
+    struct aof_header header;
+    char *data = NULL;
+    size_t dataCap = 0;
+    uint32_t now = (uint32_t) time(NULL);
+    long good = ftell(file);
+    *records = 0;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        size_t len = (size_t) header.keyLen + header.valueLen;
+        if (header.op < QUEUE_OP_SET || header.op > QUEUE_OP_EXPIRE || header.keyLen > QUEUE_MAX_KEY ||
+            len > QUEUE_MAX_ITEM_LIMIT) {
+            break;
+        }
+        if (len + 1 > dataCap) {
+            char *grown = realloc(data, len + 1);
+            if (grown == NULL) {
+                break;
+            }
+            data = grown;
+            dataCap = len + 1;
+        }
+        if (fread(data, 1, len, file) != len ||
+            recordChecksum(&header, data, data + header.keyLen) != header.checksum) {
+            break;
+        }
+        replayRecord(Q, &header, data, data + header.keyLen, now);
+        good = ftell(file);
+        ++*records;
+    }
+    free(data);
+    return good;
+}
+
+// replays the file at path into Q, creating it if need be, then logs every change made to Q from now on to it with
+// the given fsync policy. a store reopened from a checkpoint, or loaded from a snapshot, that holds this file up to
+// some offset (Q->logId and Q->logOffset, see queue_checkpoint()) only gets the tail after it replayed. call before
+// any client can change Q. returns EXIT_SUCCESS or EXIT_FAILURE.
+int aof_open(const char *path, int policy, struct queue *Q) {
+    double start = nowMs();
+    aofFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (aofFd < 0 || fstat(aofFd, &st) < 0) {
+        return EXIT_FAILURE;
+    }
+    logId = ((uint64_t) st.st_dev << 32 ^ (uint64_t) st.st_ino) | 1;   // never 0, which stands for no log
+    FILE *file = fdopen(dup(aofFd), "rb");
+    if (file == NULL) {
+        return EXIT_FAILURE;
+    }
+    setvbuf(file, NULL, _IOFBF, AOF_READ);
+
+    char magic[sizeof(AOF_MAGIC)];
+    size_t got = fread(magic, 1, sizeof(magic), file);
+    long good = 0;
+    unsigned long records = 0;
+    int resume = Q->logId == logId && Q->logOffset >= sizeof(magic) && Q->logOffset <= (uint64_t) st.st_size;
+    if (got == sizeof(magic) && memcmp(magic, AOF_MAGIC, sizeof(magic)) == 0) {
+        if (resume) {
+            fseek(file, (long) Q->logOffset, SEEK_SET);
+        } else if ((Q->restored || Q->logId != 0) && (uint64_t) st.st_size > sizeof(magic)) {
+            printf("aof: the store was not checkpointed or snapshotted with %s, replaying all of it on top\n", path);
+        }
+        good = replay(file, Q, &records);
+    } else if (got > 0 && (got == sizeof(magic) || memcmp(magic, AOF_MAGIC, got) != 0)) {
+        fprintf(stderr, "%s IS NOT AN APPEND-ONLY FILE!\n", path);
+        fclose(file);
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+
+    if (good == 0) {
+        if (ftruncate(aofFd, 0) < 0 || writeAll(aofFd, AOF_MAGIC, sizeof(AOF_MAGIC)) < 0 || fdatasync(aofFd) < 0) {
+            return EXIT_FAILURE;
+        }
+        good = sizeof(AOF_MAGIC);
+    } else if (good < size) {
+        // a crash in the middle of a write. everything before it is fine
+        printf("aof: dropping %ld bytes of a torn or corrupt record at the end of %s\n", size - good, path);
+        if (ftruncate(aofFd, good) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    fileEnd = logStart = (uint64_t) good;
+    if (records > 0) {
+        double seconds = (nowMs() - start) / 1e3;
+        printf("aof: replayed %lu changes from %s%s in %.2f s, %u keys stored\n", records, path,
+               resume ? (Q->restored ? " after the checkpoint" : " after the snapshot") : "", seconds, queue_count(Q));
+    }
+
+    fsyncPolicy = policy;
+    running = 1;
+    if (pthread_create(&flusher, NULL, aofFlusher, NULL) != 0) {
+        running = 0;
+        return EXIT_FAILURE;
+    }
+    queue_set_journal(Q, aof_append, NULL);
+    return EXIT_SUCCESS;
+}
+
+// writes and syncs whatever is still buffered and stops the flusher. changes made after this are not logged.
+void aof_shutdown(void) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_broadcast(&wake);
+    pthread_cond_broadcast(&room);
+    pthread_cond_broadcast(&synced);
+    pthread_mutex_unlock(&lock);
+    pthread_join(flusher, NULL);
+    if (fsyncPolicy != AOF_FSYNC_NEVER) {
+        fdatasync(aofFd);
+    }
+    off_t end = lseek(aofFd, 0, SEEK_END);
+    logEnd = end > 0 ? (uint64_t) end : 0;
+    close(aofFd);
+    aofFd = -1;
+}
+
+// a number that tells the open file from other files, 0 if none was opened. a store checkpoint records it along with
+// aof_log_end(), so the next start knows which file the checkpoint has seen how much of.
+uint64_t aof_log_id(void) {
+    return logId;
+}
+
+// where in the file the next change will be logged, so a snapshot of the store as it is now holds the file up to
+// there. the caller must hold every shard lock, so no change is half logged. 0 without a file, or once the file is
+// broken and no longer holds every change.
+uint64_t aof_log_position(void) {
+    pthread_mutex_lock(&lock);
+    uint64_t position = running && !broken ? logStart + appended : 0;
+    pthread_mutex_unlock(&lock);
+    return position;
+}
+
+// bytes in the file after aof_shutdown(), every change logged included.
+uint64_t aof_log_end(void) {
+    return logEnd;
+}
+
+// ------------------------------- END OF PERSISTENCE -------------------------------
@@ -0,0 +1,58 @@
+/*
+ * HashServer persistence -- an append-only file of every change clients make, replayed at startup.
+ *
+ * IMPLEMENTATION AND SHORT DESCRIPTION:
+ *      The store calls aof_append() for every SET, SETEX, DEL and EXPIRE it carries out, while it still holds the shard
+ *      lock, so the changes to any one key are logged in the order they happened. aof_append() only copies the record
+ *      into a buffer in memory. A background flusher thread takes everything in the buffer, writes it to the file in
+ *      one write() and, depending on the fsync policy, fsyncs it:
+ *
+ *          always      after every write. Workers hold back their replies to changes until the change is on disk
+ *                      (aof_wait()), but every change that came in while the last fsync was running goes out in the
+ *                      next one, so the whole server shares one fsync per disk round-trip (group commit) rather than
+ *                      paying one per request.
+ *          N (ms)      at most every N milliseconds. Replies never wait; a crash of the machine loses at most the
+ *                      last N ms of changes.
+ *          never       never. The operating system writes the file out when it likes.
+ *
+ *      Whatever the policy, the buffer is written out every few milliseconds, so if only the server process dies
+ *      (and not the machine) next to nothing is lost. If a write or an fsync fails (a full disk, say), the file is cut
+ *      back to the last whole record and nothing more is logged, and the same goes for running out of memory for the
+ *      buffer: the changes from then on never become durable, so with "always" aof_wait() fails and their replies are
+ *      never sent.
+ *
+ *      The file starts with an 8 byte magic, followed by records: a header (checksum, operation, key and value length,
+ *      expiry time) in native byte order, then the key and the value. At startup aof_open() replays the records into
+ *      the store and cuts off a torn or corrupt tail, which is what a crash in the middle of a write leaves behind.
+ *      The file is never compacted, it only ever grows. A snapshot, and the checkpoint of a store kept in a file (see
+ *      queue.h), remember which log they were taken with and how far into it they go (aof_log_position()), and only
+ *      the records after that are replayed on top of them.
+ */
+
+#ifndef HASHSERVER_AOF_H
+#define HASHSERVER_AOF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "queue.h"
+
+// Define parameters
+#define AOF_FSYNC_ALWAYS -1
+#define AOF_FSYNC_NEVER 0     // anything above is the most milliseconds between fsyncs
+#define AOF_FSYNC_DEFAULT 1000
+#define AOF_MAX_BUFFER (64u << 20)  // bytes of records waiting for the flusher after which clients wait instead
+
+// Method definitions
+int aof_open(const char *path, int policy, struct queue *Q);
+int aof_parse_policy(const char *text);
+void aof_append(void *arguements, int op, const char *key, size_t keyLen, const char *value, size_t valueLen,
+                uint32_t expire);
+uint64_t aof_thread_lsn(void);
+int aof_durable(uint64_t lsn);
+int aof_wait(uint64_t lsn);
+void aof_shutdown(void);
+uint64_t aof_log_id(void);
+uint64_t aof_log_position(void);
+uint64_t aof_log_end(void);
+
+#endif
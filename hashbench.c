@@ -0,0 +1,704 @@
+/*
+ * hashbench -- network load generator for HashServer.
+ *
+ * Every client thread opens one connection. The connections first SET every key of the key space between them, then
+ * each sends its share of a mix of GETs, SETs and DELs over the whole key space, picking keys uniformly or from a
+ * Zipfian distribution (a few keys get most of the requests, like a real cache). A key's value is always the same
+ * bytes, so every reply has exactly one right answer (or KNF, once DELs are in the mix) and the run fails if a reply
+ * is missing, out of order or wrong.
+ *
+ * Closed loop (the default): commands go out [depth] at a time in a single write, and the replies are read back before
+ * the next batch, so "-d 1000" keeps a 1000-deep pipeline in flight on every connection. Latency is from a batch being
+ * written to each reply arriving. A closed loop never sends faster than the server answers, so a stalled server makes
+ * it send less instead of making it wait: its percentiles hide stalls (coordinated omission).
+ *
+ * Open loop ("-R rate"): every connection gets a sender thread that sends requests on a fixed schedule, rate divided
+ * evenly over the connections, no matter how far behind the replies are (up to [depth] in flight, after which it
+ * waits). The client thread reads the replies. Latency is measured from when a request was due to be sent, not from
+ * when it went out, so time a request spent waiting behind a stalled server counts against it: these are the
+ * coordinated-omission-corrected numbers. The uncorrected ones, from the actual send, are printed next to them.
+ *
+ * "-P binary" talks the binary protocol (see protocol.h) instead of the text one, and "-P compare" does the whole run
+ * twice, in text and then in binary, and prints how their throughput compares.
+ *
+ * USAGE: ./hashbench [-h host] [-p port] [-c connections] [-d depth] [-n requests] [-k keys] [-v value size]
+ *                    [-r get percent] [-x del percent] [-z zipf theta] [-R requests per second]
+ *                    [-P text|binary|compare]
+ */
+
+// Imports
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <endian.h>
+#include "hist.h"
+#include "protocol.h"
+
+#define BENCH_MAX_CONNS 1024
+#define BENCH_MAX_DEPTH 100000
+#define BENCH_MAX_VALUE (1u << 20)
+#define BENCH_LINE 256      // longest key or status line we expect
+#define BENCH_READ 65536
+
+#define OP_SET 0
+#define OP_GET 1
+#define OP_DEL 2
+
+// YCSB's Zipfian generator (Gray et al., "Quickly Generating Billion-Record Synthetic Databases"). key 0 is the most
+// popular, key 1 the next and so on.
+struct zipf {
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+    unsigned keys;
+};
+
+// how the run is set up. read only once the clients are started
+struct bench_config {
+    const char *host;
+    const char *port;
+    unsigned conns;
+    unsigned depth;
+    unsigned long requests;     // per connection
+    unsigned keys;              // shared by all connections
+    unsigned valueSize;
+    unsigned getPercent;
+    unsigned delPercent;
+    double theta;               // 0 for uniform keys
+    double rate;                // requests per second over all connections, 0 for a closed loop
+    int binary;                 // talk the binary protocol
+    struct zipf zipf;
+    pthread_barrier_t loaded;   // every client has SET its share of the keys
+    double start;               // when the measured part of the run began
+};
+
+// one request in flight on an open loop connection
+struct flight {
+    unsigned key;
+    int op;
+    double due;     // when the schedule said to send it
+    double sent;    // when it was written
+};
+
+// holds arguements for one client thread, plus what it measured
+struct client_args {
+    struct bench_config *config;
+    unsigned id;
+    int fd;
+    unsigned long done;
+    unsigned long errors;
+    struct hist corrected;      // ns from when each request was due. only filled in by an open loop
+    struct hist measured;       // ns from when each request was written
+    struct flight *flights;     // open loop: ring of depth requests the sender has written and the client not yet read
+    unsigned long head;         // written by the sender
+    unsigned long tail;         // written by the client
+};
+
+// buffered reader over the socket, replies arrive in arbitrary chunks
+struct reader {
+    int fd;
+    char buf[BENCH_READ];
+    size_t start;
+    size_t end;
+};
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void sleepUntil(double when) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) (when / 1e9);
+    ts.tv_nsec = (long) (when - ts.tv_sec * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+// xorshift64*, a uniform double in [0, 1)
+static double nextRandom(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (double) ((*state * 0x2545F4914F6CDD1Dull) >> 11) / 9007199254740992.0;
+}
+
+// ------------------------------- KEYS -------------------------------
+
+static void zipfInit(struct zipf *Z, unsigned keys, double theta) {
+    Z->keys = keys;
+    Z->theta = theta;
+    Z->zetan = 0;
+    for (unsigned i = 1; i <= keys; i++) {
+        Z->zetan += 1.0 / pow(i, theta);
+    }
+    double zeta2 = 1.0 + 1.0 / pow(2, theta);
+    Z->alpha = 1.0 / (1.0 - theta);
+    Z->eta = (1.0 - pow(2.0 / keys, 1.0 - theta)) / (1.0 - zeta2 / Z->zetan);
+}
+
+static unsigned zipfNext(const struct zipf *Z, double u) {
+    double uz = u * Z->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, Z->theta)) {
+        return Z->keys > 1 ? 1 : 0;
+    }
+    unsigned key = (unsigned) (Z->keys * pow(Z->eta * u - Z->eta + 1.0, Z->alpha));
+    return key < Z->keys ? key : Z->keys - 1;
+}
+
+// picks the next request's key and command
+static void nextRequest(const struct bench_config *config, uint64_t *seed, unsigned *key, int *op) {
+    double u = nextRandom(seed);
+    *key = config->theta > 0 ? zipfNext(&config->zipf, u) : (unsigned) (u * config->keys);
+    unsigned percent = (unsigned) (nextRandom(seed) * 100);
+    *op = percent < config->getPercent ? OP_GET : percent < config->getPercent + config->delPercent ? OP_DEL : OP_SET;
+}
+
+static size_t makeKey(char *buff, unsigned i) {
+    return snprintf(buff, BENCH_LINE, "bench:%u", i);
+}
+
+// every key's value is "v<key>:" padded with x's to the value size, the same bytes whoever SETs it
+static void makeValue(char *buff, unsigned i, unsigned size) {
+    int n = snprintf(buff, BENCH_LINE, "v%u:", i);
+    if ((unsigned) n < size) {
+        memset(buff + n, 'x', size - n);
+    }
+    buff[size] = '\0';
+}
+
+// ------------------------------- TALKING TO THE SERVER -------------------------------
+
+static int connectTo(const char *host, const char *port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int readByte(struct reader *rd, char *ch) {
+    while (rd->start == rd->end) {
+        ssize_t r = read(rd->fd, rd->buf, sizeof(rd->buf));
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        rd->start = 0;
+        rd->end = r;
+    }
+    *ch = rd->buf[rd->start++];
+    return 0;
+}
+
+// reads one reply line into line without its newline. NUL bytes are skipped, older servers pad the length line with
+// them. returns -1 if the connection ended.
+static int readLine(struct reader *rd, char *line) {
+    size_t n = 0;
+    for (;;) {
+        char ch;
+        if (readByte(rd, &ch) < 0) {
+            return -1;
+        }
+        if (ch == '\n') {
+            line[n] = '\0';
+            return 0;
+        }
+        if (ch != '\0' && n < BENCH_LINE - 1) {
+            line[n++] = ch;
+        }
+    }
+}
+
+// reads len bytes and says whether they are value followed by a newline. returns -1 if the connection ended.
+static int readValue(struct reader *rd, const char *value, size_t len) {
+    int bad = len != strlen(value) + 1;
+    for (size_t i = 0; i < len; i++) {
+        char ch;
+        if (readByte(rd, &ch) < 0) {
+            return -1;
+        }
+        if (!bad && ch != (i + 1 < len ? value[i] : '\n')) {
+            bad = 1;
+        }
+    }
+    return bad;
+}
+
+// reads len bytes into buff. returns -1 if the connection ended.
+static int readBytes(struct reader *rd, char *buff, size_t len) {
+    while (len > 0) {
+        if (rd->start == rd->end) {
+            // readByte() refills the buffer
+            if (readByte(rd, buff) < 0) {
+                return -1;
+            }
+            ++buff;
+            --len;
+            continue;
+        }
+        size_t n = rd->end - rd->start < len ? rd->end - rd->start : len;
+        memcpy(buff, rd->buf + rd->start, n);
+        rd->start += n;
+        buff += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// appends one binary request to out and returns its length. the opaque field carries the key, see checkBinary()
+static size_t appendBinary(char *out, int op, unsigned k, const char *key, size_t keyLen, const char *value,
+                           size_t valueLen) {
+    if (op != OP_SET) {
+        valueLen = 0;
+    }
+    uint16_t keyLen16 = htole16((uint16_t) keyLen);
+    uint32_t valueLen32 = htole32((uint32_t) valueLen);
+    uint32_t opaque = htole32(k);
+    memset(out, 0, PROTOCOL_HEADER);
+    out[PROTOCOL_MAGIC] = (char) PROTOCOL_REQUEST;
+    out[PROTOCOL_OPCODE] = (char) (op == OP_SET ? PROTOCOL_SET : op == OP_GET ? PROTOCOL_GET : PROTOCOL_DEL);
+    memcpy(out + PROTOCOL_KEY_LEN, &keyLen16, sizeof(keyLen16));
+    memcpy(out + PROTOCOL_VALUE_LEN, &valueLen32, sizeof(valueLen32));
+    memcpy(out + PROTOCOL_OPAQUE, &opaque, sizeof(opaque));
+    memcpy(out + PROTOCOL_HEADER, key, keyLen);
+    memcpy(out + PROTOCOL_HEADER + keyLen, value, valueLen);
+    return PROTOCOL_HEADER + keyLen + valueLen;
+}
+
+// reads the binary reply to one request for key k and checks it, like checkReply()
+static int checkBinary(const struct bench_config *config, struct reader *rd, int op, unsigned k, const char *value) {
+    char header[PROTOCOL_HEADER];
+    if (readBytes(rd, header, sizeof(header)) < 0) {
+        return -1;
+    }
+    uint16_t status;
+    uint32_t len, opaque;
+    memcpy(&status, header + PROTOCOL_STATUS, sizeof(status));
+    memcpy(&len, header + PROTOCOL_VALUE_LEN, sizeof(len));
+    memcpy(&opaque, header + PROTOCOL_OPAQUE, sizeof(opaque));
+    status = le16toh(status);
+    len = le32toh(len);
+    int bad = (unsigned char) header[PROTOCOL_MAGIC] != PROTOCOL_RESPONSE || le32toh(opaque) != k;
+    if (len > BENCH_MAX_VALUE) {
+        return 1;   // can't be ours, and we'd never find the next reply anyway
+    }
+    if (op == OP_SET) {
+        bad |= status != PROTOCOL_OK || len != 0;
+    } else if (status == PROTOCOL_KNF) {
+        bad |= config->delPercent == 0 || len != 0;
+    } else {
+        bad |= status != PROTOCOL_OK || len != strlen(value);
+    }
+    // the value is read even if the reply is already wrong, so the next one starts where it should
+    for (uint32_t i = 0; i < len; i++) {
+        char ch;
+        if (readByte(rd, &ch) < 0) {
+            return -1;
+        }
+        if (!bad && ch != value[i]) {
+            bad = 1;
+        }
+    }
+    return bad;
+}
+
+// appends one command to out and returns its length
+static size_t appendCommand(char *out, int op, const char *key, size_t keyLen, const char *value, size_t valueLen) {
+    if (op == OP_SET) {
+        size_t len = sprintf(out, "SET\n%zu\n%s\n", keyLen + valueLen + 2, key);
+        memcpy(out + len, value, valueLen);
+        out[len + valueLen] = '\n';
+        return len + valueLen + 1;
+    }
+    return sprintf(out, "%s\n%zu\n%s\n", op == OP_GET ? "GET" : "DEL", keyLen + 1, key);
+}
+
+// reads the reply to one command and checks it. returns 0 if it is what we expected, 1 if it is wrong, -1 if the
+// connection ended. a key may only be missing if the run DELs keys.
+static int checkReply(const struct bench_config *config, struct reader *rd, int op, const char *value) {
+    char line[BENCH_LINE];
+    if (readLine(rd, line) < 0) {
+        return -1;
+    }
+    if (op == OP_SET) {
+        return strcmp(line, "OKS") != 0;
+    }
+    if (strcmp(line, "KNF") == 0) {
+        return config->delPercent == 0;
+    }
+    if (strcmp(line, op == OP_GET ? "OKG" : "OKD") != 0) {
+        return 1;
+    }
+    if (readLine(rd, line) < 0) {
+        return -1;
+    }
+    return readValue(rd, value, strtoul(line, NULL, 10));
+}
+
+// writes the given commands, out is big enough for all of them. returns bytes written or -1
+static int sendCommands(int fd, int binary, char *out, char *value, unsigned valueSize, const unsigned *keys,
+                        const int *ops, unsigned count) {
+    char key[BENCH_LINE];
+    size_t len = 0;
+    for (unsigned i = 0; i < count; i++) {
+        size_t keyLen = makeKey(key, keys[i]);
+        if (ops[i] == OP_SET) {
+            makeValue(value, keys[i], valueSize);
+        }
+        len += binary ? appendBinary(out + len, ops[i], keys[i], key, keyLen, value, valueSize)
+                      : appendCommand(out + len, ops[i], key, keyLen, value, valueSize);
+    }
+    return writeAll(fd, out, len);
+}
+
+// sends count commands in one write and checks their replies in order
+static int runBatch(struct client_args *args, struct reader *rd, char *out, char *value, unsigned *keys, int *ops,
+                    unsigned count) {
+    const struct bench_config *config = args->config;
+    double sent = nowNs();
+    if (sendCommands(rd->fd, config->binary, out, value, config->valueSize, keys, ops, count) < 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        makeValue(value, keys[i], config->valueSize);
+        int bad = config->binary ? checkBinary(config, rd, ops[i], keys[i], value)
+                                 : checkReply(config, rd, ops[i], value);
+        if (bad < 0) {
+            return -1;
+        }
+        hist_record(&args->measured, (uint64_t) (nowNs() - sent));
+        args->errors += bad;
+        ++args->done;
+    }
+    return 0;
+}
+
+// ------------------------------- CLIENTS -------------------------------
+
+// open loop sender. writes each request when it is due, or at once if it is already late, a whole backlog in one
+// write. only waits when depth requests are already in flight.
+static void * sender(void *arguements) {
+    struct client_args *args = (struct client_args *) arguements;
+    const struct bench_config *config = args->config;
+    double interval = 1e9 * config->conns / config->rate;
+    char *out = malloc((size_t) config->depth * (config->valueSize + 2 * BENCH_LINE));
+    char *value = malloc(config->valueSize + BENCH_LINE);
+    unsigned *keys = malloc(config->depth * sizeof(unsigned));
+    int *ops = malloc(config->depth * sizeof(int));
+    if (out == NULL || value == NULL || keys == NULL || ops == NULL) {
+        perror("out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t seed = 0x9E3779B97F4A7C15ull * (args->id + 1);
+    // connections start out of step with each other, so the server sees an even stream rather than bursts
+    double start = config->start + interval * args->id / config->conns;
+    for (unsigned long sent = 0; sent < config->requests; ) {
+        double due = start + interval * sent;
+        sleepUntil(due);
+        unsigned long tail = __atomic_load_n(&args->tail, __ATOMIC_ACQUIRE);
+        if (sent - tail >= config->depth) {
+            struct timespec pause = {0, 10000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        double now = nowNs();
+        unsigned count = 0;
+        while (sent + count < config->requests && sent + count - tail < config->depth &&
+               start + interval * (sent + count) <= now) {
+            struct flight *f = &args->flights[(sent + count) % config->depth];
+            nextRequest(config, &seed, &f->key, &f->op);
+            f->due = start + interval * (sent + count);
+            f->sent = now;
+            keys[count] = f->key;
+            ops[count] = f->op;
+            ++count;
+        }
+        // the client may see the replies before write() returns, so the requests are published first
+        __atomic_store_n(&args->head, sent + count, __ATOMIC_RELEASE);
+        if (sendCommands(args->fd, config->binary, out, value, config->valueSize, keys, ops, count) < 0) {
+            break;  // the client notices the connection is gone
+        }
+        sent += count;
+    }
+
+    free(out);
+    free(value);
+    free(keys);
+    free(ops);
+    return NULL;
+}
+
+// open loop client: reads the replies to whatever the sender wrote
+static int openLoop(struct client_args *args, struct reader *rd, char *value) {
+    const struct bench_config *config = args->config;
+    args->flights = malloc(config->depth * sizeof(struct flight));
+    if (args->flights == NULL) {
+        perror("out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t t;
+    if (pthread_create(&t, NULL, sender, args) != 0) {
+        perror("sender thread error!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned long i = 0; i < config->requests; i++) {
+        while (__atomic_load_n(&args->head, __ATOMIC_ACQUIRE) == i) {
+            struct timespec pause = {0, 10000};
+            nanosleep(&pause, NULL);
+        }
+        struct flight f = args->flights[i % config->depth];
+        makeValue(value, f.key, config->valueSize);
+        int bad = config->binary ? checkBinary(config, rd, f.op, f.key, value) : checkReply(config, rd, f.op, value);
+        if (bad < 0) {
+            return -1;
+        }
+        double now = nowNs();
+        hist_record(&args->corrected, (uint64_t) (now - f.due));
+        hist_record(&args->measured, (uint64_t) (now - f.sent));
+        args->errors += bad;
+        ++args->done;
+        __atomic_store_n(&args->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(t, NULL);
+    free(args->flights);
+    return 0;
+}
+
+static void * client(void *arguements) {
+    struct client_args *args = (struct client_args *) arguements;
+    struct bench_config *config = args->config;
+    struct reader *rd = calloc(1, sizeof(struct reader));
+    char *out = malloc((size_t) config->depth * (config->valueSize + 2 * BENCH_LINE));
+    char *value = malloc(config->valueSize + BENCH_LINE);
+    unsigned *keys = malloc(config->depth * sizeof(unsigned));
+    int *ops = malloc(config->depth * sizeof(int));
+    if (rd == NULL || out == NULL || value == NULL || keys == NULL || ops == NULL) {
+        perror("out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    rd->fd = args->fd = connectTo(config->host, config->port);
+    if (rd->fd < 0) {
+        perror("connect error!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // every key gets its value first, each connection SETting its own slice of the key space
+    unsigned from = (unsigned) ((unsigned long long) config->keys * args->id / config->conns);
+    unsigned to = (unsigned) ((unsigned long long) config->keys * (args->id + 1) / config->conns);
+    for (unsigned k = from; k < to; k += config->depth) {
+        unsigned count = to - k < config->depth ? to - k : config->depth;
+        for (unsigned i = 0; i < count; i++) {
+            keys[i] = k + i;
+            ops[i] = OP_SET;
+        }
+        if (runBatch(args, rd, out, value, keys, ops, count) < 0) {
+            goto lost;
+        }
+    }
+    args->done = 0;
+    memset(&args->measured, 0, sizeof(args->measured));
+    if (pthread_barrier_wait(&config->loaded) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        config->start = nowNs();
+    }
+    pthread_barrier_wait(&config->loaded);  // so everybody sees start
+
+    if (config->rate > 0) {
+        if (openLoop(args, rd, value) < 0) {
+            goto lost;
+        }
+    } else {
+        uint64_t seed = 0x9E3779B97F4A7C15ull * (args->id + 1);
+        for (unsigned long sent = 0; sent < config->requests; ) {
+            unsigned count = config->requests - sent < config->depth ? (unsigned) (config->requests - sent)
+                                                                    : config->depth;
+            for (unsigned i = 0; i < count; i++) {
+                nextRequest(config, &seed, &keys[i], &ops[i]);
+            }
+            if (runBatch(args, rd, out, value, keys, ops, count) < 0) {
+                goto lost;
+            }
+            sent += count;
+        }
+    }
+
+    close(rd->fd);
+    free(rd);
+    free(out);
+    free(value);
+    free(keys);
+    free(ops);
+    return NULL;
+
+lost:
+    fprintf(stderr, "client %u: server closed the connection!\n", args->id);
+    exit(EXIT_FAILURE);
+}
+
+// ------------------------------- REPORT -------------------------------
+
+static void printLatency(const char *name, const struct hist *H) {
+    printf("%-12s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, hist_percentile(H, 50) / 1e3,
+           hist_percentile(H, 90) / 1e3, hist_percentile(H, 99) / 1e3, hist_percentile(H, 99.9) / 1e3,
+           hist_percentile(H, 99.99) / 1e3, H->max / 1e3);
+}
+
+// does one whole run with config and prints its report. returns its requests per second, and adds its bad replies to
+// errors.
+static double benchRun(struct bench_config *config, unsigned long *errors) {
+    pthread_barrier_init(&config->loaded, NULL, config->conns);
+    pthread_t t[BENCH_MAX_CONNS];
+    struct client_args *args = calloc(config->conns, sizeof(struct client_args));
+    struct hist *corrected = calloc(1, sizeof(struct hist));
+    struct hist *measured = calloc(1, sizeof(struct hist));
+    if (args == NULL || corrected == NULL || measured == NULL) {
+        perror("out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < config->conns; i++) {
+        args[i].config = config;
+        args[i].id = i;
+        if (pthread_create(&t[i], NULL, client, &args[i]) != 0) {
+            perror("client thread error!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned long done = 0, bad = 0;
+    for (unsigned i = 0; i < config->conns; i++) {
+        pthread_join(t[i], NULL);
+        done += args[i].done;
+        bad += args[i].errors;
+        hist_merge(corrected, &args[i].corrected);
+        hist_merge(measured, &args[i].measured);
+    }
+    double seconds = (nowNs() - config->start) / 1e9;
+
+    char keys[64];
+    if (config->theta > 0) {
+        snprintf(keys, sizeof(keys), "zipf %.2f", config->theta);
+    } else {
+        snprintf(keys, sizeof(keys), "uniform");
+    }
+    printf("%s protocol, %u connections, pipeline depth %u, %u keys (%s), %u byte values, %u%% GET %u%% DEL, ",
+           config->binary ? "binary" : "text", config->conns, config->depth, config->keys, keys, config->valueSize,
+           config->getPercent, config->delPercent);
+    if (config->rate > 0) {
+        printf("open loop at %.0f requests/s\n", config->rate);
+    } else {
+        printf("closed loop\n");
+    }
+    printf("%lu requests in %.2f s, %.0f requests/s, %lu bad replies\n", done, seconds, done / seconds, bad);
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n", "latency us", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    if (config->rate > 0) {
+        printLatency("corrected", corrected);
+        printLatency("uncorrected", measured);
+    } else {
+        printLatency("per request", measured);
+    }
+
+    free(corrected);
+    free(measured);
+    free(args);
+    pthread_barrier_destroy(&config->loaded);
+    *errors += bad;
+    return done / seconds;
+}
+
+int main(int argc, char *argv[argc]) {
+    struct bench_config config = {.host = "127.0.0.1", .port = "18000", .conns = 1, .depth = 1, .requests = 100000,
+                                  .keys = 1000, .valueSize = 16, .getPercent = 90};
+    const char *protocol = "text";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:d:n:k:v:r:x:z:R:P:")) != -1) {
+        switch (opt) {
+            case 'h': config.host = optarg; break;
+            case 'p': config.port = optarg; break;
+            case 'c': config.conns = (unsigned) atoi(optarg); break;
+            case 'd': config.depth = (unsigned) atoi(optarg); break;
+            case 'n': config.requests = strtoul(optarg, NULL, 10); break;
+            case 'k': config.keys = (unsigned) atoi(optarg); break;
+            case 'v': config.valueSize = (unsigned) atoi(optarg); break;
+            case 'r': config.getPercent = (unsigned) atoi(optarg); break;
+            case 'x': config.delPercent = (unsigned) atoi(optarg); break;
+            case 'z': config.theta = atof(optarg); break;
+            case 'R': config.rate = atof(optarg); break;
+            case 'P': protocol = optarg; break;
+            default:
+                fprintf(stderr, "USAGE: %s [-h host] [-p port] [-c connections] [-d depth] [-n requests] [-k keys] "
+                                "[-v value size] [-r get percent] [-x del percent] [-z zipf theta] "
+                                "[-R requests per second] [-P text|binary|compare]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    int compare = strcmp(protocol, "compare") == 0;
+    if (config.conns < 1 || config.conns > BENCH_MAX_CONNS || config.depth < 1 || config.depth > BENCH_MAX_DEPTH ||
+        config.keys < config.conns || config.valueSize < 1 || config.valueSize > BENCH_MAX_VALUE ||
+        config.getPercent + config.delPercent > 100 || config.theta < 0 || config.theta >= 1 || config.rate < 0 ||
+        (!compare && strcmp(protocol, "text") != 0 && strcmp(protocol, "binary") != 0)) {
+        fprintf(stderr, "bad arguements!\n");
+        return EXIT_FAILURE;
+    }
+    if (config.theta > 0) {
+        zipfInit(&config.zipf, config.keys, config.theta);
+    }
+
+    unsigned long errors = 0;
+    config.binary = strcmp(protocol, "binary") == 0;
+    double rate = benchRun(&config, &errors);
+    if (compare) {
+        // the same run again, binary this time
+        printf("\n");
+        config.binary = 1;
+        double binaryRate = benchRun(&config, &errors);
+        printf("\nbinary %.0f requests/s, text %.0f requests/s: binary is %.2fx text\n", binaryRate, rate,
+               binaryRate / rate);
+    }
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,55 @@
+/*
+ * HashServer latency histograms -- see hist.h for the bucket layout.
+ */
+
+// Imports
+#include "hist.h"
+
+// adds from into into. from may be another thread's histogram that is still being recorded into.
+void hist_merge(struct hist *into, const struct hist *from) {
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max) {
+        into->max = max;
+    }
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+// largest value that lands in the bucket
+uint64_t hist_bucket_high(unsigned bucket) {
+    unsigned group = bucket >> HIST_SUB_BITS;
+    if (group == 0) {
+        return bucket;
+    }
+    unsigned shift = group - 1;
+    uint64_t low = (uint64_t) ((1u << HIST_SUB_BITS) | (bucket & ((1u << HIST_SUB_BITS) - 1))) << shift;
+    return low + (1ull << shift) - 1;
+}
+
+// smallest value that at least percent of the recorded values are no larger than, to within a bucket. reported as
+// the top of its bucket, but never above the largest value recorded. 0 for an empty histogram.
+uint64_t hist_percentile(const struct hist *H, double percent) {
+    unsigned long total = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        total += H->buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    double wanted = total * percent / 100.0;
+    unsigned long rank = (unsigned long) wanted;
+    if (rank < wanted || rank == 0) {
+        ++rank;     // round up: p50 of 3 values is the 2nd
+    }
+    unsigned long seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += H->buckets[i];
+        if (seen >= rank) {
+            uint64_t high = hist_bucket_high(i);
+            return high < H->max ? high : H->max;
+        }
+    }
+    return H->max;
+}
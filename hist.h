@@ -0,0 +1,56 @@
+/*
+ * HashServer latency histograms -- HDR-style, log-linear buckets with a fixed relative error.
+ *
+ * IMPLEMENTATION AND SHORT DESCRIPTION:
+ *      Values below 32 get a bucket each. Above that, every power of two is split into 32 equal buckets, so a bucket
+ *      is never wider than 1/32 (about 3%) of the values in it, whether they are microseconds or seconds. Recording a
+ *      value is a count-leading-zeros, a shift and two increments, cheap enough to do for every request.
+ *
+ *      A histogram belongs to one thread, which is the only one that records into it. Anybody may read it at any time
+ *      through hist_merge(), which loads every bucket on its own; a reader racing the owner can be off by the values
+ *      being recorded at that moment, which is fine for statistics.
+ */
+
+#ifndef HASHSERVER_HIST_H
+#define HASHSERVER_HIST_H
+
+#include <stdint.h>
+
+// Define parameters
+#define HIST_SUB_BITS 5     // 32 buckets per power of two
+#define HIST_MAX_BITS 36    // largest value kept apart is 2^36 - 1 (about 69 seconds in ns). anything above joins it
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+    unsigned long count;
+    uint64_t max;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+// bucket value v falls into
+static inline unsigned hist_bucket(uint64_t v) {
+    if (v >= (1ull << HIST_MAX_BITS)) {
+        v = (1ull << HIST_MAX_BITS) - 1;
+    }
+    if (v < (1u << HIST_SUB_BITS)) {
+        return (unsigned) v;
+    }
+    unsigned top = 63 - __builtin_clzll(v);
+    unsigned shift = top - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) | (unsigned) ((v >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+static inline void hist_record(struct hist *H, uint64_t v) {
+    ++H->count;
+    ++H->buckets[hist_bucket(v)];
+    if (v > H->max) {
+        H->max = v;
+    }
+}
+
+// Method definitions
+void hist_merge(struct hist *into, const struct hist *from);
+uint64_t hist_bucket_high(unsigned bucket);
+uint64_t hist_percentile(const struct hist *H, double percent);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * HashServer logging -- see log.h for how the rings work.
+ */
+
+// Imports
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+
+#define LOG_INTERVAL_NS 10000000    // writer nap between passes over the rings (10ms)
+
+// one formatted message waiting for the writer
+struct log_record {
+    struct timespec when;
+    int level;
+    char text[LOG_LINE];
+};
+
+// one thread's records. head is only ever written by that thread, tail and reported only by the writer
+struct log_ring {
+    struct log_record records[LOG_RING];
+    unsigned head;          // records written so far
+    unsigned tail;          // records the writer has taken so far
+    unsigned long dropped;  // records lost to a full ring
+    unsigned long reported; // how many of those the writer has owned up to
+    unsigned id;
+    struct log_ring *next;  // next older ring. rings are never freed, a thread may log until the process exits
+};
+
+int logLevel = LOG_LEVEL_WARN;
+
+static const char *levelNames[] = {"off", "error", "warn", "info", "debug"};
+static FILE *logFile;
+static struct log_ring *rings;  // newest first
+static unsigned ringCount;
+static __thread struct log_ring *ring;
+static pthread_t writer;
+static int writerRunning;
+
+// ------------------------------- WRITING LINES -------------------------------
+
+// the calling thread's ring, made the first time it logs. NULL if we ran out of memory.
+static struct log_ring *ringGet(void) {
+    if (ring == NULL) {
+        struct log_ring *R = calloc(1, sizeof(struct log_ring));
+        if (R == NULL) {
+            return NULL;
+        }
+        R->id = __atomic_add_fetch(&ringCount, 1, __ATOMIC_RELAXED);
+        R->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &R->next, R, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        ring = R;
+    }
+    return ring;
+}
+
+// formats one message into the calling thread's ring. use LOG(), which skips all of this for a disabled level.
+void log_write(int level, const char *format, ...) {
+    struct log_ring *R = ringGet();
+    if (R == NULL) {
+        return;
+    }
+    unsigned head = R->head;
+    if (head - __atomic_load_n(&R->tail, __ATOMIC_ACQUIRE) == LOG_RING) {
+        __atomic_store_n(&R->dropped, R->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct log_record *record = &R->records[head & (LOG_RING - 1)];
+    clock_gettime(CLOCK_REALTIME, &record->when);
+    record->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text, LOG_LINE, format, args);
+    va_end(args);
+    __atomic_store_n(&R->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// makes len bytes of client data (a key, say) safe to put between the quotes of a "key=value" pair, so a newline,
+// quote or "name=value" inside it can neither break the line nor forge another pair: bytes outside printable ASCII,
+// quotes and backslashes become \xHH. only the first LOG_QUOTE_MAX bytes are shown, "..." marks the cut. out needs
+// LOG_QUOTE_SIZE bytes. returns out, so it can be an arguement of LOG() and only costs anything if the line is logged.
+const char * log_quote(char *out, const char *data, size_t len) {
+    static const char hexits[] = "0123456789abcdef";
+    size_t shown = len < LOG_QUOTE_MAX ? len : LOG_QUOTE_MAX;
+    size_t n = 0;
+    for (size_t i = 0; i < shown; i++) {
+        unsigned char ch = (unsigned char) data[i];
+        if (ch >= 0x20 && ch < 0x7F && ch != '"' && ch != '\\') {
+            out[n++] = (char) ch;
+        } else {
+            out[n++] = '\\';
+            out[n++] = 'x';
+            out[n++] = hexits[ch >> 4];
+            out[n++] = hexits[ch & 0x0F];
+        }
+    }
+    if (shown < len) {
+        memcpy(out + n, "...", 3);
+        n += 3;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+// ------------------------------- BACKGROUND WRITER -------------------------------
+
+static void writeLine(const struct timespec *when, int level, unsigned thread, const char *text) {
+    struct tm tm;
+    char stamp[32];
+    gmtime_r(&when->tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(logFile, "time=%s.%06ldZ level=%s thread=%u %s\n", stamp, when->tv_nsec / 1000, levelNames[level], thread,
+            text);
+}
+
+// copies every record the rings hold to the log file. returns lines written.
+static unsigned drainRings(void) {
+    unsigned written = 0;
+    for (struct log_ring *R = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); R != NULL; R = R->next) {
+        unsigned head = __atomic_load_n(&R->head, __ATOMIC_ACQUIRE);
+        for (unsigned tail = R->tail; tail != head; tail++) {
+            struct log_record *record = &R->records[tail & (LOG_RING - 1)];
+            writeLine(&record->when, record->level, R->id, record->text);
+            __atomic_store_n(&R->tail, tail + 1, __ATOMIC_RELEASE);
+            ++written;
+        }
+        unsigned long dropped = __atomic_load_n(&R->dropped, __ATOMIC_RELAXED);
+        if (dropped != R->reported) {
+            struct timespec now;
+            char text[LOG_LINE];
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(text, sizeof(text), "msg=\"dropped %lu lines, the log could not keep up\"", dropped - R->reported);
+            writeLine(&now, LOG_LEVEL_WARN, R->id, text);
+            R->reported = dropped;
+            ++written;
+        }
+    }
+    if (written > 0) {
+        fflush(logFile);
+    }
+    return written;
+}
+
+// background thread. the only one that ever touches the log file.
+static void * logWriter(void *arguements) {
+    (void) arguements;
+    struct timespec pause = {0, LOG_INTERVAL_NS};
+    while (__atomic_load_n(&writerRunning, __ATOMIC_ACQUIRE)) {
+        drainRings();
+        nanosleep(&pause, NULL);
+    }
+    drainRings();
+    return NULL;
+}
+
+// ------------------------------- SETUP -------------------------------
+
+// starts the writer. lines go to path, appended, or to stderr if path is NULL.
+int log_init(int level, const char *path) {
+    logFile = path != NULL ? fopen(path, "a") : stderr;
+    if (logFile == NULL) {
+        return EXIT_FAILURE;
+    }
+    log_set_level(level);
+    writerRunning = 1;
+    if (pthread_create(&writer, NULL, logWriter, NULL) != 0) {
+        writerRunning = 0;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void log_set_level(int level) {
+    __atomic_store_n(&logLevel, level, __ATOMIC_RELAXED);
+}
+
+// returns the level called name ("off", "error", "warn", "info" or "debug"), or -1 if there is none.
+int log_parse_level(const char *name) {
+    for (int level = LOG_LEVEL_OFF; level <= LOG_LEVEL_DEBUG; level++) {
+        if (strcmp(name, levelNames[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+// writes out what is left and stops the writer. threads still running may go on logging, their lines just stay in
+// their rings, which live as long as the process.
+void log_shutdown(void) {
+    if (!writerRunning) {
+        return;
+    }
+    __atomic_store_n(&writerRunning, 0, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    if (logFile != stderr) {
+        fclose(logFile);
+    }
+    logFile = NULL;
+}
+
+// ------------------------------- END OF LOGGING -------------------------------
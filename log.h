@@ -0,0 +1,54 @@
+/*
+ * HashServer logging -- leveled log lines that never make a worker wait on a terminal or a disk.
+ *
+ * IMPLEMENTATION AND SHORT DESCRIPTION:
+ *      Every thread that logs gets its own ring of fixed-size records the first time it does. LOG() formats the line
+ *      straight into the next free record and bumps the ring's head; nothing is locked and nothing is written. A
+ *      background writer thread wakes up every few milliseconds, copies whatever the rings hold to the log file and
+ *      moves their tails on. The rings are single-producer single-consumer, so head and tail each have one writer and
+ *      a pair of acquire/release operations is all the synchronisation there is. A thread that logs faster than the
+ *      writer drains drops lines rather than block, and the writer reports how many it lost.
+ *
+ *      Lines are "key=value" pairs (logfmt), led by the time, level and thread: the message passed to LOG() should be
+ *      written the same way, e.g. LOG(LOG_LEVEL_DEBUG, "cmd=GET key=\"%s\"", log_quote(text, key, keyLen)), with
+ *      anything a client sent passed through log_quote() so it can't break the line. The level is checked before any
+ *      arguement is even evaluated, so a disabled LOG() costs one load and a compare. It can be changed at any time.
+ */
+
+#ifndef HASHSERVER_LOG_H
+#define HASHSERVER_LOG_H
+
+#include <stdio.h>
+
+// Define parameters
+#define LOG_RING 256        // records per thread. power of two
+#define LOG_LINE 240        // longest message in bytes, anything longer is cut
+#define LOG_QUOTE_MAX 32    // bytes of client data log_quote() shows
+#define LOG_QUOTE_SIZE (4 * LOG_QUOTE_MAX + 4)
+
+// Log levels, most important first. A level also logs everything above it.
+enum log_level {
+    LOG_LEVEL_OFF,
+    LOG_LEVEL_ERROR,    // the server can't do something it should
+    LOG_LEVEL_WARN,     // a connection failed in a way the client didn't ask for (the default level)
+    LOG_LEVEL_INFO,     // a client sent something we refused
+    LOG_LEVEL_DEBUG,    // every command
+};
+
+extern int logLevel;
+
+#define LOG(level, ...) do { \
+        if ((level) <= __atomic_load_n(&logLevel, __ATOMIC_RELAXED)) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+// Method definitions
+int log_init(int level, const char *path);
+void log_set_level(int level);
+int log_parse_level(const char *name);
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+const char * log_quote(char *out, const char *data, size_t len);
+void log_shutdown(void);
+
+#endif
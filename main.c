@@ -1,4 +1,3 @@
-
 /*
  * @Author: Cyrus Majd
  *
@@ -6,10 +5,15 @@
  *
  * IMPLEMENTATION AND SHORT DESCRIPTION:
  *      This is the server code. The idea is that you connect to this server from a client, and send either a GET, SET, or DEL request.
- *      The appropriate request, along with any parameters, is then processed in a separate thread, one for each client.
+ *      A small fixed pool of worker threads (one per core) serves every client. Each worker runs an epoll loop over non-blocking
+ *      sockets, and each connection is a little state machine (struct conn) that pulls newline terminated fields out of
+ *      whatever the socket delivers, however TCP happened to split or glue them, so an idle client costs a few hundred bytes
+ *      instead of a whole thread.
  *
- *      Values are stored in a mutex-locked synchronous queue data structure. The contents of the queue is an array of structs containing
- *      a key value pair. This is the data structure with which the client interacts. The program handles three commands: "SET", "GET", & "DEL".
+ *      Values are stored in a sharded, mutex-locked synchronous queue data structure. The contents of the queue are key value pairs of any
+ *      length in slab pages, plus a hash index over the keys (see queue.h) so every lookup is O(1) expected. This is the data structure with
+ *      which the client interacts. The program handles twelve commands: "SET", "GET", "DEL", "SETEX", "EXPIRE", "TTL", "DUMP", "STATS",
+ *      "SNAPSHOT", "MGET", "MSET" & "MDEL".
  *
  *      "SET" [length] [key] [value]
  *          Sets a key-value pair in the synchronous queue structure. If a pair with the same key already exists, the old pair is deleted and the
@@ -18,11 +22,61 @@
  *          Returns the value at the key in the synchronous queue structure. If the key-value pair does not exist, KNF is returned.
  *      "DEL" [length] [key]
  *          Deletes the key-value pair specified. If it does not exists, KNF is returned.
+ *      "SETEX" [length] [key] [seconds] [value]
+ *          Like SET, but the pair expires after the given number of seconds (at most ten years). A plain SET of the key
+ *          makes it permanent again.
+ *      "EXPIRE" [length] [key] [seconds]
+ *          Makes an existing pair expire after the given number of seconds, or deletes it right away if that is 0 or
+ *          less. Returns OKE, or KNF if the key does not exist.
+ *      "TTL" [length] [key]
+ *          Returns the seconds the pair has left to live like GET returns a value, -1 if it never expires. If the
+ *          key-value pair does not exist, KNF is returned.
+ *      "DUMP" [length]
+ *          Admin command: prints every key-value pair to the server's standard output from a background thread, so
+ *          neither the client nor the other clients wait for it. [length] is 0. Returns OKU.
+ *      "STATS" [length]
+ *          Admin command: returns "name value" lines (counts of commands, hits, misses, bytes, connections, items and
+ *          memory, and the p50/p99/p999/max latency of every command type in ns) like GET returns a value, with OKI.
+ *          [length] is 0. Every worker keeps its own counters and histograms, which STATS adds up when it is asked.
+ *      "SNAPSHOT" [length]
+ *          Admin command: forks a child that writes the whole store to the --snapshot file (see snapshot.h) while the
+ *          server keeps going. [length] is 0. Returns OKB once the child is running, or ERR SNP if it couldn't start.
+ *      "MGET" [length] [count] [key]...
+ *          Looks up [count] keys at once. Returns OKM, the length of what follows, then for every key the reply GET
+ *          would have given (OKG and the value, or KNF).
+ *      "MSET" [length] [count] [key] [value]...
+ *          Sets [count] pairs at once. Returns OKS, or ERR MEM if some of them didn't fit.
+ *      "MDEL" [length] [count] [key]...
+ *          Deletes [count] keys at once. Returns OKC and the number of keys that were deleted, like GET returns a value.
+ *
+ *      [length] always counts the bytes of the fields after it, one newline each included. A bad number of seconds is
+ *      answered with ERR TTL. The fields of a batch command are taken in one piece once all [length] bytes are in, and
+ *      its keys are handed to the store together: it sorts them by shard, takes each shard lock once for the whole
+ *      batch and prefetches the next keys' slots while it works on the current one, so a batch of keys costs a fraction
+ *      of the locking and cache misses of as many single commands.
+ *
+ *      A connection whose first byte is 0x80 talks the binary protocol of protocol.h instead: fixed size headers with
+ *      the command, the key and value lengths and an opaque id, followed by the raw key and value, which are run right
+ *      where they were received with no scanning for newlines and no length to parse out of text.
+ *
+ *      Nothing is printed per request. What happens is logged through log.h at a level picked with --log-level, to
+ *      stderr or to --log-file, by a background writer so a slow terminal or disk never holds up a worker.
+ *
+ *      With --aof every change is also appended to a file that is replayed at the next start (see aof.h). With
+ *      --aof-fsync always, a worker holds back the replies of the connections that changed something until the changes
+ *      are on disk, then sends them all together, so a whole batch of events shares one fsync. At startup the snapshot
+ *      is loaded first, if there is one, by a pool of threads (see snapshot.h), and the part of the append-only file
+ *      logged after it was taken is replayed on top of it. The port is bound right away but only listened on once all that is done.
+ *
+ *      With --store-file the store lives in a file that is reopened as it is at the next start, in place of the
+ *      snapshot (see queue.h). On the way out every shard lock is taken for good, the log is closed and the store is
+ *      checkpointed, so the checkpoint and the log end at the same change and a later crash only replays the log tail.
  *
  */
 
 
 // Imports
+#define _GNU_SOURCE     // accept4()
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -31,479 +85,1603 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <errno.h>
 #include <err.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <endian.h>
+#ifdef HASHSERVER_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "queue.h"
+#include "log.h"
+#include "hist.h"
+#include "aof.h"
+#include "snapshot.h"
+#include "protocol.h"
 
 // Define parameters
-#define QUEUESIZE 1000000    // size of key-value queue
-#define KEYSIZE 100
-#define VALUESIZE 100
 #define DEBUG_QUEUE 0
 #define SERVER_PORT 18000
-#define SERVER_BACKLOG 100
+#define SERVER_BACKLOG 4096
+#define SERVER_MAX_WORKERS 64
+#define EPOLL_BATCH 256     // events handled per epoll_wait
 #define MAXLINE 4096
+#define CONN_MAX_PENDING (1 << 20)  // queued reply bytes after which we stop reading a pipelining client
+#define COMMAND_FIELDS 5    // "SETEX" [length] [key] [seconds] [value]
+#define DUMP_COMMAND 7
+#define STATS_COMMAND 8
+#define SNAPSHOT_COMMAND 9
+#define MGET_COMMAND 10     // the batch commands, see runBatch()
+#define MSET_COMMAND 11
+#define MDEL_COMMAND 12
+#define COMMAND_TYPES 13
+#define BATCH_MAX_KEYS 16384        // most keys in one batch command
+#define BATCH_MAX_BYTES (64u << 20) // longest [length] of a batch command
+#define STATS_MAX 4096      // longest STATS reply
+#define CONN_NEW 0          // the protocol of a connection
+#define CONN_TEXT 1
+#define CONN_BINARY 2
 #define DEBUG_SOCKETS 1
 #define SA struct sockaddr
-
-// ------------------------------- QUEUE STRUCTURE -------------------------------
-
-// Key-Value pair structure
-struct queueElement {
-    char key[KEYSIZE];
-    char value[VALUESIZE];
-};
-
-// Queue Structure
-struct queue {
-    struct queueElement* data;
-    unsigned head;  // index of first item in queue
-    unsigned count;  // number of items in queue
-    pthread_mutex_t lock;
-    pthread_cond_t read_ready;  // wait for count > 0
-    pthread_cond_t write_ready; // wait for count < QUEUESIZE
+#ifdef HASHSERVER_IO_URING
+#define SERVER_BACKEND "io_uring"
+#else
+#define SERVER_BACKEND "epoll"
+#endif
+
+// Per-connection state. Everything connection() used to keep on its stack between reads lives here now.
+struct conn {
+    int connfd;
+    struct queue *Q;
+#ifdef HASHSERVER_IO_URING
+    struct uring *ring;
+    unsigned inflight;  // submitted operations that have not completed for good yet
+    int sendInFlight;
+    char *sending;      // the batch of replies the kernel is sending right now. pending fills up meanwhile
+    size_t sendingLen;
+    size_t sendingCap;
+    size_t sendingOff;  // how much of it went out already
+    int closing;
+#else
+    int epollfd;
+    unsigned events;    // what the epoll set is currently watching for
+#endif
+    int protocol;       // CONN_TEXT or CONN_BINARY (see protocol.h), CONN_NEW until the client sends something
+    char *inbuf;        // bytes of a command that arrived split across reads, see connInput()
+    size_t inLen;
+    size_t inCap;
+    int fields;         // complete fields of the current command found so far
+    size_t fieldStart[COMMAND_FIELDS];  // where each one starts, counted from the start of the command
+    size_t fieldLen[COMMAND_FIELDS];
+    size_t next;        // where the next field starts
+    size_t scanned;     // how far the next field has already been searched for its newline
+    int commandType;
+    size_t bodyLen;     // [length] of a batch command, whose fields are taken in one piece
+    char *pending;      // reply bytes the socket would not take yet
+    size_t pendingLen;
+    size_t pendingCap;
+    int escape;         // close once the pending replies are out
+    int waiting;        // its replies wait for the append-only file, see waitList
+    struct conn *waitNext;
 };
 
-// holds arguements for multithreaded call to connection()
-struct arg_struct {
-    int connfd_STRUCT;
+// holds arguements for one worker thread
+struct worker_args {
+    int listenfd;
     struct queue *Q;
-    int n;
+    int id;
 };
 
+// what one worker has done, for STATS and to compare the two networking backends. only the worker itself writes its
+// stats, anybody may read them with relaxed loads. padded so workers don't share cache lines.
+struct worker_stats {
+    unsigned long commands;
+    unsigned long syscalls;
+    unsigned long hits;     // commands that found their key
+    unsigned long misses;   // commands answered with KNF
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    unsigned long opened;   // connections accepted. a connection is closed by the worker that accepted it
+    unsigned long closed;
+    struct hist latency[COMMAND_TYPES];     // ns from a command being parsed to its reply being queued
+} __attribute__((aligned(64)));
+
+static struct worker_stats workerStats[SERVER_MAX_WORKERS];
+static __thread struct worker_stats *stats;
+static long workerCount;
+static time_t startTime;
+static const char *snapshotPath = SNAPSHOT_PATH;
+
+// where a worker copies values on their way out. it grows to the largest value the worker has sent so far
+static __thread struct conn *waitList;  // connections whose replies wait until their changes are on disk
+static __thread char *valueBuf;
+static __thread size_t valueBufSize;
+static __thread struct queue_batch_key *batchKeys;  // the keys of the batch command being run
+static __thread unsigned batchKeysCap;
+
 // Method definitions
-int queue_init(struct queue *Q);
-int queue_add(struct queue *Q, char * key, char * value);
-int queue_remove(struct queue *Q, char *item);
-int queue_remove_UNLOCKED(struct queue *Q, char *item);
-void queuePrint(struct queue *Q);
-int indexOfElement(struct queue *Q, char * currElement);
-int alreadyExists(struct queue *Q, char * currElement);
-void queueDestroy(struct queue *Q);
 int commandHandler(char * command);
 char* bin2hex(const unsigned char *input, size_t len);
+void connection(struct conn *c);
 
-int queue_init(struct queue *Q)
-{
-    Q->data = malloc(QUEUESIZE * sizeof(struct queueElement));
-    Q->head = 0;
-    Q->count = 0;
-    int i = pthread_mutex_init(&Q->lock, NULL);
-    int j = pthread_cond_init(&Q->read_ready, NULL);
-    int k = pthread_cond_init(&Q->write_ready, NULL);
+// ------------------------------- HANDLING COMMANDS -------------------------------
 
-    if (i != 0 || j != 0 || k != 0) {
-        return EXIT_FAILURE;  // obtained from the init functions (code omitted)
+char* bin2hex(const unsigned char *input, size_t len) {
+    char * result;
+    char * hexits = "0123456789ABCDEF";
+    if (input == NULL || len <= 0) {
+        return NULL;
     }
 
-    return EXIT_SUCCESS;
-}
-
-int queue_add(struct queue *Q, char * key, char * value)
-{
+    int resultlength = (len*3) + 1;
 
-    pthread_mutex_lock(&Q->lock); // make sure no one else touches Q until we're done
+    result = malloc(resultlength);
+    bzero(result, resultlength);
 
-    while (Q->count == QUEUESIZE) {
-        // wait for another thread to dequeue
-        pthread_cond_wait(&Q->write_ready, &Q->lock);
-        // release lock & wait for a thread to signal write_ready
+    for (int i = 0; i < len; i++) {
+        result[i*3] = hexits[input[i] >> 4];
+        result[(i*3) + 1] = hexits[input[i] & 0x0F];
+        result[(i*3) + 2] = ' ';
     }
 
-    // at this point, we hold the lock & Q->count < QUEUESIZE
+    return result;
+}
 
-    // prevent duplicate keys
-    if (alreadyExists(Q, key)){
-        printf("Deleting the duplicate element!\n");
-        queue_remove_UNLOCKED(Q, key);
+int commandHandler(char * command) {
+//    printf("read command: %s. Compared to DEL and DELnewline: %d %d\n", command, strcmp(command, "DEL"), strcmp(command, "DEL\n"));
+    if (strcmp(command, "SET") == 0 || strcmp(command, "SET\n") == 0) {
+        return 0;
+    }
+    else if (strcmp(command, "GET") == 0 || strcmp(command, "GET\n") == 0) {
+        return 1;
+    }
+    else if (strcmp(command, "DEL") == 0 || strcmp(command, "DEL\n") == 0) {
+        return 2;
+    }
+    else if (strcmp(command, "SETEX") == 0) {
+        return 4;
+    }
+    else if (strcmp(command, "EXPIRE") == 0) {
+        return 5;
+    }
+    else if (strcmp(command, "TTL") == 0) {
+        return 6;
+    }
+    else if (strcmp(command, "DUMP") == 0) {
+        return DUMP_COMMAND;
+    }
+    else if (strcmp(command, "STATS") == 0) {
+        return STATS_COMMAND;
+    }
+    else if (strcmp(command, "SNAPSHOT") == 0) {
+        return SNAPSHOT_COMMAND;
+    }
+    else if (strcmp(command, "MGET") == 0) {
+        return MGET_COMMAND;
+    }
+    else if (strcmp(command, "MSET") == 0) {
+        return MSET_COMMAND;
+    }
+    else if (strcmp(command, "MDEL") == 0) {
+        return MDEL_COMMAND;
+    }
+    else {
+        return 3;
     }
 
-    unsigned index = Q->head + Q->count;
-    if (index >= QUEUESIZE) index -= QUEUESIZE;
+}
 
-    strcpy(Q->data[index].key, key);
-    strcpy(Q->data[index].value, value);
-    ++Q->count;
+// fields of each command type, the command itself included. 3 is an invalid command. a batch command has its
+// command and [length] fields, then [length] bytes of keys
+static const int commandFields[] = {4, 3, 3, 0, 5, 4, 3, 2, 2, 2, 2, 2, 2};
+static const char *commandNames[] = {"SET", "GET", "DEL", "?", "SETEX", "EXPIRE", "TTL", "DUMP", "STATS", "SNAPSHOT",
+                                     "MGET", "MSET", "MDEL"};
+
+static int dumpRunning;     // a DUMP is being written out
+
+// background thread for DUMP. the store can take a long time to print, and a worker has other clients to serve.
+static void * dumper(void *arguements) {
+    struct queue *Q = (struct queue *) arguements;
+    LOG(LOG_LEVEL_INFO, "msg=\"dump started\"");
+    long pairs = queue_dump(Q, stdout);
+    LOG(LOG_LEVEL_INFO, "msg=\"dump finished\" pairs=%ld", pairs);
+    __atomic_store_n(&dumpRunning, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    pthread_mutex_unlock(&Q->lock); // now we're done
-    pthread_cond_signal(&Q->read_ready); // wake up a thread waiting to read (if any)
+// starts a dump unless one is running already, in which case that one answers the request too.
+static void dumpStart(struct queue *Q) {
+    int idle = 0;
+    if (!__atomic_compare_exchange_n(&dumpRunning, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&t, &attr, dumper, Q) != 0) {
+        LOG(LOG_LEVEL_ERROR, "msg=\"dump thread error\"");
+        __atomic_store_n(&dumpRunning, 0, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&attr);
+}
 
-    return 0;
+static uint64_t monoNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-int queue_remove_UNLOCKED(struct queue *Q, char *item)
-{
-//    printf("ONE\n");
+// appends one "name value" line to the body of a STATS reply
+static size_t statLine(char *body, size_t used, size_t size, const char *name, unsigned long value) {
+    int n = snprintf(body + used, size - used, "%s %lu\n", name, value);
+    return n < 0 || used + n >= size ? used : used + n;
+}
 
-//    printf("TWO\n");
-    while (Q->count == 0) {
-        pthread_cond_wait(&Q->read_ready, &Q->lock);
+// adds up every worker's stats, and the store's, into the body of a STATS reply. returns its length.
+static size_t statsReport(struct queue *Q, char *body, size_t size) {
+    unsigned long commands = 0, hits = 0, misses = 0, bytesIn = 0, bytesOut = 0, opened = 0, closed = 0;
+    for (long i = 0; i < workerCount; i++) {
+        struct worker_stats *W = &workerStats[i];
+        commands += __atomic_load_n(&W->commands, __ATOMIC_RELAXED);
+        hits += __atomic_load_n(&W->hits, __ATOMIC_RELAXED);
+        misses += __atomic_load_n(&W->misses, __ATOMIC_RELAXED);
+        bytesIn += __atomic_load_n(&W->bytesIn, __ATOMIC_RELAXED);
+        bytesOut += __atomic_load_n(&W->bytesOut, __ATOMIC_RELAXED);
+        opened += __atomic_load_n(&W->opened, __ATOMIC_RELAXED);
+        closed += __atomic_load_n(&W->closed, __ATOMIC_RELAXED);
     }
-//    printf("THREE\n");
-    // now we have exclusive access and queue is non-empty
 
-    // check if key exists, if it does, delete the element and shift everything else over.
-    if (alreadyExists(Q, item)) {
-        int index = indexOfElement(Q, item);
-        --Q->count;
-        for (int i = index; i < Q->count; i++) {
-            Q->data[i] = Q->data[i+1];
+    size_t used = 0;
+    used = statLine(body, used, size, "uptime", (unsigned long) (time(NULL) - startTime));
+    used = statLine(body, used, size, "workers", (unsigned long) workerCount);
+    used = statLine(body, used, size, "curr_connections", opened - closed);
+    used = statLine(body, used, size, "total_connections", opened);
+    used = statLine(body, used, size, "commands", commands);
+    used = statLine(body, used, size, "hits", hits);
+    used = statLine(body, used, size, "misses", misses);
+    used = statLine(body, used, size, "bytes_read", bytesIn);
+    used = statLine(body, used, size, "bytes_written", bytesOut);
+    used = statLine(body, used, size, "curr_items", queue_count(Q));
+    used = statLine(body, used, size, "memory", queue_memory(Q));
+    used = statLine(body, used, size, "limit_maxbytes", Q->maxMemory);
+    used = statLine(body, used, size, "evictions", queue_evictions(Q));
+    used = statLine(body, used, size, "expired", queue_expired(Q));
+    used = statLine(body, used, size, "snapshots", snapshot_count());
+    used = statLine(body, used, size, "snapshot_stall_ns", snapshot_stall_ns());
+
+    // latency of every command type, summed over the workers
+    struct hist merged;
+    for (int type = 0; type < COMMAND_TYPES; type++) {
+        if (commandFields[type] == 0) {
+            continue;
         }
+        memset(&merged, 0, sizeof(merged));
+        for (long i = 0; i < workerCount; i++) {
+            hist_merge(&merged, &workerStats[i].latency[type]);
+        }
+        char lower[16];
+        char name[32];
+        size_t j = 0;
+        for (; commandNames[type][j] != '\0'; j++) {
+            lower[j] = (char) tolower((unsigned char) commandNames[type][j]);
+        }
+        lower[j] = '\0';
+        snprintf(name, sizeof(name), "cmd_%s", lower);
+        used = statLine(body, used, size, name, merged.count);
+        snprintf(name, sizeof(name), "%s_p50_ns", lower);
+        used = statLine(body, used, size, name, hist_percentile(&merged, 50));
+        snprintf(name, sizeof(name), "%s_p99_ns", lower);
+        used = statLine(body, used, size, name, hist_percentile(&merged, 99));
+        snprintf(name, sizeof(name), "%s_p999_ns", lower);
+        used = statLine(body, used, size, name, hist_percentile(&merged, 99.9));
+        snprintf(name, sizeof(name), "%s_max_ns", lower);
+        used = statLine(body, used, size, name, merged.max);
     }
-        // in case the key does not exist
-    else {
-        perror("ERROR: key-not-found!\n");
-    }
-//    printf("FOUR\n");
-//    --Q->head;
-    if (Q->head == QUEUESIZE) Q->head = 0;
+    return used;
+}
 
-//    printf("FIVE\n");
+// reads a whole number of seconds. returns -1 if field is not one.
+static int parseSeconds(const char *field, long *seconds) {
+    char *end;
+    errno = 0;
+    *seconds = strtol(field, &end, 10);
+    return end == field || *end != '\0' || errno != 0 ? -1 : 0;
+}
 
-//    printf("SIX\n");
-    return EXIT_SUCCESS;
+// handles cntrl C when the server wants to end.
+void sig_handler(int signum){
+    //Return type of the handler function should be void
+    printf("\nInside handler function\n");
 }
 
-int queue_remove(struct queue *Q, char *item)
-{
-//    printf("ONE\n");
-    pthread_mutex_lock(&Q->lock);
+// ------------------------------- END OF HANDLING COMMANDS -------------------------------
+
+// ------------------------------- CONNECTION STATE MACHINE -------------------------------
 
-//    printf("TWO\n");
-    while (Q->count == 0) {
-        pthread_cond_wait(&Q->read_ready, &Q->lock);
+// returns room for len more reply bytes behind whatever is still waiting to go out, or NULL if we ran out of memory.
+static char * connReserveOut(struct conn *c, size_t len) {
+    if (c->pendingLen + len > c->pendingCap) {
+        size_t cap = c->pendingCap ? c->pendingCap : MAXLINE;
+        while (cap < c->pendingLen + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(c->pending, cap);
+        if (grown == NULL) {
+            c->escape = 1;
+            return NULL;
+        }
+        c->pending = grown;
+        c->pendingCap = cap;
     }
-//    printf("THREE\n");
-    // now we have exclusive access and queue is non-empty
+    return c->pending + c->pendingLen;
+}
 
-    // check if key exists, if it does, delete the element and shift everything else over.
-    if (alreadyExists(Q, item)) {
-        int index = indexOfElement(Q, item);
-        --Q->count;
-        for (int i = index; i < Q->count; i++) {
-            Q->data[i] = Q->data[i+1];
-        }
+// appends reply bytes behind whatever is still waiting to go out. returns -1 if we ran out of memory.
+static int connQueue(struct conn *c, const char *data, size_t len) {
+    char *out = connReserveOut(c, len);
+    if (out == NULL) {
+        return -1;
     }
-    // in case the key does not exist
-    else {
-        perror("ERROR: key-not-found!\n");
+    memcpy(out, data, len);
+    c->pendingLen += len;
+    return 0;
+}
+
+// replies are only queued here. the worker sends everything a read produced at once after the whole read has been
+// parsed, so a pipeline of commands gets its replies back in a single write.
+static void connSend(struct conn *c, const char *data, size_t len) {
+    connQueue(c, data, len);
+}
+
+// queues a reply that carries a value in one go: the status line, the length of the value line (newline included)
+// and the value line itself.
+static void connSendValue(struct conn *c, const char *status, const char *value, size_t len) {
+    char *out = connReserveOut(c, strlen(status) + 24 + len);
+    if (out == NULL) {
+        return;
     }
-//    printf("FOUR\n");
-//    --Q->head;
-    if (Q->head == QUEUESIZE) Q->head = 0;
+    int header = sprintf(out, "%s\n%zu\n", status, len + 1);
+    memcpy(out + header, value, len);
+    out[header + len] = '\n';
+    c->pendingLen += header + len + 1;
+}
 
-//    printf("FIVE\n");
-    pthread_mutex_unlock(&Q->lock);
-    pthread_cond_signal(&Q->write_ready);
+// the append-only file broke before the changes of c were on disk. its held back replies would acknowledge them, so
+// they are thrown away and the client is hung up on, and it can tell its changes may not have stuck.
+static void connLost(struct conn *c) {
+    LOG(LOG_LEVEL_ERROR, "fd=%d msg=\"changes not logged, closing\"", c->connfd);
+    c->pendingLen = 0;
+    c->escape = 1;
+}
+
+#ifndef HASHSERVER_IO_URING
 
-//    printf("SIX\n");
-    return EXIT_SUCCESS;
+static void connClose(struct conn *c) {
+//    printf("CLOSING OLD CONNECTION.\n");
+    // close() alone only takes the socket out of the epoll set if no other process has it open, and a snapshot child
+    // (see snapshot.h) may have a copy for a moment
+    epoll_ctl(c->epollfd, EPOLL_CTL_DEL, c->connfd, NULL);
+    close(c->connfd);
+    stats->syscalls += 2;
+    ++stats->closed;
+    free(c->pending);
+    free(c->inbuf);
+    free(c);
 }
 
-char* queue_get(struct queue *Q, char *key) {
-    int count = Q->count;
-    for (int i = 0; i < count; i++) {
-        if (strcmp(Q->data[i].key, key) == 0) {
-            return Q->data[i].value;
+// writes what the socket will take right now and keeps the rest for EPOLLOUT. returns -1 if the connection is dead.
+static int connFlush(struct conn *c) {
+    size_t sent = 0;
+    while (sent < c->pendingLen) {
+        ssize_t w = write(c->connfd, c->pending + sent, c->pendingLen - sent);
+        ++stats->syscalls;
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
         }
+        sent += w;
+        stats->bytesOut += w;
     }
+    memmove(c->pending, c->pending + sent, c->pendingLen - sent);
+    c->pendingLen -= sent;
+    if (c->escape && c->pendingLen == 0) {
+        return 0;   // about to be closed anyway
+    }
+
+    // a client that pipelines faster than it reads its replies stops being read until it catches up.
+    // only bother the kernel when that, or whether we wait for writability, changes
+    unsigned events = c->pendingLen > CONN_MAX_PENDING || c->escape ? 0 : EPOLLIN | EPOLLRDHUP;
+    if (c->pendingLen > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events != c->events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = c;
+        epoll_ctl(c->epollfd, EPOLL_CTL_MOD, c->connfd, &ev);
+        ++stats->syscalls;
+        c->events = events;
+    }
+    return 0;
 }
 
-void queuePrint(struct queue *Q) {
-    int count = Q->count;
-    for (int i = 0; i < count; i++) {
-        printf("Value at %d: KEY IS \'%s\' VALUE IS \'%s\'\n", i, Q->data[i].key, Q->data[i].value);
+// sends what the commands read so far have to say, and closes the connection if it is done.
+static void connFinish(struct conn *c) {
+    if (connFlush(c) < 0 || (c->escape && c->pendingLen == 0)) {
+        connClose(c);
     }
 }
 
-int indexOfElement(struct queue *Q, char * currElement) {
-    int count = Q->count;
-    for (int i = 0; i < count; i++) {
-        if (strcmp(Q->data[i].key, currElement) == 0) {
-            return i;
+#endif
+
+// runs a fully read command. cmd points at its first field, every field is NUL terminated in place.
+// returns 1 if the connection has to be closed afterwards.
+static int runCommand(struct conn *c, char *cmd) {
+    uint64_t started = monoNs();
+    struct queue *Q = c->Q;
+    int msgLength = atoi(cmd + c->fieldStart[1]);
+    int fields = commandFields[c->commandType];
+    char *paramOne = fields > 2 ? cmd + c->fieldStart[2] : "";
+    size_t paramOneLen = fields > 2 ? c->fieldLen[2] : 0;
+    // the value is always the last field of a SET or SETEX, the seconds of a SETEX or EXPIRE come right after the key
+    int hasValue = c->commandType == 0 || c->commandType == 4;
+    char *paramTwo = hasValue ? cmd + c->fieldStart[fields - 1] : "";
+    size_t paramTwoLen = hasValue ? c->fieldLen[fields - 1] : 0;
+    char *seconds = c->commandType == 4 || c->commandType == 5 ? cmd + c->fieldStart[3] : "";
+
+    // the store has a limit on key length and on key + value length
+    if (paramOneLen > QUEUE_MAX_KEY || paramOneLen + paramTwoLen > Q->maxItem) {
+        LOG(LOG_LEVEL_INFO, "fd=%d cmd=%s msg=\"key or value too long\"", c->connfd, commandNames[c->commandType]);
+        connSend(c, "ERR\nLEN\n", strlen("ERR\nLEN\n"));
+        return 1;
+    }
+
+    // [length] covers every field after it, newline included
+    size_t expected = 0;
+    for (int i = 2; i < fields; i++) {
+        expected += c->fieldLen[i] + 1;
+    }
+    if (msgLength != (int) expected) {
+        LOG(LOG_LEVEL_INFO, "fd=%d cmd=%s msg=\"wrong length\" length=%d expected=%zu", c->connfd,
+            commandNames[c->commandType], msgLength, expected);
+        connSend(c, "ERR\nLEN\n", strlen("ERR\nLEN\n"));
+        return 1;
+    }
+
+    long ttl = 0;
+    if ((c->commandType == 4 || c->commandType == 5) && (parseSeconds(seconds, &ttl) < 0 ||
+                                                         (c->commandType == 4 && (ttl < 1 || ttl > QUEUE_MAX_TTL)))) {
+        connSend(c, "ERR\nTTL\n", strlen("ERR\nTTL\n"));
+    } else if (c->commandType == 0 || c->commandType == 4) {
+        //            printf("TOTAL LENGHT OF WORDS: %d",(int)(strlen(paramOne) + strlen(paramTwo)));
+        int stored = c->commandType == 0 ? queue_set(Q, paramOne, paramOneLen, paramTwo, paramTwoLen)
+                                         : queue_setex(Q, paramOne, paramOneLen, paramTwo, paramTwoLen, (unsigned) ttl);
+        if (stored == 0) {
+            // response
+            connSend(c, "OKS\n", strlen("OKS\n"));
+        } else {    // the shard ran out of memory, the client may try again later
+            connSend(c, "ERR\nMEM\n", strlen("ERR\nMEM\n"));
+        }
+    } else if (c->commandType == 1) {
+        // if the element exists or not. if doesnt, return key not found (KNF) error
+        long valueLen = queue_get_value(Q, paramOne, paramOneLen, &valueBuf, &valueBufSize);
+        if (valueLen >= 0) {
+            // response
+            connSendValue(c, "OKG", valueBuf, valueLen);
+            ++stats->hits;
+        } else {
+            connSend(c, "KNF\n", strlen("KNF\n"));
+            ++stats->misses;
+        }
+    } else if (c->commandType == 2) {
+        // response
+        long valueLen = queue_remove_value(Q, paramOne, paramOneLen, &valueBuf, &valueBufSize);
+        if (valueLen >= 0) {
+            connSendValue(c, "OKD", valueBuf, valueLen);
+            ++stats->hits;
+        } else {  //return KNF if key is not found.
+            connSend(c, "KNF\n", strlen("KNF\n"));
+            ++stats->misses;
+        }
+    } else if (c->commandType == 5) {
+        if (queue_expire(Q, paramOne, paramOneLen, ttl) == 0) {
+            connSend(c, "OKE\n", strlen("OKE\n"));
+            ++stats->hits;
+        } else {
+            connSend(c, "KNF\n", strlen("KNF\n"));
+            ++stats->misses;
+        }
+    } else if (c->commandType == DUMP_COMMAND) {
+        dumpStart(Q);
+        connSend(c, "OKU\n", strlen("OKU\n"));
+    } else if (c->commandType == SNAPSHOT_COMMAND) {
+        if (snapshot_start(Q, snapshotPath) == 0) {
+            connSend(c, "OKB\n", strlen("OKB\n"));
+        } else {
+            connSend(c, "ERR\nSNP\n", strlen("ERR\nSNP\n"));
+        }
+    } else if (c->commandType == STATS_COMMAND) {
+        char body[STATS_MAX];
+        size_t len = statsReport(Q, body, sizeof(body));
+        connSendValue(c, "OKI", body, len > 0 ? len - 1 : 0);   // the last newline is the reply's own
+    } else {
+        long left = queue_ttl(Q, paramOne, paramOneLen);
+        if (left >= -1) {
+            char number[24];
+            connSendValue(c, "OKT", number, snprintf(number, sizeof(number), "%ld", left));
+            ++stats->hits;
+        } else {
+            connSend(c, "KNF\n", strlen("KNF\n"));
+            ++stats->misses;
         }
     }
+
+    ++stats->commands;
+    hist_record(&stats->latency[c->commandType], monoNs() - started);
+    char keyText[LOG_QUOTE_SIZE];
+    LOG(LOG_LEVEL_DEBUG, "fd=%d cmd=%s keylen=%zu key=\"%s\"", c->connfd, commandNames[c->commandType], paramOneLen,
+        log_quote(keyText, paramOne, paramOneLen));
+    return 0;
 }
 
-int alreadyExists(struct queue *Q, char * currElement) {
-    int count = Q->count;
-    for (int i = 0; i < count; i++) {
-        if (strcmp(Q->data[i].key, currElement) == 0) {
-            // already exists, return 1
+// runs a batch command (MGET, MSET or MDEL), whose [length] bytes of fields are all in body: the number of keys, then
+// every key (followed by its value for MSET), each with its newline. the keys go to the store in one call, which takes
+// every shard lock once for the whole batch. returns 1 if the connection has to be closed afterwards.
+static int runBatch(struct conn *c, char *body, size_t len) {
+    uint64_t started = monoNs();
+    struct queue *Q = c->Q;
+    int fieldsPerKey = c->commandType == MSET_COMMAND ? 2 : 1;
+    char *at = body;
+    char *end = body + len;
+
+    // the fields are cut in place, like parseInput() does with the fields of the other commands
+    long count = -1;
+    char *newline = memchr(at, '\n', len);
+    if (newline != NULL) {
+        *newline = '\0';
+        if (newline > at && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        char *digits;
+        errno = 0;
+        count = strtol(at, &digits, 10);
+        if (digits == at || *digits != '\0' || errno != 0) {
+            count = -1;
+        }
+        at = newline + 1;
+    }
+    if (count < 1 || count > BATCH_MAX_KEYS) {
+        LOG(LOG_LEVEL_INFO, "fd=%d cmd=%s msg=\"bad key count\"", c->connfd, commandNames[c->commandType]);
+        connSend(c, "ERR\nLEN\n", strlen("ERR\nLEN\n"));
+        return 1;
+    }
+    if ((unsigned) count > batchKeysCap) {
+        struct queue_batch_key *grown = realloc(batchKeys, count * sizeof(struct queue_batch_key));
+        if (grown == NULL) {
+            connSend(c, "ERR\nMEM\n", strlen("ERR\nMEM\n"));
+            return 1;
+        }
+        batchKeys = grown;
+        batchKeysCap = (unsigned) count;
+    }
+
+    unsigned n = (unsigned) count;
+    for (unsigned i = 0; i < n; i++) {
+        struct queue_batch_key *k = &batchKeys[i];
+        k->value = "";
+        k->valueLen = 0;
+        for (int f = 0; f < fieldsPerKey; f++) {
+            newline = at < end ? memchr(at, '\n', end - at) : NULL;
+            if (newline == NULL) {
+                LOG(LOG_LEVEL_INFO, "fd=%d cmd=%s msg=\"wrong length\" keys=%u", c->connfd,
+                    commandNames[c->commandType], n);
+                connSend(c, "ERR\nLEN\n", strlen("ERR\nLEN\n"));
+                return 1;
+            }
+            size_t fieldLen = newline - at;
+            if (fieldLen > 0 && at[fieldLen - 1] == '\r') {
+                --fieldLen;
+            }
+            at[fieldLen] = '\0';
+            if (f == 0) {
+                k->key = at;
+                k->keyLen = fieldLen;
+            } else {
+                k->value = at;
+                k->valueLen = fieldLen;
+            }
+            at = newline + 1;
+        }
+        if (k->keyLen > QUEUE_MAX_KEY || k->keyLen + k->valueLen > Q->maxItem) {
+            LOG(LOG_LEVEL_INFO, "fd=%d cmd=%s msg=\"key or value too long\"", c->connfd, commandNames[c->commandType]);
+            connSend(c, "ERR\nLEN\n", strlen("ERR\nLEN\n"));
             return 1;
         }
     }
+    if (at != end) {
+        LOG(LOG_LEVEL_INFO, "fd=%d cmd=%s msg=\"wrong length\" keys=%u", c->connfd, commandNames[c->commandType], n);
+        connSend(c, "ERR\nLEN\n", strlen("ERR\nLEN\n"));
+        return 1;
+    }
+
+    unsigned hits;
+    if (c->commandType == MGET_COMMAND) {
+        // one reply per key, just like GET's, behind a header with their length
+        hits = queue_get_many(Q, batchKeys, n, &valueBuf, &valueBufSize);
+        char number[24];
+        size_t replyLen = 0;
+        for (unsigned i = 0; i < n; i++) {
+            replyLen += batchKeys[i].result == 0 ? strlen("OKG\n") + sprintf(number, "%zu\n", batchKeys[i].valueLen + 1) +
+                                                   batchKeys[i].valueLen + 1
+                                                 : strlen("KNF\n");
+        }
+        char *out = connReserveOut(c, replyLen + 32);
+        if (out == NULL) {
+            return 1;
+        }
+        char *reply = out + sprintf(out, "OKM\n%zu\n", replyLen);
+        for (unsigned i = 0; i < n; i++) {
+            struct queue_batch_key *k = &batchKeys[i];
+            if (k->result == 0) {
+                reply += sprintf(reply, "OKG\n%zu\n", k->valueLen + 1);
+                memcpy(reply, valueBuf + k->offset, k->valueLen);
+                reply += k->valueLen;
+                *reply++ = '\n';
+            } else {
+                memcpy(reply, "KNF\n", strlen("KNF\n"));
+                reply += strlen("KNF\n");
+            }
+        }
+        c->pendingLen += reply - out;
+    } else if (c->commandType == MSET_COMMAND) {
+        hits = queue_set_many(Q, batchKeys, n);
+        if (hits == n) {
+            connSend(c, "OKS\n", strlen("OKS\n"));
+        } else {    // some shard ran out of memory. the pairs that fit are stored
+            connSend(c, "ERR\nMEM\n", strlen("ERR\nMEM\n"));
+        }
+    } else {
+        hits = queue_remove_many(Q, batchKeys, n);
+        char number[24];
+        connSendValue(c, "OKC", number, snprintf(number, sizeof(number), "%u", hits));
+    }
+    if (c->commandType != MSET_COMMAND) {
+        stats->hits += hits;
+        stats->misses += n - hits;
+    }
+
+    ++stats->commands;
+    hist_record(&stats->latency[c->commandType], monoNs() - started);
+    LOG(LOG_LEVEL_DEBUG, "fd=%d cmd=%s keys=%u", c->connfd, commandNames[c->commandType], n);
     return 0;
 }
 
-void queueDestroy(struct queue *Q) {
-    free(Q->data);
+// ------------------------------- BINARY PROTOCOL -------------------------------
+
+static uint16_t getLe16(const char *at) {
+    uint16_t n;
+    memcpy(&n, at, sizeof(n));
+    return le16toh(n);
 }
 
-// ------------------------------- END OF QUEUE STRUCTURE -------------------------------
+static uint32_t getLe32(const char *at) {
+    uint32_t n;
+    memcpy(&n, at, sizeof(n));
+    return le32toh(n);
+}
 
-// ------------------------------- HANDLING COMMANDS -------------------------------
+// queues a binary reply to request: the header, then len bytes of value. see protocol.h
+static void binarySend(struct conn *c, const char *request, unsigned status, int32_t seconds, const char *value,
+                       size_t len) {
+    char *out = connReserveOut(c, PROTOCOL_HEADER + len);
+    if (out == NULL) {
+        return;
+    }
+    uint16_t status16 = htole16((uint16_t) status);
+    uint32_t len32 = htole32((uint32_t) len);
+    uint32_t seconds32 = htole32((uint32_t) seconds);
+    out[PROTOCOL_MAGIC] = (char) PROTOCOL_RESPONSE;
+    out[PROTOCOL_OPCODE] = request[PROTOCOL_OPCODE];
+    memcpy(out + PROTOCOL_STATUS, &status16, sizeof(status16));
+    memcpy(out + PROTOCOL_VALUE_LEN, &len32, sizeof(len32));
+    memcpy(out + PROTOCOL_OPAQUE, request + PROTOCOL_OPAQUE, 4);
+    memcpy(out + PROTOCOL_SECONDS, &seconds32, sizeof(seconds32));
+    memcpy(out + PROTOCOL_HEADER, value, len);
+    c->pendingLen += PROTOCOL_HEADER + len;
+}
 
-char* bin2hex(const unsigned char *input, size_t len) {
-    char * result;
-    char * hexits = "0123456789ABCDEF";
-    if (input == NULL || len <= 0) {
-        return NULL;
+// runs a fully received binary request. its key and value follow the header right where they were received.
+static void runBinary(struct conn *c, const char *request) {
+    uint64_t started = monoNs();
+    struct queue *Q = c->Q;
+    int op = (unsigned char) request[PROTOCOL_OPCODE];
+    size_t keyLen = getLe16(request + PROTOCOL_KEY_LEN);
+    size_t valueLen = getLe32(request + PROTOCOL_VALUE_LEN);
+    int32_t seconds = (int32_t) getLe32(request + PROTOCOL_SECONDS);
+    const char *key = request + PROTOCOL_HEADER;
+    const char *value = key + keyLen;
+
+    if (op == PROTOCOL_SETEX && (seconds < 1 || (uint32_t) seconds > QUEUE_MAX_TTL)) {
+        binarySend(c, request, PROTOCOL_TTL_ERROR, 0, NULL, 0);
+    } else if (op == PROTOCOL_SET || op == PROTOCOL_SETEX) {
+        int stored = op == PROTOCOL_SET ? queue_set(Q, key, keyLen, value, valueLen)
+                                        : queue_setex(Q, key, keyLen, value, valueLen, (unsigned) seconds);
+        binarySend(c, request, stored == 0 ? PROTOCOL_OK : PROTOCOL_MEM, 0, NULL, 0);
+    } else if (op == PROTOCOL_GET || op == PROTOCOL_DEL) {
+        long found = op == PROTOCOL_GET ? queue_get_value(Q, key, keyLen, &valueBuf, &valueBufSize)
+                                        : queue_remove_value(Q, key, keyLen, &valueBuf, &valueBufSize);
+        if (found >= 0) {
+            binarySend(c, request, PROTOCOL_OK, 0, valueBuf, found);
+            ++stats->hits;
+        } else {
+            binarySend(c, request, PROTOCOL_KNF, 0, NULL, 0);
+            ++stats->misses;
+        }
+    } else if (op == PROTOCOL_EXPIRE || op == PROTOCOL_TTL) {
+        long left = op == PROTOCOL_EXPIRE ? queue_expire(Q, key, keyLen, seconds) : queue_ttl(Q, key, keyLen);
+        if (op == PROTOCOL_EXPIRE ? left == 0 : left >= -1) {
+            binarySend(c, request, PROTOCOL_OK, op == PROTOCOL_TTL ? (int32_t) left : 0, NULL, 0);
+            ++stats->hits;
+        } else {
+            binarySend(c, request, PROTOCOL_KNF, 0, NULL, 0);
+            ++stats->misses;
+        }
+    } else if (op == PROTOCOL_DUMP) {
+        dumpStart(Q);
+        binarySend(c, request, PROTOCOL_OK, 0, NULL, 0);
+    } else if (op == PROTOCOL_SNAPSHOT) {
+        binarySend(c, request, snapshot_start(Q, snapshotPath) == 0 ? PROTOCOL_OK : PROTOCOL_SNP, 0, NULL, 0);
+    } else {
+        char body[STATS_MAX];
+        size_t len = statsReport(Q, body, sizeof(body));
+        binarySend(c, request, PROTOCOL_OK, 0, body, len);
     }
 
-    int resultlength = (len*3) + 1;
+    ++stats->commands;
+    hist_record(&stats->latency[op], monoNs() - started);
+    LOG(LOG_LEVEL_DEBUG, "fd=%d cmd=%s protocol=binary keylen=%zu", c->connfd, commandNames[op], keyLen);
+}
 
-    result = malloc(resultlength);
-    bzero(result, resultlength);
+// the binary counterpart of parseInput(). a request is taken as soon as its header and the key and value lengths it
+// gives are all there. returns how many bytes belong to finished requests.
+static size_t parseBinary(struct conn *c, char *buf, size_t len) {
+    size_t consumed = 0;
+    while (!c->escape && len - consumed >= PROTOCOL_HEADER) {
+        const char *request = buf + consumed;
+        int op = (unsigned char) request[PROTOCOL_OPCODE];
+        size_t keyLen = getLe16(request + PROTOCOL_KEY_LEN);
+        size_t valueLen = getLe32(request + PROTOCOL_VALUE_LEN);
+
+        // a key for every command but the admin ones, a value only for SET and SETEX
+        int hasKey = op < DUMP_COMMAND;
+        int hasValue = op == PROTOCOL_SET || op == PROTOCOL_SETEX;
+        if ((unsigned char) request[PROTOCOL_MAGIC] != PROTOCOL_REQUEST || op == 3 || op > SNAPSHOT_COMMAND ||
+            (!hasKey && keyLen > 0) || (!hasValue && valueLen > 0)) {
+            LOG(LOG_LEVEL_INFO, "fd=%d msg=\"invalid binary request\" bytes=%d,%d", c->connfd,
+                (unsigned char) request[PROTOCOL_MAGIC], op);
+            binarySend(c, request, PROTOCOL_BAD, 0, NULL, 0);
+            c->escape = 1;
+            break;
+        }
+        if (keyLen > QUEUE_MAX_KEY || keyLen + valueLen > c->Q->maxItem) {
+            LOG(LOG_LEVEL_INFO, "fd=%d cmd=%s msg=\"key or value too long\"", c->connfd, commandNames[op]);
+            binarySend(c, request, PROTOCOL_LEN, 0, NULL, 0);
+            c->escape = 1;
+            break;
+        }
+        if (len - consumed < PROTOCOL_HEADER + keyLen + valueLen) {
+            break;
+        }
+        runBinary(c, request);
+        consumed += PROTOCOL_HEADER + keyLen + valueLen;
+    }
+    return consumed;
+}
 
-    for (int i = 0; i < len; i++) {
-        result[i*3] = hexits[input[i] >> 4];
-        result[(i*3) + 1] = hexits[input[i] & 0x0F];
-        result[(i*3) + 2] = ' ';
+// ------------------------------- END OF BINARY PROTOCOL -------------------------------
+
+// pulls complete newline terminated fields out of buf and runs every command whose fields are all there. fields are
+// cut in place (the newline, or a "\r\n", becomes the NUL terminator) so nothing is copied. returns how many bytes
+// belong to finished commands; the rest is the start of a command that is still arriving.
+static size_t parseInput(struct conn *c, char *buf, size_t len) {
+    // the first byte a client sends picks the protocol for the rest of the connection
+    if (c->protocol == CONN_NEW && len > 0) {
+        c->protocol = (unsigned char) buf[0] == PROTOCOL_REQUEST ? CONN_BINARY : CONN_TEXT;
+    }
+    if (c->protocol == CONN_BINARY) {
+        return parseBinary(c, buf, len);
     }
 
-    return result;
+    size_t consumed = 0;
+    while (!c->escape) {
+        char *cmd = buf + consumed;
+        size_t avail = len - consumed;
+
+        // the fields of a batch command are taken in one piece, once all [length] bytes of them are there
+        if (c->fields == 2 && c->commandType >= MGET_COMMAND) {
+            if (avail < c->next + c->bodyLen) {
+                break;
+            }
+            if (runBatch(c, cmd + c->next, c->bodyLen)) {
+                c->escape = 1;
+            }
+            consumed += c->next + c->bodyLen;
+            c->fields = 0;
+            c->next = 0;
+            c->scanned = 0;
+            continue;
+        }
+
+        // telnet sends IAC IP (0xFF 0xF4) without a newline when the user hits ctrl + C
+        if (c->scanned == c->next && avail >= c->next + 2 &&
+            (unsigned char) cmd[c->next] == 0xFF && (unsigned char) cmd[c->next + 1] == 0xF4) {
+//            printf("CTRL + C DETECTED!\n");
+            c->escape = 1;
+            break;
+        }
+
+        char *newline = avail > c->scanned ? memchr(cmd + c->scanned, '\n', avail - c->scanned) : NULL;
+        if (newline == NULL) {
+            c->scanned = avail;
+            if (avail - c->next > c->Q->maxItem + MAXLINE) {   // no field is that long, the client is lying to us
+                connSend(c, "ERR\nBAD\n", strlen("ERR\nBAD\n"));
+                c->escape = 1;
+            }
+            break;
+        }
+
+        size_t end = newline - cmd;
+        size_t fieldLen = end - c->next;
+        if (fieldLen > 0 && cmd[end - 1] == '\r') {
+            --fieldLen;
+        }
+        cmd[c->next + fieldLen] = '\0';
+        c->fieldStart[c->fields] = c->next;
+        c->fieldLen[c->fields] = fieldLen;
+        ++c->fields;
+        c->next = c->scanned = end + 1;
+
+        if (c->fields == 1) {
+            c->commandType = commandHandler(cmd);
+            if (c->commandType == 3) {
+                LOG(LOG_LEVEL_INFO, "fd=%d msg=\"invalid command\" bytes=%d,%d,%d", c->connfd, cmd[0], cmd[1], cmd[2]);
+                connSend(c, "ERR\nBAD\n", strlen("ERR\nBAD\n"));
+                c->escape = 1;
+                break;
+            }
+        }
+
+        if (c->fields == commandFields[c->commandType] && c->commandType >= MGET_COMMAND) {
+            char *digits;
+            long body = strtol(cmd + c->fieldStart[1], &digits, 10);
+            if (digits == cmd + c->fieldStart[1] || *digits != '\0' || body < 2 || body > BATCH_MAX_BYTES) {
+                LOG(LOG_LEVEL_INFO, "fd=%d cmd=%s msg=\"bad length\"", c->connfd, commandNames[c->commandType]);
+                connSend(c, "ERR\nLEN\n", strlen("ERR\nLEN\n"));
+                c->escape = 1;
+                break;
+            }
+            c->bodyLen = (size_t) body;
+            continue;
+        }
+
+        if (c->fields == commandFields[c->commandType]) {
+            if (runCommand(c, cmd)) {
+                c->escape = 1;
+            }
+            consumed += c->next;
+            c->fields = 0;
+            c->next = 0;
+            c->scanned = 0;
+        }
+    }
+    return consumed;
 }
 
-int commandHandler(char * command) {
-//    printf("read command: %s. Compared to DEL and DELnewline: %d %d\n", command, strcmp(command, "DEL"), strcmp(command, "DEL\n"));
-    if (strcmp(command, "SET") == 0 || strcmp(command, "SET\n") == 0) {
+// makes room for at least need more bytes in the connection's carry-over buffer. returns -1 if we ran out of memory.
+static int connReserve(struct conn *c, size_t need) {
+    if (c->inLen + need <= c->inCap) {
         return 0;
     }
-    else if (strcmp(command, "GET") == 0 || strcmp(command, "GET\n") == 0) {
-        return 1;
+    size_t cap = c->inCap ? c->inCap : MAXLINE;
+    while (cap < c->inLen + need) {
+        cap *= 2;
     }
-    else if (strcmp(command, "DEL") == 0 || strcmp(command, "DEL\n") == 0) {
-        return 2;
+    char *grown = realloc(c->inbuf, cap);
+    if (grown == NULL) {
+        c->escape = 1;
+        return -1;
     }
-    else {
-        return 3;
+    c->inbuf = grown;
+    c->inCap = cap;
+    return 0;
+}
+
+// parses what is in the carry-over buffer and slides the unfinished command back to its front.
+static void connParseBuffered(struct conn *c) {
+    size_t used = parseInput(c, c->inbuf, c->inLen);
+    memmove(c->inbuf, c->inbuf + used, c->inLen - used);
+    c->inLen -= used;
+    if (c->inLen == 0 && c->inCap > MAXLINE) {
+        // a huge command went through, don't sit on its buffer while the client idles
+        free(c->inbuf);
+        c->inbuf = NULL;
+        c->inCap = 0;
+    }
+}
+
+// hands len freshly received bytes to the parser. both backends end up here. the bytes are parsed right where they
+// were received, and only the tail of a command that is still arriving gets copied into the connection.
+static void connInput(struct conn *c, char *data, size_t len) {
+    if (c->inLen > 0) {
+        if (connReserve(c, len) == 0) {
+            memcpy(c->inbuf + c->inLen, data, len);
+            c->inLen += len;
+            connParseBuffered(c);
+        }
+        return;
     }
 
+    size_t used = parseInput(c, data, len);
+    if (used < len && !c->escape && connReserve(c, len - used) == 0) {
+        memcpy(c->inbuf, data + used, len - used);
+        c->inLen = len - used;
+    }
 }
 
-// handles cntrl C when the server wants to end.
-void sig_handler(int signum){
-    //Return type of the handler function should be void
-    printf("\nInside handler function\n");
+#ifndef HASHSERVER_IO_URING
+
+// called by a worker whenever the client socket is readable. with a command half read, the bytes go straight into
+// the connection's buffer behind it. otherwise they land on the stack and are parsed there.
+void connection(struct conn *c) {
+    char recvline[MAXLINE];
+    uint64_t logged = aof_thread_lsn();
+    for (;;) {
+        char *into = recvline;
+        size_t room = sizeof(recvline);
+        if (c->inLen > 0) {
+            if (connReserve(c, MAXLINE) < 0) {
+                connClose(c);
+                return;
+            }
+            into = c->inbuf + c->inLen;
+            room = c->inCap - c->inLen;
+        }
+
+        ssize_t n = read(c->connfd, into, room);
+        ++stats->syscalls;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                LOG(LOG_LEVEL_WARN, "fd=%d msg=\"read error\" error=\"%s\"", c->connfd, strerror(errno));
+            }
+            connClose(c);
+            return;
+        }
+
+        stats->bytesIn += n;
+        if (into == recvline) {
+            connInput(c, recvline, n);
+        } else {
+            c->inLen += n;
+            connParseBuffered(c);
+        }
+        // a full buffer means the client is pipelining and more is probably waiting. take it too, so its replies
+        // go out in the same write
+        if ((size_t) n < room || c->escape || c->pendingLen > CONN_MAX_PENDING) {
+            break;
+        }
+    }
+
+    // replies to changes that aren't on disk yet wait for the rest of the worker's batch, see worker()
+    if (aof_thread_lsn() != logged && !aof_durable(aof_thread_lsn())) {
+        c->waiting = 1;
+        c->waitNext = waitList;
+        waitList = c;
+        return;
+    }
+    connFinish(c);
 }
 
-// ------------------------------- END OF HANDLING COMMANDS -------------------------------
+#endif
+
+// ------------------------------- END OF CONNECTION STATE MACHINE -------------------------------
+
+// ------------------------------- EVENT LOOP -------------------------------
+
+static int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-void * connection(void *arguements) {
-//    struct arg_struct *args = malloc(sizeof (struct arg_struct));
-//    args = (struct arg_struct *) arguements;
-//    sleep(2);
-//    printf("copied struct\n");
-
-    int connfd = ((struct arg_struct *) arguements)->connfd_STRUCT;
-//    sleep(2);
-//    printf("copied FD: %d\n", connfd);
-
-    int n = ((struct arg_struct *) arguements)->n;
-//    sleep(2);
-//    printf("copied n: %d\n", n);
-
-    struct queue *Q = ((struct arg_struct *) arguements)->Q;
-//    sleep(2);
-//    printf("copied queue\n");
-
-    char buff[MAXLINE + 1];
-    int escape = 0;
-//            signal(SIGINT,sig_handler);
-    while (escape == 0) {
-        // read client message
-        int counter = 0;
-        int limit = 0;
-        int commandType;
-        char paramOne[1000] = "";
-        char paramTwo[1000] = "";
-        int msgLength = 0;
-        char recvline[MAXLINE + 1];
-        while ((n = read(connfd, recvline, MAXLINE - 1)) > 0) {
-            char word[1000] = "";
-//            fprintf(stdout, "\nRECVLINE: %s WORD: %s\n", recvline, word);
-//            strcpy(word, recvline);
-            strncpy(word, recvline, strlen(recvline) - 2);
-            strcpy(recvline, "");
-            strcat(word, "");
-            if (counter == 0) {
-                char substr[7];
-                strncpy(substr, word, 3);
-                strcpy(word, substr);
+#ifndef HASHSERVER_IO_URING
+
+// takes every connection waiting on the listening socket and adds it to this worker's epoll set.
+static void acceptAll(int listenfd, int epollfd, struct queue *Q) {
+    for (;;) {
+        int connfd = accept4(listenfd, (SA *) NULL, NULL, SOCK_NONBLOCK);
+        ++stats->syscalls;
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
-//                    fprintf(stdout, "\nRECVLINE: %s WORD: %s\n", recvline, word);
-//            printf("==========%s=========", word);
-            if (word[strlen(word) - 1] == '\n') {
-//                printf("NEWLINE DETECTED!\n");
-                word[strlen(word) - 2] = '\0';
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG(LOG_LEVEL_WARN, "msg=\"accept error\" error=\"%s\"", strerror(errno));
             }
+            return;
+        }
 
-            if (word[0] == -1 && word[1] == -12 && word[2] == -1) {
-//                printf("CTRL + C DETECTED!\n");
-                escape = 1;
-                break;
-            }
+        struct conn *c = calloc(1, sizeof(struct conn));
+        if (c == NULL) {
+            close(connfd);
+            continue;
+        }
+        c->connfd = connfd;
+        c->Q = Q;
+        c->epollfd = epollfd;
+        c->events = EPOLLIN | EPOLLRDHUP;
+
+        struct epoll_event ev;
+        ev.events = c->events;
+        ev.data.ptr = c;
+        ++stats->syscalls;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            LOG(LOG_LEVEL_WARN, "fd=%d msg=\"epoll_ctl error\" error=\"%s\"", connfd, strerror(errno));
+            close(connfd);
+            free(c);
+        } else {
+            ++stats->opened;
+        }
+    }
+}
 
-            if (counter == 0) {
-//                printf("TESING: %s", recvline);
-                int tmp = commandHandler(word);
-                if (tmp == 0) { // we have a SET, so 4 arguements (including "SET")
-                    limit = 2;
-                    commandType = 0;
-                } else if (tmp == 1 || tmp == 2) {
-                    limit = 1; // either a GET or a DEL
-                    if (tmp == 1) {
-                        commandType = 1;
-                    } else {
-                        commandType = 2;
-                    }
-                } else {
-                    printf("%d%d%d", word[0], word[1], word[2]);
-                    if (word[0] == -1 && word[1] == -12 && word[2] == -1) {
-                        //ctrl + C is pressed! exit the thread and close connection.
-                    }
-                    perror(" INVALID COMMAND!\n");
-//                    snprintf((char *) buff, sizeof(buff), "INVALID COMMAND! Ending Program.\n");
-//                            queueDestroy(&Q);
-                    write(connfd, "ERR\nBAD\n", strlen("ERR\nBAD\n"));
-                    escape = 1;
-                    break;
-                }
+// one worker thread. every worker watches the shared listening socket (EPOLLEXCLUSIVE wakes just one of them per
+// new connection) and then owns the connections it accepted for their whole life.
+static void * worker(void *arguements) {
+    struct worker_args *args = (struct worker_args *) arguements;
+    struct epoll_event events[EPOLL_BATCH];
+    stats = &workerStats[args->id];
+
+    int epollfd = epoll_create1(0);
+    if (epollfd < 0) {
+        perror("epoll_create error!\n");
+        return NULL;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;   // NULL marks the listening socket
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, args->listenfd, &ev) < 0) {
+        perror("epoll_ctl error!\n");
+        return NULL;
+    }
+
+    for (;;) {
+        int ready = epoll_wait(epollfd, events, EPOLL_BATCH, -1);
+        ++stats->syscalls;
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            if (counter == 1) {
-                char numWord[10] = "";
-                strncpy(numWord, word, strlen(word));
-                msgLength = atoi(numWord);
-//                printf("NUM WORD: %d\n", msgLength);
+            perror("epoll_wait error!\n");
+            return NULL;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (c == NULL) {
+                acceptAll(args->listenfd, epollfd, args->Q);
+                continue;
             }
-            if (counter == 2) {
-                strcpy(paramOne, word);
+            if (events[i].events & EPOLLOUT) {
+                if (connFlush(c) < 0 || (c->escape && c->pendingLen == 0)) {
+                    connClose(c);
+                    continue;
+                }
             }
-            if (counter == 3) {
-                strcpy(paramTwo, word);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                connection(c);
             }
-            if (counter > limit) {
-                break;
+        }
+
+        // one wait for the disk covers every change the batch made
+        if (waitList != NULL) {
+            int lost = aof_wait(aof_thread_lsn()) < 0;
+            while (waitList != NULL) {
+                struct conn *c = waitList;
+                waitList = c->waitNext;
+                c->waiting = 0;
+                if (lost) {
+                    connLost(c);
+                }
+                connFinish(c);
             }
+        }
+    }
+}
 
-            memset(recvline, 0, MAXLINE);
-            recvline[0] = '\0';
-            strcpy(recvline, "");
-//                    printf("CONTENTS OF RECV AFTER CLEAN: %s", recvline);
-            counter++;
+#else
+
+// The io_uring backend talks to the kernel through the raw system calls, so it needs no liburing. Each worker owns one
+// ring with a multishot accept on the shared listening socket, a multishot recv per client that picks its buffers from a
+// ring of provided buffers, and one send per client at a time. Everything queued while handling a batch of completions
+// goes to the kernel in the same io_uring_enter that waits for the next batch.
+
+#define URING_ENTRIES 4096      // submission queue size
+#define URING_CQ_ENTRIES 16384  // completion queue size, multishot requests can post a lot of completions
+#define URING_BUFFERS 1024      // provided receive buffers per worker, power of two
+#define URING_BGID 0            // buffer group id of those buffers
+
+// what a completion belongs to lives in the low bits of user_data, the connection pointer in the rest
+#define URING_OP_ACCEPT 0
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_MASK 3ull
+
+struct uring {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqLocalTail;   // SQEs handed out so far
+    unsigned sqSubmitted;   // SQEs the kernel has been told about
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufRing;
+    char *bufs;             // URING_BUFFERS receive buffers of MAXLINE bytes
+    int listenfd;
+    struct queue *Q;
+};
+
+static int uringEnter(struct uring *r, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    ++stats->syscalls;
+    return (int) syscall(__NR_io_uring_enter, r->fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+// hands the kernel every SQE queued since the last call and, if wait is set, sleeps until at least one completion.
+static int uringSubmit(struct uring *r, int wait) {
+    __atomic_store_n(r->sqTail, r->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = r->sqLocalTail - r->sqSubmitted;
+    if (toSubmit == 0 && !wait) {
+        return 0;
+    }
+    int ret = uringEnter(r, toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0) {
+        r->sqSubmitted += ret;
+    }
+    return ret;
+}
+
+// returns a cleared SQE. if the submission queue is full, what is in it gets submitted first.
+static struct io_uring_sqe *uringSqe(struct uring *r) {
+    while (r->sqLocalTail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->sqEntries) {
+        if (uringSubmit(r, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter error!\n");
+            exit(EXIT_FAILURE);
         }
+    }
+    unsigned index = r->sqLocalTail & r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqArray[index] = index;
+    ++r->sqLocalTail;
+    return sqe;
+}
 
-        if (escape) {
-            continue;
+// gives receive buffer bid back to the kernel.
+static void uringRecycle(struct uring *r, unsigned short bid) {
+    unsigned short tail = r->bufRing->tail;
+    struct io_uring_buf *buf = &r->bufRing->bufs[tail & (URING_BUFFERS - 1)];
+    buf->addr = (unsigned long) (r->bufs + (size_t) bid * MAXLINE);
+    buf->len = MAXLINE;
+    buf->bid = bid;
+    __atomic_store_n(&r->bufRing->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+static int uringSetup(struct uring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+    r->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        // older kernels don't know the scheduling hints, they are only an optimisation
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        r->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    }
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return -1;
+    }
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return -1;
         }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        return -1;
+    }
 
-        if (n < 0) {
-            perror("read error!\n");
-            queueDestroy(Q);
-            escape = 1;
-            break;
+    r->sqHead = (unsigned *) (sq + p.sq_off.head);
+    r->sqTail = (unsigned *) (sq + p.sq_off.tail);
+    r->sqMask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    r->sqEntries = *(unsigned *) (sq + p.sq_off.ring_entries);
+    r->sqArray = (unsigned *) (sq + p.sq_off.array);
+    r->sqLocalTail = r->sqSubmitted = *r->sqTail;
+    r->cqHead = (unsigned *) (cq + p.cq_off.head);
+    r->cqTail = (unsigned *) (cq + p.cq_off.tail);
+    r->cqMask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // the provided buffer ring: recv requests take whichever buffer is next instead of each owning one
+    r->bufRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->bufs = malloc((size_t) URING_BUFFERS * MAXLINE);
+    if (r->bufRing == MAP_FAILED || r->bufs == NULL) {
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) r->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    r->bufRing->tail = 0;
+    for (unsigned i = 0; i < URING_BUFFERS; i++) {
+        uringRecycle(r, (unsigned short) i);
+    }
+    return 0;
+}
+
+static void uringAccept(struct uring *r) {
+    struct io_uring_sqe *sqe = uringSqe(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_OP_ACCEPT;
+}
+
+static void uringRecv(struct conn *c) {
+    struct io_uring_sqe *sqe = uringSqe(c->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->connfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uint64_t) (uintptr_t) c | URING_OP_RECV;
+    ++c->inflight;
+}
+
+// sends everything queued on the connection, unless a send is already out. the completion sends whatever piled up.
+// the kernel may read the buffer any time until the send completes, so the batch being sent is swapped out of pending,
+// where later replies could realloc it away.
+static void uringSend(struct conn *c) {
+    if (c->sendInFlight || c->closing || c->waiting) {
+        return;
+    }
+    if (c->sendingOff == c->sendingLen) {
+        if (c->pendingLen == 0) {
+            return;
         }
+        char *buf = c->sending;
+        size_t cap = c->sendingCap;
+        c->sending = c->pending;
+        c->sendingCap = c->pendingCap;
+        c->sendingLen = c->pendingLen;
+        c->sendingOff = 0;
+        c->pending = buf;
+        c->pendingCap = cap;
+        c->pendingLen = 0;
+    }
+    struct io_uring_sqe *sqe = uringSqe(c->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->connfd;
+    sqe->addr = (uint64_t) (uintptr_t) (c->sending + c->sendingOff);
+    sqe->len = (unsigned) (c->sendingLen - c->sendingOff);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t) (uintptr_t) c | URING_OP_SEND;
+    c->sendInFlight = 1;
+    ++c->inflight;
+}
 
-//                // response
-//                snprintf((char *) buff, sizeof(buff), "HTTP/1.0 200 OK\r\n\r\nHello :)");
+// starts tearing the connection down. shutdown() makes the outstanding recv finish, and the connection is freed
+// once the last of its requests has completed and it is off the waitList. returns 1 if it was freed right away.
+static int uringClose(struct conn *c) {
+    if (!c->closing) {
+        c->closing = 1;
+        shutdown(c->connfd, SHUT_RDWR);
+        ++stats->syscalls;
+    }
+    if (c->inflight > 0 || c->waiting) {
+        return 0;
+    }
+//    printf("CLOSING OLD CONNECTION.\n");
+    close(c->connfd);
+    ++stats->syscalls;
+    ++stats->closed;
+    free(c->pending);
+    free(c->sending);
+    free(c->inbuf);
+    free(c);
+    return 1;
+}
 
-        if (commandType == 0) {
-            if (msgLength != (int)(strlen(paramOne) + strlen(paramTwo)) + 2) {
-                write(connfd, "ERR\nLEN\n", strlen("ERR\nLEN\n"));
-                escape = 1;
-                break;
+static void uringCompletion(struct uring *r, struct io_uring_cqe *cqe) {
+    uint64_t op = cqe->user_data & URING_OP_MASK;
+    struct conn *c = (struct conn *) (uintptr_t) (cqe->user_data & ~URING_OP_MASK);
+
+    if (op == URING_OP_ACCEPT) {
+        if (cqe->res >= 0) {
+            c = calloc(1, sizeof(struct conn));
+            if (c == NULL) {
+                close(cqe->res);
+            } else {
+                c->connfd = cqe->res;
+                c->Q = r->Q;
+                c->ring = r;
+                ++stats->opened;
+                uringRecv(c);
             }
-            else {
-                //            printf("TOTAL LENGHT OF WORDS: %d",(int)(strlen(paramOne) + strlen(paramTwo)));
-                queue_add(Q, paramOne, paramTwo);
-                // response
-//                snprintf((char *) buff, sizeof(buff), "Added pair '%s':'%s'\n", paramOne, paramTwo);
-                write(connfd, "OKS\n", strlen("OKS\n"));
-            }
-        } else if (commandType == 1) {
-            if (msgLength != (int) strlen(paramOne) + 1) {
-                write(connfd,  "ERR\nLEN\n", strlen("ERR\nLEN\n"));
-                escape = 1;
-                break;
-            }
-            else {
-                // if the element exists or not. if doesnt, return key not found (KNF) error
-                if (alreadyExists(Q, paramOne)) {
-                    printf("KEY %s HAS VALUE %s\n", paramOne, queue_get(Q, paramOne));
-                    // response
-//                    snprintf((char *) buff, sizeof(buff), "Key %s has value %s\n", paramOne, queue_get(Q, paramOne));
-                    char tmpGetStr[100] = "";
-                    strcpy(tmpGetStr, queue_get(Q, paramOne));
-                    strcat(tmpGetStr, "\n");
-                    write(connfd, "OKG\n", strlen("OKG\n"));
-                    char lenBuff[20] = "";
-                    sprintf(lenBuff, "%d", (int) strlen(tmpGetStr));
-                    strcat(lenBuff, "\n");
-                    write(connfd, lenBuff, 17);
-                    write(connfd, tmpGetStr, strlen(tmpGetStr));
-                } else {
-                    write(connfd, "KNF\n", strlen("KNF\n"));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            uringAccept(r);   // the kernel dropped the multishot accept, ask again
+        }
+        return;
+    }
+
+    if (op == URING_OP_RECV) {
+        int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        if (!more) {
+            --c->inflight;
+        }
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            unsigned short bid = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            stats->bytesIn += cqe->res;
+            if (!c->closing) {
+                uint64_t logged = aof_thread_lsn();
+                connInput(c, r->bufs + (size_t) bid * MAXLINE, (size_t) cqe->res);
+                if (!c->waiting && aof_thread_lsn() != logged && !aof_durable(aof_thread_lsn())) {
+                    c->waiting = 1;     // the replies go out once the changes are on disk, see worker()
+                    c->waitNext = waitList;
+                    waitList = c;
                 }
+                uringSend(c);
             }
-        } else {
-            if (msgLength != (int) strlen(paramOne) + 1) {
-                write(connfd,  "ERR\nLEN\n", strlen("ERR\nLEN\n"));
-                escape = 1;
-                break;
-            }
-            else {
-                // response
-                if (alreadyExists(Q, paramOne)) {
-                    snprintf((char *) buff, sizeof(buff), "Removed pair at key %s\n", paramOne);
-                    write(connfd, "OKD\n", strlen("OKD\n"));
-                    char lenBuff[20] = "";
-                    char tmpGetStr[100] = "";
-                    strcpy(tmpGetStr, queue_get(Q, paramOne));
-                    strcat(tmpGetStr, "\n");
-                    queue_remove(Q, paramOne);
-                    sprintf(lenBuff, "%d", (int) strlen(tmpGetStr));
-                    strcat(lenBuff, "\n");
-                    write(connfd, lenBuff, 17);
-                    write(connfd, tmpGetStr, strlen(tmpGetStr));
-                } else {  //return KNF if key is not found.
-                    write(connfd, "KNF\n", strlen("KNF\n"));
+            uringRecycle(r, bid);
+        } else if (cqe->res != -ENOBUFS) {
+            c->escape = 1;    // the client hung up or the socket broke
+        }
+        if (c->escape && !c->sendInFlight && !c->waiting) {
+            uringClose(c);
+        } else if (!more && !c->closing) {
+            uringRecv(c);     // out of buffers for a moment, or the kernel ended the multishot. keep listening
+        } else if (c->closing && c->inflight == 0) {
+            uringClose(c);
+        }
+        return;
+    }
+
+    // URING_OP_SEND
+    --c->inflight;
+    c->sendInFlight = 0;
+    if (cqe->res < 0) {
+        c->escape = 1;
+        c->pendingLen = 0;
+        c->sendingOff = c->sendingLen;
+    } else {
+        c->sendingOff += cqe->res;
+        stats->bytesOut += cqe->res;
+    }
+    if (c->closing || (c->escape && c->pendingLen == 0 && c->sendingOff == c->sendingLen)) {
+        uringClose(c);
+    } else {
+        uringSend(c);
+    }
+}
+
+// one worker thread with its own ring. the listening socket is shared, every ring keeps a multishot accept on it.
+static void * worker(void *arguements) {
+    struct worker_args *args = (struct worker_args *) arguements;
+    struct uring r;
+    stats = &workerStats[args->id];
+
+    memset(&r, 0, sizeof(r));
+    r.listenfd = args->listenfd;
+    r.Q = args->Q;
+    if (uringSetup(&r) < 0) {
+        perror("io_uring setup error!\n");
+        return NULL;
+    }
+    uringAccept(&r);
+
+    for (;;) {
+        if (uringSubmit(&r, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter error!\n");
+            return NULL;
+        }
+
+        unsigned head = *r.cqHead;
+        unsigned tail = __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            uringCompletion(&r, &r.cqes[head & r.cqMask]);
+            ++head;
+        }
+        __atomic_store_n(r.cqHead, head, __ATOMIC_RELEASE);
+
+        // one wait for the disk covers every change the batch made
+        if (waitList != NULL) {
+            int lost = aof_wait(aof_thread_lsn()) < 0;
+            while (waitList != NULL) {
+                struct conn *c = waitList;
+                waitList = c->waitNext;
+                c->waiting = 0;
+                if (lost) {
+                    connLost(c);
+                }
+                if (c->closing) {
+                    uringClose(c);
+                    continue;
+                }
+                uringSend(c);
+                if (c->escape && !c->sendInFlight) {
+                    uringClose(c);
                 }
             }
         }
+    }
+}
 
-        printf("CURRENT CONTENTS OF THE QUEUE:\n");
-        queuePrint(Q);
-        printf("=============================\n\n");
-
+#endif
+
+// ------------------------------- END OF EVENT LOOP -------------------------------
+
+// reads a byte count like "512", "64k", "100m" or "2g". returns 0 if it isn't one.
+static size_t parseSize(const char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'g': case 'G': size <<= 10;
+        // fall through
+        case 'm': case 'M': size <<= 10;
+        // fall through
+        case 'k': case 'K': size <<= 10;
+            ++end;
     }
-    // closing things
-    write(connfd, (char *) buff, strlen((char *) buff));
-//    printf("CLOSING OLD CONNECTION.\n");
-    close(connfd);
-    free(arguements);
+    return *end == '\0' && end != text ? (size_t) size : 0;
 }
 
 int main(int argc, char *argv[argc]) {
 //    printf("Hello, World!\n");
 
-    // check arguements. there must be only one, and it must be an integer.
-    if (argc != 2) {
+    // options come first (getopt_long moves them in front of the rest), then the positional arguements
+    static const struct option options[] = {
+        {"maxmemory", required_argument, NULL, 'm'},
+        {"filter", no_argument, NULL, 'f'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"log-file", required_argument, NULL, 'o'},
+        {"aof", required_argument, NULL, 'a'},
+        {"aof-fsync", required_argument, NULL, 's'},
+        {"snapshot", required_argument, NULL, 'n'},
+        {"store-file", required_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
+    size_t maxMemory = 0;
+    int filter = 0;
+    int level = LOG_LEVEL_WARN;
+    const char *logPath = NULL;
+    const char *aofPath = NULL;
+    const char *storePath = NULL;
+    int aofPolicy = AOF_FSYNC_DEFAULT;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        if (opt == 'f') {
+            filter = 1;
+        } else if (opt == 'o') {
+            logPath = optarg;
+        } else if (opt == 'a') {
+            aofPath = optarg;
+        } else if (opt == 'n') {
+            snapshotPath = optarg;
+        } else if (opt == 'p') {
+            storePath = optarg;
+        } else if ((opt != 'm' || (maxMemory = parseSize(optarg)) == 0) &&
+                   (opt != 'l' || (level = log_parse_level(optarg)) < 0) &&
+                   (opt != 's' || (aofPolicy = aof_parse_policy(optarg)) < AOF_FSYNC_ALWAYS)) {
+            fprintf(stderr, "USAGE: %s [--maxmemory bytes[k|m|g]] [--filter] [--log-level off|error|warn|info|debug] "
+                            "[--log-file path] [--aof path] [--aof-fsync always|never|ms] [--snapshot path] "
+                            "[--store-file path] port [shards] [max item]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // check arguements. the port is required, the shard count and maximum item size are optional. all must be integers.
+    if (argc < 2 || argc > 4) {
         perror("NOT ENOUGH ARGUEMENTS PROVIDED!\n");
         return EXIT_FAILURE;
     }
     int serverPort = atoi(argv[1]);
+    int shards = argc >= 3 ? atoi(argv[2]) : QUEUE_SHARDS;
+    if (shards <= 0 || shards > QUEUE_MAX_SHARDS || (shards & (shards - 1)) != 0) {
+        fprintf(stderr, "SHARD COUNT MUST BE A POWER OF TWO BETWEEN 1 AND %d!\n", QUEUE_MAX_SHARDS);
+        return EXIT_FAILURE;
+    }
+    long maxItem = argc == 4 ? atol(argv[3]) : QUEUE_MAX_ITEM;
+    if (maxItem < QUEUE_MAX_KEY + 1 || maxItem > QUEUE_MAX_ITEM_LIMIT) {
+        fprintf(stderr, "MAXIMUM ITEM SIZE MUST BE BETWEEN %d AND %u BYTES!\n", QUEUE_MAX_KEY + 1, QUEUE_MAX_ITEM_LIMIT);
+        return EXIT_FAILURE;
+    }
+
+    if (log_init(level, logPath) != EXIT_SUCCESS) {
+        perror("log file error!\n");
+        return EXIT_FAILURE;
+    }
 
-    int listenfd, connfd, n;
+    int listenfd;
     struct sockaddr_in servaddr;
 
+    // a client hanging up while we write to it must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    // tens of thousands of clients need tens of thousands of descriptors, so go up to the hard limit
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
     // allocate a socket
     if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket allocation error!\n");
         return EXIT_FAILURE;
     }
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // replies already leave in one write per batch, Nagle would only hold back the tail of a pipeline.
+    // accepted sockets inherit this
+    setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &reuse, sizeof(reuse));
 
     // setting up the address
     bzero(&servaddr, sizeof(servaddr));
@@ -511,54 +1689,111 @@ int main(int argc, char *argv[argc]) {
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(serverPort);
 
-    // listen and bind
+    // bind now, so a port in use is caught before a long load. clients are only let in by listen() once the store
+    // is loaded; until then they are refused rather than left hanging in the backlog
     if ((bind(listenfd, (SA *) &servaddr, sizeof(servaddr)) < 0)) {
         perror("bind allocation error!\n");
         return EXIT_FAILURE;
     }
 
-    if (listen(listenfd, SERVER_BACKLOG) < 0) {
-        perror("listening error!\n");
+    // static, since the workers and the compactor go on using it while exit() runs
+    static struct queue Q;
+    struct queue_config config = {.shards = (unsigned) shards, .maxItem = (size_t) maxItem, .maxMemory = maxMemory,
+                                  .filter = filter, .path = storePath};
+    struct timespec opened, ready;
+    clock_gettime(CLOCK_MONOTONIC, &opened);
+    if (queue_init(&Q, &config) != EXIT_SUCCESS) {
+        perror("queue allocation error!\n");
+        return EXIT_FAILURE;
+    }
+    if (Q.restored) {
+        // the store is back as it was at its last checkpoint, a snapshot would only be older
+        clock_gettime(CLOCK_MONOTONIC, &ready);
+        printf("store: reopened %s at checkpoint %lu with %u keys in %.2f ms\n", storePath,
+               (unsigned long) Q.generation, queue_count(&Q),
+               (ready.tv_sec - opened.tv_sec) * 1e3 + (ready.tv_nsec - opened.tv_nsec) / 1e6);
+    } else if (snapshot_load(&Q, snapshotPath) < 0 && errno != ENOENT) {
+        perror("snapshot error!\n");
+        return EXIT_FAILURE;
+    }
+    if (aofPath != NULL && aof_open(aofPath, aofPolicy, &Q) != EXIT_SUCCESS) {
+        perror("aof error!\n");
         return EXIT_FAILURE;
     }
 
-    struct queue Q;
-    queue_init(&Q);
+    if (listen(listenfd, SERVER_BACKLOG) < 0 || setNonBlocking(listenfd) < 0) {
+        perror("listening error!\n");
+        return EXIT_FAILURE;
+    }
 
     if (DEBUG_SOCKETS) {
-        // endless loop POG. listening for connections B)
-        // macro to suppress annoying infinite loop warnings. like duh i know im in an infinite loop silly compooter it is by DESIGN
-        #pragma clang diagnostic push
-        #pragma ide diagnostic ignored "EndlessLoop"
-        for (;;) {
-            struct sockaddr_in addr;
-            socklen_t addr_len;
-
-            // accept until connection arrives, returns to connfd when connection is made
-            printf("Waiting for a connection on port %d\n", serverPort);
-            fflush(stdout);
-            connfd = accept(listenfd, (SA *) NULL, NULL);
-
-            // MULTITHREADING: Each new connection gets its own thread, so message overlapping does not occur. also efficient. and cool.
-
-            pthread_t t;
-            n = 0;
-            //TODO: something is wrong with the following line. fix it, and we will have multithreading.
-            //HYPOTHESIS: it has something to do with lines 461 thru 466, this is where args is constantly redifined. our old threads lose a pointer to it.
-            struct arg_struct *args2 = malloc(sizeof (struct arg_struct));
-            args2->connfd_STRUCT = connfd;
-            args2->Q = &Q;
-            args2->n = n;
-            pthread_create(&t, NULL, connection, (void *)args2);
-//            sleep(15);
-//            connection((void* )&args);
-        }
-        #pragma clang diagnostic pop
+        // one worker per core. each one runs its own event loop, so they never hand connections to each other.
+        long workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers < 1) {
+            workers = 1;
+        }
+        if (workers > SERVER_MAX_WORKERS) {
+            workers = SERVER_MAX_WORKERS;
+        }
+        workerCount = workers;
+        startTime = time(NULL);
+
+        // ctrl + C and kill are only ever taken by this thread. the workers inherit the blocked mask
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+        pthread_t t[SERVER_MAX_WORKERS];
+        struct worker_args args[SERVER_MAX_WORKERS];
+        for (long i = 0; i < workers; i++) {
+            args[i].listenfd = listenfd;
+            args[i].Q = &Q;
+            args[i].id = (int) i;
+            if (pthread_create(&t[i], NULL, worker, &args[i]) != 0) {
+                perror("worker thread error!\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        printf("Waiting for connections on port %d (%ld %s workers, %d shards)\n", serverPort, workers, SERVER_BACKEND,
+               shards);
+        fflush(stdout);
+
+        int signum;
+        sigwait(&stopSignals, &signum);
+
+        // say how hard the networking backend had to work, then let the exit take the workers down with it
+        unsigned long commands = 0, syscalls = 0;
+        for (long i = 0; i < workers; i++) {
+            commands += __atomic_load_n(&workerStats[i].commands, __ATOMIC_RELAXED);
+            syscalls += __atomic_load_n(&workerStats[i].syscalls, __ATOMIC_RELAXED);
+        }
+        printf("\n%s: %lu commands, %lu syscalls, %.2f syscalls per command\n", SERVER_BACKEND, commands, syscalls,
+               commands ? (double) syscalls / commands : 0.0);
+        printf("store: %u keys in %zu bytes of pages, %lu evicted, %lu pages moved between size classes\n",
+               queue_count(&Q), queue_memory(&Q), queue_evictions(&Q), queue_pages_moved(&Q));
+        // with a store file, nothing may change between the last logged change and the checkpoint, so the workers
+        // are held off for good first
+        if (storePath != NULL) {
+            queue_lock_all(&Q);
+        }
+        aof_shutdown();
+        if (storePath != NULL) {
+            if (queue_checkpoint(&Q, aof_log_id(), aof_log_end()) != EXIT_SUCCESS) {
+                perror("store file error!\n");
+            } else {
+                printf("store: checkpoint %lu written to %s\n", (unsigned long) Q.generation, storePath);
+            }
+        }
+        log_shutdown();
+        return EXIT_SUCCESS;
     }
 
     if (DEBUG_QUEUE) {
         struct queue Q;
-        queue_init(&Q);
+        queue_init(&Q, NULL);
         queue_add(&Q, "key1", "value1");
         queue_add(&Q, "key2", "value2");
         queue_add(&Q, "key3", "value3");
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Training run for profile-guided optimization. Starts an instrumented server, drives a few typical workloads at it
+# with hashbench (mostly GETs, a pipelined even mix, many connections) and stops it with ctrl + C, so it exits the
+# normal way and writes out its profile.
+#
+# USAGE: sh pgo-train.sh server hashbench [port]
+
+server=$1
+bench=$2
+port=${3:-18999}
+if [ -z "$server" ] || [ -z "$bench" ]; then
+    echo "USAGE: $0 server hashbench [port]" >&2
+    exit 1
+fi
+
+"$server" "$port" > /dev/null &
+pid=$!
+sleep 1
+
+status=0
+"$bench" -p "$port" -c 8 -n 50000 -k 10000 -r 90 || status=1
+"$bench" -p "$port" -c 4 -d 64 -n 200000 -k 10000 -r 50 || status=1
+"$bench" -p "$port" -c 64 -d 4 -n 10000 -k 1000 -r 99 || status=1
+
+kill -INT "$pid"
+wait "$pid"
+exit $status
@@ -0,0 +1,71 @@
+/*
+ * HashServer binary protocol -- a compact framing of the same commands as the text protocol, for clients that want
+ * to skip the text parsing.
+ *
+ * IMPLEMENTATION AND SHORT DESCRIPTION:
+ *      The first byte a client sends picks the protocol for the whole connection: PROTOCOL_REQUEST, which no text
+ *      command starts with, makes it a binary connection. Every request is then a PROTOCOL_HEADER byte header
+ *      followed by the raw bytes of the key and then of the value, with nothing in between and nothing after:
+ *
+ *          byte  0     PROTOCOL_REQUEST
+ *          byte  1     opcode, the command
+ *          bytes 2-3   key length
+ *          bytes 4-7   value length
+ *          bytes 8-11  opaque, anything the client likes. it comes back untouched in the reply
+ *          bytes 12-15 seconds to live for SETEX and EXPIRE (signed), 0 otherwise
+ *
+ *      Every reply is a header of the same size and shape, followed by value length bytes of value:
+ *
+ *          byte  0     PROTOCOL_RESPONSE
+ *          byte  1     the opcode of the request
+ *          bytes 2-3   status
+ *          bytes 4-7   value length
+ *          bytes 8-11  opaque of the request
+ *          bytes 12-15 seconds left to live for TTL (signed, -1 if it never expires), 0 otherwise
+ *
+ *      Numbers are little-endian. Replies come back in the order of the requests. Keys and values are any bytes at
+ *      all, and the server finds them by their lengths alone, right where they were received: it never copies or
+ *      scans a request. A SET or SETEX carries a key and a value, DUMP, STATS and SNAPSHOT neither, every other
+ *      command just a key; a request that doesn't fit its opcode, an unknown opcode or a key or value that is too
+ *      long is answered with PROTOCOL_BAD or PROTOCOL_LEN and the connection is closed, like their text
+ *      counterparts. The batch commands are text only, a binary client pipelines its requests instead.
+ */
+
+#ifndef HASHSERVER_PROTOCOL_H
+#define HASHSERVER_PROTOCOL_H
+
+// Define parameters
+#define PROTOCOL_HEADER 16
+#define PROTOCOL_REQUEST 0x80
+#define PROTOCOL_RESPONSE 0x81
+
+// where each field of a header starts
+#define PROTOCOL_MAGIC 0
+#define PROTOCOL_OPCODE 1
+#define PROTOCOL_KEY_LEN 2      // in a request
+#define PROTOCOL_STATUS 2       // in a reply
+#define PROTOCOL_VALUE_LEN 4
+#define PROTOCOL_OPAQUE 8
+#define PROTOCOL_SECONDS 12
+
+// opcodes, the numbers of the text commands
+#define PROTOCOL_SET 0
+#define PROTOCOL_GET 1
+#define PROTOCOL_DEL 2
+#define PROTOCOL_SETEX 4
+#define PROTOCOL_EXPIRE 5
+#define PROTOCOL_TTL 6
+#define PROTOCOL_DUMP 7
+#define PROTOCOL_STATS 8
+#define PROTOCOL_SNAPSHOT 9
+
+// statuses. OK is every OK... reply of the text protocol, the others are KNF and the ERR replies
+#define PROTOCOL_OK 0
+#define PROTOCOL_KNF 1
+#define PROTOCOL_LEN 2
+#define PROTOCOL_MEM 3
+#define PROTOCOL_TTL_ERROR 4
+#define PROTOCOL_BAD 5
+#define PROTOCOL_SNP 6
+
+#endif
@@ -0,0 +1,2083 @@
+/*
+ * HashServer storage -- see queue.h for a description of the layout.
+ */
+
+// Imports
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "queue.h"
+
+#define ITEM_SHIFT 4                // chunks are 16 byte aligned, so a 32 bit chunk reference covers 64GB of arena
+#define CHUNK_MIN 32                // smallest size class
+#define CLASS_GROWTH 1.25           // each size class is this much bigger than the one before
+#define ARENA_LIMIT ((size_t) 0xFFFFFFFEu << ITEM_SHIFT)   // most arena a shard can address
+#define INDEX_EMPTY 0
+#define INDEX_TOMBSTONE 0xFFFFFFFFull   // tag 0, position bits all set. never a valid position + 1
+#define SLOT_REF (1ull << 63)       // top tag bit: the key was read since the eviction clock last passed it
+#define COMPACT_BATCH 4096          // index slots the compactor cleans per lock hold
+#define COMPACT_INTERVAL_NS 10000000 // compactor nap between batches when there is little to clean (10ms)
+#define READ_RETRIES 64             // optimistic read attempts before a reader falls back to the shard lock
+#define REHASH_BATCH 256            // old index slots a write moves to the new table while the index is being resized
+#define INDEX_MAX (1u << 31)        // most slots a shard's index can grow to
+#define FILTER_BLOCK 64             // bytes per Bloom filter block, a cache line of 128 four bit counters
+#define FILTER_SPREAD 32            // index slots per filter block, so 2 filter bytes per 8 byte slot
+#define FILTER_HASHES 4             // counters a key sets, all in one block
+#define FILTER_FULL 15              // a counter that got this high sticks
+#define DUMP_BATCH 1024             // chunks queue_dump() looks at per lock hold
+#define PAIR_FORMAT_EXTRA 64        // bytes a printed pair takes besides its key and value, see pairFormat()
+#define EXPIRE_BATCH 1024           // timing wheel entries the compactor handles per shard and lock hold
+#define WHEEL_SLOTS (1u << QUEUE_WHEEL_BITS)
+#define WHEEL_REACH (1u << (QUEUE_WHEEL_BITS * QUEUE_WHEEL_LEVELS))  // seconds the wheel can see ahead
+#define WHEEL_KEEP 1024             // entries an emptied wheel slot keeps room for, bigger arrays are freed
+#define BATCH_PREFETCH 4            // keys of a batch whose items are prefetched ahead of the one being looked up
+#define BATCH_GET 0                 // batchRun() looks keys up, next to QUEUE_OP_SET and QUEUE_OP_DEL
+#define REBUILD_BATCH 4096          // index slots the compactor refills the timing wheel from per lock hold
+#define FILE_MAGIC "HSSTORE"        // with its NUL, the first 8 bytes of a store file
+#define FILE_VERSION 1
+
+// ------------------------------- HASHING -------------------------------
+
+// MurmurHash64A by Austin Appleby (public domain). Eats the key 8 bytes at a time, which is plenty fast for our key sizes.
+uint64_t queue_hash(const void *key, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t h = 0x9747b28c ^ (len * m);
+
+    const unsigned char *data = (const unsigned char *) key;
+    const unsigned char *end = data + (len & ~(size_t) 7);
+
+    while (data != end) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        data += 8;
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7) {
+        case 7: h ^= (uint64_t) data[6] << 48;
+        // fall through
+        case 6: h ^= (uint64_t) data[5] << 40;
+        // fall through
+        case 5: h ^= (uint64_t) data[4] << 32;
+        // fall through
+        case 4: h ^= (uint64_t) data[3] << 24;
+        // fall through
+        case 3: h ^= (uint64_t) data[2] << 16;
+        // fall through
+        case 2: h ^= (uint64_t) data[1] << 8;
+        // fall through
+        case 1: h ^= (uint64_t) data[0];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+// ------------------------------- HASH INDEX -------------------------------
+
+static inline uint64_t slotTag(uint64_t hash) {
+    return (hash >> 32) & 0x7FFFFFFFu;
+}
+
+static inline int slotMatches(uint64_t slot, uint64_t tag) {
+    return ((slot & ~SLOT_REF) >> 32) == tag;
+}
+
+static inline uint64_t makeSlot(uint64_t hash, unsigned ref) {
+    return (slotTag(hash) << 32) | (uint64_t) (ref + 1);
+}
+
+static inline int slotLive(uint64_t slot) {
+    return slot != INDEX_EMPTY && slot != INDEX_TOMBSTONE;
+}
+
+static inline unsigned slotPosition(uint64_t slot) {
+    return (unsigned) (slot & 0xFFFFFFFFu) - 1;
+}
+
+static inline struct item *itemAt(struct shard *S, unsigned ref) {
+    return (struct item *) (S->arena + ((size_t) ref << ITEM_SHIFT));
+}
+
+static inline size_t itemSize(size_t keyLen, size_t valueLen) {
+    return sizeof(struct item) + keyLen + 1 + valueLen + 1;
+}
+
+static inline char *itemValue(struct item *e) {
+    return e->data + e->keyLen + 1;
+}
+
+// the top bits of the hash pick the shard, the bottom bits pick the home slot inside it.
+static inline struct shard *shardOf(struct queue *Q, uint64_t hash) {
+    return Q->shardBits == 0 ? &Q->shards[0] : &Q->shards[hash >> (64 - Q->shardBits)];
+}
+
+// writers bump the shard sequence to odd before touching the shard and back to even afterwards. caller holds S->lock.
+static inline void writeBegin(struct shard *S) {
+    __atomic_store_n(&S->seq, S->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void writeEnd(struct shard *S) {
+    __atomic_store_n(&S->seq, S->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline size_t filterBytes(unsigned size) {
+    return size < FILTER_SPREAD ? FILTER_BLOCK : (size_t) size / FILTER_SPREAD * FILTER_BLOCK;
+}
+
+static inline size_t tableBytesFor(unsigned size, int withFilter) {
+    return sizeof(struct index_table) + (size_t) size * sizeof(uint64_t) + (withFilter ? filterBytes(size) : 0);
+}
+
+static size_t tableBytes(struct index_table *T) {
+    return tableBytesFor(T->mask + 1, T->filter != NULL);
+}
+
+// fills in the header of a table of size slots at T. the slots and the filter are left as they are.
+static void tableSetup(struct index_table *T, unsigned size, int withFilter) {
+    T->mask = size - 1;
+    T->released = 0;
+    T->retired = NULL;
+    T->filter = withFilter ? (unsigned char *) &T->slots[size] : NULL;
+    T->filterMask = withFilter ? (unsigned) (filterBytes(size) / FILTER_BLOCK) - 1 : 0;
+}
+
+// maps a fresh, all empty table of size slots, followed by its Bloom filter if withFilter is set. NULL if we ran
+// out of memory.
+static struct index_table *tableCreate(unsigned size, int withFilter) {
+    struct index_table *T = mmap(NULL, tableBytesFor(size, withFilter), PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (T == MAP_FAILED) {
+        return NULL;
+    }
+    tableSetup(T, size, withFilter);
+    return T;
+}
+
+// the filter block and counters come from a remix of the hash, since its bits already pick the shard, the home slot
+// and the tag, and keys sharing those must not share counters as well
+static inline uint64_t filterMix(uint64_t hash) {
+    hash ^= hash >> 31;
+    hash *= 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+}
+
+static inline unsigned char *filterBlock(struct index_table *T, uint64_t mixed) {
+    return T->filter + (size_t) ((unsigned) (mixed >> 32) & T->filterMask) * FILTER_BLOCK;
+}
+
+// counter n of the key, 7 bits each from the bottom of the mixed hash
+static inline unsigned filterCounter(uint64_t mixed, unsigned n) {
+    return (unsigned) (mixed >> (7 * n)) & 127;
+}
+
+// returns 0 if T certainly doesn't hold the key, 1 if it may. lock-free readers call this too, a torn answer is
+// caught by their sequence check.
+static int filterMaybe(struct index_table *T, uint64_t hash) {
+    uint64_t mixed = filterMix(hash);
+    unsigned char *block = filterBlock(T, mixed);
+    for (unsigned n = 0; n < FILTER_HASHES; n++) {
+        unsigned c = filterCounter(mixed, n);
+        if (((__atomic_load_n(&block[c / 2], __ATOMIC_RELAXED) >> (4 * (c & 1))) & 0xF) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// counts a key in or out of T's filter (delta 1 or -1). caller holds S->lock and is inside a write section.
+static void filterCount(struct index_table *T, uint64_t hash, int delta) {
+    if (T->filter == NULL) {
+        return;
+    }
+    uint64_t mixed = filterMix(hash);
+    unsigned char *block = filterBlock(T, mixed);
+    for (unsigned n = 0; n < FILTER_HASHES; n++) {
+        unsigned c = filterCounter(mixed, n);
+        unsigned shift = 4 * (c & 1);
+        unsigned value = (block[c / 2] >> shift) & 0xF;
+        if (value == FILTER_FULL || (delta < 0 && value == 0)) {
+            continue;
+        }
+        value += delta;
+        __atomic_store_n(&block[c / 2], (unsigned char) ((block[c / 2] & ~(0xF << shift)) | (value << shift)),
+                         __ATOMIC_RELAXED);
+    }
+}
+
+// a drained table may still be walked by lock-free readers, so its address space stays mapped until the queue is
+// destroyed. the compactor gives the memory behind its slots back to the system later, outside the shard lock (see
+// tableRelease). caller holds S->lock.
+static void tableRetire(struct shard *S, struct index_table *T) {
+    T->retired = S->retired;
+    S->retired = T;
+}
+
+// hands the slots of a retired table back to the system. a straggling reader sees empty slots there and its sequence
+// check sends it back to the current table. the header page stays, so the table's mask and list link survive.
+static void tableRelease(struct index_table *T) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t bytes = tableBytes(T);
+    if (bytes > page) {
+        madvise((char *) T + page, bytes - page, MADV_DONTNEED);
+    }
+    T->released = 1;
+}
+
+// returns the slot of T holding key, or NULL if it is not there. while T is being drained into a bigger table its
+// slots below cursor have already moved, so probing jumps over them. pass 0 for a table that isn't being drained.
+static uint64_t *tableFind(struct shard *S, struct index_table *T, unsigned cursor, const char *key, size_t keyLen,
+                           uint64_t hash) {
+    if (T->filter != NULL && !filterMaybe(T, hash)) {
+        return NULL;
+    }
+    uint64_t tag = slotTag(hash);
+    unsigned i = (unsigned) hash & T->mask;
+    for (unsigned probes = 0; probes <= T->mask; probes++) {
+        if (i < cursor) {
+            i = cursor;
+        }
+        uint64_t slot = T->slots[i];
+        if (slot == INDEX_EMPTY) {
+            return NULL;
+        }
+        if (slotLive(slot) && slotMatches(slot, tag)) {
+            struct item *e = itemAt(S, slotPosition(slot));
+            if (e->hash == hash && e->keyLen == keyLen && memcmp(e->data, key, keyLen) == 0) {
+                return &T->slots[i];
+            }
+        }
+        i = (i + 1) & T->mask;
+    }
+    return NULL;
+}
+
+// returns the index slot holding key, or NULL if the key is not stored. caller holds S->lock.
+static uint64_t *findSlot(struct shard *S, const char *key, size_t keyLen, uint64_t hash) {
+    uint64_t *slot = tableFind(S, S->index, 0, key, keyLen, hash);
+    if (slot == NULL && S->oldIndex != NULL) {
+        slot = tableFind(S, S->oldIndex, S->migrateCursor, key, keyLen, hash);
+    }
+    return slot;
+}
+
+// new keys always go into the current table. caller holds S->lock.
+static void insertSlot(struct shard *S, uint64_t hash, unsigned ref) {
+    struct index_table *T = S->index;
+    unsigned i = (unsigned) hash & T->mask;
+    while (slotLive(T->slots[i])) {
+        i = (i + 1) & T->mask;
+    }
+    if (T->slots[i] == INDEX_TOMBSTONE) {
+        --S->tombstones;
+    }
+    T->slots[i] = makeSlot(hash, ref);
+    filterCount(T, hash, 1);
+}
+
+// starts moving the shard over to a fresh table of size slots. a bigger table makes room for more keys, one of the
+// same size gets rid of a pile of tombstones. nothing moves yet, migrateStep() drains the old table a batch at a time.
+// caller holds S->lock and is inside a write section. returns -1 if we ran out of memory.
+static int startRehash(struct shard *S, unsigned size) {
+    struct index_table *T = tableCreate(size, S->filter);
+    if (T == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&S->oldIndex, S->index, __ATOMIC_RELEASE);
+    __atomic_store_n(&S->migrateCursor, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->index, T, __ATOMIC_RELEASE);
+    S->tombstones = 0;
+    S->compactCursor = 0;
+    return 0;
+}
+
+// moves the live entries of up to budget slots of the old table into the current one. once the last slot is done the
+// old table is retired. caller holds S->lock and is inside a write section. returns slots examined.
+static unsigned migrateStep(struct shard *S, unsigned budget) {
+    struct index_table *old = S->oldIndex;
+    unsigned examined = 0;
+    while (examined < budget && S->migrateCursor <= old->mask) {
+        uint64_t slot = old->slots[S->migrateCursor];
+        if (slotLive(slot)) {
+            insertSlot(S, itemAt(S, slotPosition(slot))->hash, slotPosition(slot));
+        }
+        __atomic_store_n(&S->migrateCursor, S->migrateCursor + 1, __ATOMIC_RELAXED);
+        ++examined;
+    }
+    if (S->migrateCursor > old->mask) {
+        __atomic_store_n(&S->oldIndex, NULL, __ATOMIC_RELEASE);
+        tableRetire(S, old);
+    }
+    return examined;
+}
+
+// makes sure the current table has room for one more key, starting a resize if it is getting full and moving the
+// resize along if one is under way. caller holds S->lock and is inside a write section. returns -1 if the table is
+// full and can't grow.
+static int indexReserve(struct shard *S) {
+    if (S->oldIndex != NULL) {
+        migrateStep(S, REHASH_BATCH);
+    }
+    unsigned size = S->index->mask + 1;
+    if (S->oldIndex == NULL) {
+        if (S->count + 1 > size / 2 && size < INDEX_MAX) {
+            startRehash(S, size * 2);
+        } else if (S->tombstones > size / 4) {
+            // the compactor normally keeps up. if it hasn't, move to a clean table before probe chains get long
+            startRehash(S, size);
+        }
+    }
+    // a table that could not grow still works up to nearly full, as long as probe chains end somewhere
+    return S->count + S->tombstones + 1 < S->index->mask ? 0 : -1;
+}
+
+// gets rid of the tombstone at slot i of the current table. live entries further down the probe chain are pulled back
+// into the hole as long as they stay reachable from their home slot, and the last hole becomes empty once the chain
+// ends. returns slots examined.
+static unsigned purgeTombstone(struct shard *S, unsigned i) {
+    struct index_table *T = S->index;
+    unsigned mask = T->mask;
+    unsigned hole = i;
+    unsigned examined = 0;
+    for (unsigned j = (i + 1) & mask; ; j = (j + 1) & mask) {
+        uint64_t slot = T->slots[j];
+        ++examined;
+        if (slot == INDEX_EMPTY) {
+            T->slots[hole] = INDEX_EMPTY;
+            --S->tombstones;
+            return examined;
+        }
+        if (slot == INDEX_TOMBSTONE) {
+            continue;
+        }
+        unsigned home = (unsigned) itemAt(S, slotPosition(slot))->hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            T->slots[hole] = slot;
+            T->slots[j] = INDEX_TOMBSTONE;
+            hole = j;
+        }
+    }
+}
+
+// ------------------------------- SLAB ALLOCATION -------------------------------
+
+// smallest size class whose chunks fit size bytes. size is at most Q->pageSize.
+static unsigned classFor(struct queue *Q, size_t size) {
+    unsigned low = 0, high = Q->classCount - 1;
+    while (low < high) {
+        unsigned middle = (low + high) / 2;
+        if (Q->classSize[middle] < size) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// number of the slab page chunk ref lies in
+static inline size_t pageOf(struct queue *Q, unsigned ref) {
+    return ((size_t) ref << ITEM_SHIFT) / Q->pageSize;
+}
+
+static int evictFor(struct queue *Q, struct shard *S, unsigned cls);
+
+// hands out a chunk of class cls, from the class's free list if it has one, otherwise from its newest page. a full
+// page is followed by a fresh one from the arena. once the shard has all the pages it may have, a store with a memory
+// limit evicts to make room (see evictFor). caller holds S->lock and is inside a write section. returns the chunk
+// reference, or -1 if the shard is out of memory.
+static long chunkAlloc(struct queue *Q, struct shard *S, unsigned cls) {
+    struct slab_class *C = &S->classes[cls];
+    for (;;) {
+        if (C->freeHead != 0) {
+            unsigned ref = C->freeHead - 1;
+            C->freeHead = (unsigned) itemAt(S, ref)->hash;
+            return ref;
+        }
+        if (C->next + Q->classSize[cls] <= C->end) {
+            unsigned ref = (unsigned) (C->next >> ITEM_SHIFT);
+            C->next += Q->classSize[cls];
+            return ref;
+        }
+        if (S->arenaUsed + Q->pageSize <= S->pageLimit) {
+            S->pageClass[S->arenaUsed / Q->pageSize] = (unsigned char) cls;
+            ++C->pages;
+            C->next = S->arenaUsed;
+            C->end = S->arenaUsed + Q->pageSize;
+            S->arenaUsed = C->end;
+            continue;
+        }
+        if (!S->evict || evictFor(Q, S, cls) < 0) {
+            return -1;
+        }
+    }
+}
+
+// puts a chunk back on its class's free list. caller holds S->lock and is inside a write section, since lock-free
+// readers may still look at the chunk.
+static void chunkFree(struct shard *S, unsigned cls, unsigned ref) {
+    itemAt(S, ref)->hash = S->classes[cls].freeHead;
+    S->classes[cls].freeHead = ref + 1;
+}
+
+static void itemWrite(struct item *e, uint64_t hash, const char *key, size_t keyLen, const char *value, size_t valueLen) {
+    e->hash = hash;
+    e->keyLen = (uint32_t) keyLen;
+    e->valueLen = (uint32_t) valueLen;
+    memcpy(e->data, key, keyLen);
+    e->data[keyLen] = '\0';
+    memcpy(e->data + keyLen + 1, value, valueLen);
+    e->data[keyLen + 1 + valueLen] = '\0';
+}
+
+// makes *buf at least need bytes long. returns -1 if we ran out of memory.
+static int growBuffer(char **buf, size_t *bufSize, size_t need) {
+    if (*bufSize >= need) {
+        return 0;
+    }
+    size_t size = *bufSize ? *bufSize : 64;
+    while (size < need) {
+        size *= 2;
+    }
+    char *grown = realloc(*buf, size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buf = grown;
+    *bufSize = size;
+    return 0;
+}
+
+// ------------------------------- EVICTION -------------------------------
+
+// drops the item in slot i of the current table to make room. its chunk goes back on the free list unless the whole
+// page is being taken away. a full store evicts on nearly every SET, so the slot is cleaned up right away instead of
+// leaving a tombstone for the compactor. caller holds S->lock and is inside a write section.
+static void evictSlot(struct queue *Q, struct shard *S, unsigned i, int freeChunk) {
+    unsigned ref = slotPosition(S->index->slots[i]);
+    filterCount(S->index, itemAt(S, ref)->hash, -1);
+    S->index->slots[i] = INDEX_TOMBSTONE;
+    ++S->tombstones;
+    purgeTombstone(S, i);
+    --S->count;
+    if (freeChunk) {
+        chunkFree(S, S->pageClass[pageOf(Q, ref)], ref);
+    }
+    __atomic_store_n(&S->evictions, S->evictions + 1, __ATOMIC_RELAXED);
+}
+
+// evicts one item of class cls with the CLOCK algorithm. the hand sweeps the current table; a key that was read since
+// the hand last came by has SLOT_REF set and gets a second chance, the first one without it goes. two rounds are
+// always enough, the first can only clear bits. returns 0 if a chunk was freed, -1 if the class has no items at all.
+static int clockEvict(struct queue *Q, struct shard *S, unsigned cls) {
+    struct index_table *T = S->index;
+    for (uint64_t n = 0; n < 2 * ((uint64_t) T->mask + 1); n++) {
+        unsigned i = S->clockHand & T->mask;
+        S->clockHand = i + 1;
+        uint64_t slot = __atomic_load_n(&T->slots[i], __ATOMIC_RELAXED);
+        if (!slotLive(slot) || S->pageClass[pageOf(Q, slotPosition(slot))] != cls) {
+            continue;
+        }
+        if (slot & SLOT_REF) {
+            // a reader setting the bit again right now only hands the key its second chance back
+            __atomic_store_n(&T->slots[i], slot & ~SLOT_REF, __ATOMIC_RELAXED);
+            continue;
+        }
+        evictSlot(Q, S, i, 1);
+        return 0;
+    }
+    return -1;
+}
+
+// gives a page of some other size class to class cls, the way memcached rebalances slabs: every item still in the
+// page is evicted and its free chunks are dropped from their free list. only a class with pages to spare gives one
+// up, otherwise a few rare sizes would keep taking each other's only page and evicting whole pages of items every
+// time. with idleOnly set it also has to be a class that hasn't had to evict lately. caller holds S->lock and is
+// inside a write section. returns -1 if there is no page to take.
+static int pageReclaim(struct queue *Q, struct shard *S, unsigned cls, int idleOnly) {
+    size_t pages = S->arenaUsed / Q->pageSize;
+    size_t victim = pages;
+    for (size_t n = 0; n < pages; n++) {
+        size_t p = S->pageHand++ % pages;
+        struct slab_class *C = &S->classes[S->pageClass[p]];
+        if (S->pageClass[p] != cls && C->pages > 1 && (!idleOnly || C->evicted == 0)) {
+            victim = p;
+            break;
+        }
+    }
+    if (victim == pages) {
+        return -1;
+    }
+
+    unsigned owner = S->pageClass[victim];
+    struct slab_class *C = &S->classes[owner];
+    size_t size = Q->classSize[owner];
+    size_t start = victim * Q->pageSize;
+    size_t end = C->end == start + Q->pageSize ? C->next : start + Q->pageSize;   // the newest page is partly unused
+
+    // a chunk holds a live item exactly when the index entry for the key in its header points back at it. free
+    // chunks carry a free list link where the hash was, so they never pass
+    for (size_t offset = start; offset + size <= end; offset += size) {
+        unsigned ref = (unsigned) (offset >> ITEM_SHIFT);
+        struct item *e = itemAt(S, ref);
+        if (e->keyLen > QUEUE_MAX_KEY || itemSize(e->keyLen, 0) > size) {
+            continue;
+        }
+        uint64_t *slot = findSlot(S, e->data, e->keyLen, e->hash);
+        if (slot != NULL && slotPosition(*slot) == ref) {
+            evictSlot(Q, S, (unsigned) (slot - S->index->slots), 0);
+        }
+    }
+    unsigned kept = 0;  // chunk reference + 1 of the last free chunk left on the list
+    for (unsigned link = C->freeHead; link != 0; ) {
+        unsigned next = (unsigned) itemAt(S, link - 1)->hash;
+        if (pageOf(Q, link - 1) == victim) {
+            if (kept == 0) {
+                C->freeHead = next;
+            } else {
+                itemAt(S, kept - 1)->hash = next;
+            }
+        } else {
+            kept = link;
+        }
+        link = next;
+    }
+    if (C->end == start + Q->pageSize) {
+        C->next = C->end = 0;
+    }
+    --C->pages;
+
+    struct slab_class *D = &S->classes[cls];
+    S->pageClass[victim] = (unsigned char) cls;
+    ++D->pages;
+    D->next = start;
+    D->end = start + Q->pageSize;
+    __atomic_store_n(&S->pagesMoved, S->pagesMoved + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// makes room for one more chunk of class cls in a shard that has all the pages it may have. caller holds S->lock and
+// is inside a write section. returns -1 if nothing could be evicted.
+static int evictFor(struct queue *Q, struct shard *S, unsigned cls) {
+    // the clock only sweeps the current table, so a resize under way is finished first
+    while (S->oldIndex != NULL) {
+        migrateStep(S, S->oldIndex->mask + 1);
+    }
+    struct slab_class *C = &S->classes[cls];
+    if (C->pages == 0) {
+        return pageReclaim(Q, S, cls, 0);
+    }
+    // once a class has evicted a page worth of items, it takes a page from a class that didn't have to evict at all
+    // in the meantime. that way memory follows the sizes being stored now, instead of staying with whatever sizes
+    // happened to fill the store first
+    if (++C->evicted >= Q->pageSize / Q->classSize[cls]) {
+        int moved = pageReclaim(Q, S, cls, 1) == 0;
+        for (unsigned i = 0; i < Q->classCount; i++) {
+            S->classes[i].evicted = 0;
+        }
+        if (moved) {
+            return 0;
+        }
+    }
+    return clockEvict(Q, S, cls);
+}
+
+// ------------------------------- EXPIRY -------------------------------
+
+static inline uint32_t queueNow(struct queue *Q) {
+    return __atomic_load_n(&Q->now, __ATOMIC_RELAXED);
+}
+
+static inline int itemExpired(const struct item *e, uint32_t now) {
+    return e->expire != 0 && e->expire <= now;
+}
+
+// files a wheel entry for the item at ref under the second it expires at. how far off that is picks the level, so an
+// entry is only looked at once per level on its way down rather than on every turn of the wheel. a time the wheel has
+// already passed goes into the very next second. caller holds S->lock. returns -1 if we ran out of memory, in which
+// case the item is only reclaimed once someone looks it up.
+static int wheelInsert(struct shard *S, unsigned ref, uint32_t version, uint32_t expire) {
+    uint32_t delta = (int32_t) (expire - S->wheelTime) > 0 ? expire - S->wheelTime : 1;
+    if (delta >= WHEEL_REACH) {
+        delta = WHEEL_REACH - 1;    // waits in the last level and gets filed again when it comes up
+    }
+    unsigned level = 0;
+    while (delta >= 1u << (QUEUE_WHEEL_BITS * (level + 1))) {
+        ++level;
+    }
+    uint32_t when = S->wheelTime + delta;
+    struct wheel_slot *W = &S->wheel[level][(when >> (QUEUE_WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    if (W->count == W->cap) {
+        unsigned cap = W->cap ? W->cap * 2 : 16;
+        struct wheel_entry *grown = realloc(W->entries, cap * sizeof(struct wheel_entry));
+        if (grown == NULL) {
+            return -1;
+        }
+        W->entries = grown;
+        W->cap = cap;
+    }
+    W->entries[W->count++] = (struct wheel_entry) {ref, version};
+    return 0;
+}
+
+// gives the item at ref a new expiry time, 0 for none. an item that had no expiry time, or is being made to expire
+// sooner, gets a new version and a new wheel entry, which makes any entry it still had stale. one that is only made
+// to expire later keeps its entry, which files itself again when it comes due, unless the shard was just reopened and
+// hasn't filed the item yet (see wheelRebuild()). caller holds S->lock and is inside a write section.
+static void itemExpireAt(struct shard *S, unsigned ref, struct item *e, uint32_t expire) {
+    int schedule = expire != 0 && (e->expire == 0 || expire < e->expire ||
+                                   (S->rebuilding && (int32_t) (e->version - S->rebuildVersion) <= 0));
+    e->expire = expire;
+    if (schedule) {
+        e->version = ++S->itemVersion;
+        wheelInsert(S, ref, e->version, expire);
+    }
+}
+
+// takes the item in *slot out of the index and frees its chunk. caller holds S->lock.
+static void dropSlot(struct queue *Q, struct shard *S, uint64_t *slot) {
+    unsigned ref = slotPosition(*slot);
+    struct item *e = itemAt(S, ref);
+    writeBegin(S);
+    // a tombstone in a table that is being drained is simply never moved, only the current table counts them
+    if (S->oldIndex == NULL || slot < S->oldIndex->slots || slot > &S->oldIndex->slots[S->oldIndex->mask]) {
+        ++S->tombstones;
+        filterCount(S->index, e->hash, -1);
+    } else {
+        filterCount(S->oldIndex, e->hash, -1);
+    }
+    *slot = INDEX_TOMBSTONE;
+    --S->count;
+    chunkFree(S, classFor(Q, itemSize(e->keyLen, e->valueLen)), ref);
+    if (S->oldIndex != NULL) {
+        migrateStep(S, REHASH_BATCH);
+    }
+    writeEnd(S);
+}
+
+// reclaims an item whose time to live ran out. caller holds S->lock.
+static void expireSlot(struct queue *Q, struct shard *S, uint64_t *slot) {
+    dropSlot(Q, S, slot);
+    __atomic_store_n(&S->expired, S->expired + 1, __ATOMIC_RELAXED);
+}
+
+// looks at the item a due wheel entry names. it is expired if its time has come and filed again if its expiry was
+// pushed out, while a stale entry (the item was deleted, evicted or rescheduled since) is simply dropped. caller holds
+// S->lock.
+static void wheelVisit(struct queue *Q, struct shard *S, struct wheel_entry entry, uint32_t second) {
+    struct item *e = itemAt(S, entry.ref);
+    if (e->version != entry.version || e->keyLen > QUEUE_MAX_KEY) {
+        return;
+    }
+    uint64_t *slot = findSlot(S, e->data, e->keyLen, e->hash);
+    if (slot == NULL || slotPosition(*slot) != entry.ref || e->expire == 0) {
+        return;
+    }
+    if (e->expire <= second) {
+        expireSlot(Q, S, slot);
+    } else {
+        wheelInsert(S, entry.ref, entry.version, e->expire);
+    }
+}
+
+// turns the timing wheel on towards now, handling at most budget entries. each second first brings the slots of the
+// higher levels that start there down a level, then expires what is in its level 0 slot. a slot that is cut short by
+// the budget is picked up where it was left next time. caller holds S->lock. returns entries handled plus seconds
+// turned through.
+static unsigned wheelAdvance(struct queue *Q, struct shard *S, uint32_t now, unsigned budget) {
+    unsigned done = 0;
+    while (done < budget && (int32_t) (now - S->wheelTime) > 0) {
+        uint32_t second = S->wheelTime + 1;
+        unsigned level = S->wheelLevel;
+        unsigned shift = QUEUE_WHEEL_BITS * level;
+        if (level > 0 && (second & ((1u << shift) - 1)) != 0) {
+            --S->wheelLevel;    // the slot of this level isn't due this second
+            continue;
+        }
+        struct wheel_slot *W = &S->wheel[level][(second >> shift) & (WHEEL_SLOTS - 1)];
+        while (S->wheelPos < W->count && done < budget) {
+            wheelVisit(Q, S, W->entries[S->wheelPos++], second);
+            ++done;
+        }
+        if (S->wheelPos < W->count) {
+            break;
+        }
+        W->count = 0;
+        S->wheelPos = 0;
+        if (W->cap > WHEEL_KEEP) {
+            free(W->entries);
+            W->entries = NULL;
+            W->cap = 0;
+        }
+        if (level > 0) {
+            --S->wheelLevel;
+        } else {
+            __atomic_store_n(&S->wheelTime, second, __ATOMIC_RELAXED);
+            S->wheelLevel = QUEUE_WHEEL_LEVELS - 1;
+            ++done;
+        }
+    }
+    return done;
+}
+
+// files the pairs of a reopened shard that have an expiry time in its timing wheel, up to budget index slots at a
+// time. the wheel isn't part of the store file, and filling it in one go would hold up the reopen; until a pair is
+// filed it is only reclaimed once someone looks it up. pairs whose expiry time changed since the reopen were filed by
+// itemExpireAt() already, and have a newer version than rebuildVersion. caller holds S->lock. returns slots looked at.
+static unsigned wheelRebuild(struct shard *S, unsigned budget) {
+    if (S->oldIndex != NULL) {
+        return 0;   // wait for the resize, then every pair is in the new table
+    }
+    if (S->rebuildTable != S->index) {
+        S->rebuildTable = S->index;     // first call, or the table was replaced: pairs filed already are skipped
+        S->rebuildCursor = 0;
+    }
+    unsigned examined = 0;
+    while (examined < budget && S->rebuildCursor <= S->index->mask) {
+        uint64_t slot = S->index->slots[S->rebuildCursor++];
+        ++examined;
+        if (!slotLive(slot)) {
+            continue;
+        }
+        struct item *e = itemAt(S, slotPosition(slot));
+        if (e->expire != 0 && (int32_t) (e->version - S->rebuildVersion) <= 0) {
+            e->version = ++S->itemVersion;
+            wheelInsert(S, slotPosition(slot), e->version, e->expire);
+        }
+    }
+    if (S->rebuildCursor > S->index->mask) {
+        S->rebuilding = 0;
+    }
+    return examined;
+}
+
+// ------------------------------- LOCK-FREE READS -------------------------------
+
+#define READ_TORN -2
+
+// lock-free version of tableFind(). every load is bounded, since the table may be changing under us. returns the
+// value's length if key was found (and copies the value, see readAttempt), -1 if not.
+static long probeTable(struct shard *S, struct index_table *T, unsigned cursor, const char *key, size_t keyLen,
+                       uint64_t hash, uint32_t now, char *out, size_t outSize) {
+    if (T->filter != NULL && !filterMaybe(T, hash)) {
+        return -1;
+    }
+    uint64_t tag = slotTag(hash);
+    unsigned mask = T->mask;
+    unsigned i = (unsigned) hash & mask;
+    for (unsigned probes = 0; probes <= mask; probes++) {
+        if (i < cursor) {
+            i = cursor;
+        }
+        uint64_t slot = __atomic_load_n(&T->slots[i], __ATOMIC_RELAXED);
+        if (slot == INDEX_EMPTY) {
+            break;
+        }
+        // the whole arena is mapped, so anything inside it can be looked at even if a writer is reusing it
+        size_t offset = (size_t) slotPosition(slot) << ITEM_SHIFT;
+        if (slotLive(slot) && slotMatches(slot, tag) && offset + sizeof(struct item) <= S->arenaSize) {
+            struct item *e = (struct item *) (S->arena + offset);
+            size_t valueLen = __atomic_load_n(&e->valueLen, __ATOMIC_RELAXED);
+            if (e->hash == hash && e->keyLen == keyLen && offset + itemSize(keyLen, valueLen) <= S->arenaSize &&
+                memcmp(e->data, key, keyLen) == 0) {
+                if (itemExpired(e, now)) {
+                    return -1;  // it is gone as far as anyone can tell. a writer or the wheel reclaims it
+                }
+                if (out != NULL && outSize > 0) {
+                    size_t len = valueLen < outSize ? valueLen : outSize - 1;
+                    memcpy(out, e->data + keyLen + 1, len);
+                    out[len] = '\0';
+                }
+                if (S->evict && !(slot & SLOT_REF)) {
+                    // tell the eviction clock the key is in use. the CAS only lands if the slot still holds what we
+                    // read, so a stale reader can never bring back a slot a writer has changed in the meantime
+                    __atomic_compare_exchange_n(&T->slots[i], &slot, slot | SLOT_REF, 0, __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED);
+                }
+                return (long) valueLen;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+// one optimistic lookup. the shard may change under us, so every load is bounded and the result is only trusted if
+// the shard sequence did not move. copies at most outSize - 1 bytes of the value to out, NUL terminated. returns the
+// value's full length if key was found and hasn't expired by now, -1 if not, READ_TORN on a torn read.
+static long readAttempt(struct shard *S, const char *key, size_t keyLen, uint64_t hash, uint32_t now, char *out,
+                        size_t outSize) {
+    unsigned seq = __atomic_load_n(&S->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return READ_TORN;  // a writer is in the middle of something
+    }
+
+    long found = probeTable(S, __atomic_load_n(&S->index, __ATOMIC_ACQUIRE), 0, key, keyLen, hash, now, out,
+                            outSize);
+    struct index_table *old = __atomic_load_n(&S->oldIndex, __ATOMIC_ACQUIRE);
+    if (found < 0 && old != NULL) {
+        unsigned cursor = __atomic_load_n(&S->migrateCursor, __ATOMIC_RELAXED);
+        if (cursor <= old->mask) {  // otherwise the resize is finishing under us and the sequence check will catch it
+            found = probeTable(S, old, cursor, key, keyLen, hash, now, out, outSize);
+        }
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&S->seq, __ATOMIC_RELAXED) != seq) {
+        return READ_TORN;
+    }
+    return found;
+}
+
+// looks key up without taking the shard lock, retrying while writers are busy. a reader that keeps losing the race
+// eventually takes the lock so it can't starve behind a stream of writes. with grow set, *buf is made big enough for
+// the whole value, otherwise the value is cut to fit. returns the value's length, -1 if key is not stored or -2 if
+// *buf could not grow.
+static long readShard(struct shard *S, const char *key, size_t keyLen, uint64_t hash, uint32_t now, char **buf,
+                      size_t *bufSize, int grow) {
+    for (unsigned attempt = 0; attempt < READ_RETRIES; attempt++) {
+        long len = readAttempt(S, key, keyLen, hash, now, buf ? *buf : NULL, buf ? *bufSize : 0);
+        if (len == READ_TORN) {
+            continue;
+        }
+        if (grow && len >= 0 && (size_t) len >= *bufSize) {
+            if (growBuffer(buf, bufSize, len + 1) < 0) {
+                return -2;
+            }
+            continue;   // copy it again into the bigger buffer
+        }
+        return len;
+    }
+
+    pthread_mutex_lock(&S->lock);
+    long len = readAttempt(S, key, keyLen, hash, now, buf ? *buf : NULL, buf ? *bufSize : 0);
+    if (grow && len >= 0 && (size_t) len >= *bufSize) {
+        len = growBuffer(buf, bufSize, len + 1) < 0 ? -2 : readAttempt(S, key, keyLen, hash, now, *buf, *bufSize);
+    }
+    pthread_mutex_unlock(&S->lock);
+    return len;
+}
+
+// ------------------------------- COMPACTION -------------------------------
+
+// cleans up to budget index slots starting at the compaction cursor. caller holds S->lock. returns tombstones removed.
+static unsigned compactUNLOCKED(struct shard *S, unsigned budget) {
+    unsigned before = S->tombstones;
+    unsigned examined = 0;
+    while (examined < budget && S->tombstones > 0) {
+        unsigned i = S->compactCursor;
+        if (S->index->slots[i] == INDEX_TOMBSTONE) {
+            examined += purgeTombstone(S, i);
+        }
+        ++examined;
+        S->compactCursor = (i + 1) & S->index->mask;
+    }
+    return before - S->tombstones;
+}
+
+// moves up to budget slots of a resize along, a few at a time so writers don't wait behind us. returns slots moved.
+static unsigned migrateSome(struct shard *S, unsigned budget) {
+    unsigned moved = 0;
+    while (moved < budget && __atomic_load_n(&S->oldIndex, __ATOMIC_RELAXED) != NULL) {
+        pthread_mutex_lock(&S->lock);
+        if (S->oldIndex != NULL) {
+            writeBegin(S);
+            moved += migrateStep(S, REHASH_BATCH);
+            writeEnd(S);
+        }
+        pthread_mutex_unlock(&S->lock);
+    }
+    return moved;
+}
+
+// gives the memory of newly retired tables back. the list only ever grows at its head, so once the head has been read
+// under the lock the rest can be walked without it.
+static void releaseRetired(struct shard *S) {
+    pthread_mutex_lock(&S->lock);
+    struct index_table *T = S->retired;
+    pthread_mutex_unlock(&S->lock);
+    for (; T != NULL && !T->released; T = T->retired) {
+        tableRelease(T);
+    }
+}
+
+// gives every shard one batch of compaction, taking each shard lock only for its own batch. a shard in the middle of
+// a resize gets its batch spent on moving entries instead, so a resize finishes even if nobody writes to the shard.
+// returns tombstones removed plus old slots moved.
+unsigned queue_compact(struct queue *Q, unsigned budget) {
+    unsigned removed = 0;
+    for (unsigned i = 0; i < Q->shardCount; i++) {
+        struct shard *S = &Q->shards[i];
+        if (__atomic_load_n(&S->oldIndex, __ATOMIC_RELAXED) != NULL) {
+            removed += migrateSome(S, budget);
+        } else if (__atomic_load_n(&S->tombstones, __ATOMIC_RELAXED) != 0) {
+            pthread_mutex_lock(&S->lock);
+            writeBegin(S);
+            removed += compactUNLOCKED(S, budget);
+            writeEnd(S);
+            pthread_mutex_unlock(&S->lock);
+        }
+        if (__atomic_load_n(&S->retired, __ATOMIC_RELAXED) != NULL) {
+            releaseRetired(S);
+        }
+    }
+    return removed;
+}
+
+// turns every shard's timing wheel up to the current second, reclaiming whatever has expired, with at most budget
+// entries per shard and lock hold. returns entries handled plus seconds turned through.
+unsigned queue_expire_due(struct queue *Q, unsigned budget) {
+    uint32_t now = queueNow(Q);
+    unsigned done = 0;
+    for (unsigned i = 0; i < Q->shardCount; i++) {
+        struct shard *S = &Q->shards[i];
+        if (__atomic_load_n(&S->rebuilding, __ATOMIC_RELAXED)) {
+            pthread_mutex_lock(&S->lock);
+            done += wheelRebuild(S, REBUILD_BATCH);
+            pthread_mutex_unlock(&S->lock);
+        }
+        if (__atomic_load_n(&S->wheelTime, __ATOMIC_RELAXED) != now) {
+            pthread_mutex_lock(&S->lock);
+            done += wheelAdvance(Q, S, now, budget);
+            pthread_mutex_unlock(&S->lock);
+        }
+    }
+    return done;
+}
+
+// background thread. takes a shard lock for one short batch at a time so writers never wait on a whole-index sweep.
+// it also keeps the queue's clock and turns the timing wheels.
+static void * compactor(void *arguements) {
+    struct queue *Q = (struct queue *) arguements;
+    struct timespec pause = {0, COMPACT_INTERVAL_NS};
+
+    while (__atomic_load_n(&Q->compactorRunning, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&Q->now, (uint32_t) time(NULL), __ATOMIC_RELAXED);
+        // only nap while there is little to do, otherwise keep chewing through tombstones and expired keys.
+        if (queue_compact(Q, COMPACT_BATCH) + queue_expire_due(Q, EXPIRE_BATCH) < COMPACT_BATCH / 8) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// ------------------------------- STORE FILE -------------------------------
+
+// what a shard needs to pick up where it left off, next to its arena and index. written at every checkpoint
+struct shard_file {
+    uint64_t arenaUsed;
+    struct slab_class classes[QUEUE_MAX_CLASSES];
+    uint32_t indexSize;     // slots of the table at the start of the shard's index region
+    uint32_t count;
+    uint32_t tombstones;
+    uint32_t itemVersion;
+    uint64_t evictions;
+    uint64_t pagesMoved;
+    uint64_t expired;
+};
+
+// the start of a store file, in native byte order. the store settings must match for the file to be reopened, since
+// they decide where everything in it is
+struct queue_file {
+    char magic[8];
+    uint32_t version;
+    uint32_t clean;         // 1 once a checkpoint is complete, 0 while one is being written
+    uint64_t generation;    // checkpoints so far
+    uint32_t shardCount;
+    uint32_t filter;
+    uint64_t maxItem;
+    uint64_t arenaSize;     // per shard
+    uint32_t itemHeader;    // sizeof(struct item) and sizeof(struct index_table), in case their layout changes
+    uint32_t tableHeader;
+    uint64_t logId;         // see queue_checkpoint()
+    uint64_t logOffset;
+    struct shard_file shards[];
+};
+
+// where things go in a store file. a shard's region is its page classes, its arena and room for the biggest index
+// table it can grow to, each starting on a page of its own
+struct file_layout {
+    size_t header;      // bytes before the first shard's region
+    size_t classes;     // bytes of page classes, the arena comes right after
+    size_t arena;
+    size_t index;
+    size_t shard;       // bytes of a whole region
+};
+
+static size_t pageRound(size_t bytes) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+// a shard's table grows once it is half full, and the arena holds at most one item per CHUNK_MIN bytes
+static void fileLayout(struct queue *Q, size_t arenaSize, struct file_layout *L) {
+    unsigned slots = QUEUE_INDEX_MIN;
+    while (slots < INDEX_MAX && slots / 2 < arenaSize / CHUNK_MIN + 1) {
+        slots *= 2;
+    }
+    L->header = pageRound(sizeof(struct queue_file) + Q->shardCount * sizeof(struct shard_file));
+    L->classes = pageRound(arenaSize / Q->pageSize + 1);
+    L->arena = arenaSize;
+    L->index = pageRound(tableBytesFor(slots, Q->filter));
+    L->shard = L->classes + L->arena + L->index;
+}
+
+// the part of a header that only depends on the store settings
+static void fileHeader(struct queue *Q, size_t arenaSize, struct queue_file *H) {
+    memcpy(H->magic, FILE_MAGIC, sizeof(H->magic));
+    H->version = FILE_VERSION;
+    H->shardCount = Q->shardCount;
+    H->filter = (uint32_t) Q->filter;
+    H->maxItem = Q->maxItem;
+    H->arenaSize = arenaSize;
+    H->itemHeader = sizeof(struct item);
+    H->tableHeader = sizeof(struct index_table);
+}
+
+static int pwriteAll(int fd, const char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t w = pwrite(fd, data, len, offset);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += w;
+        len -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+// opens the store file at path, or makes a new one, and maps it. a file holding a complete checkpoint taken with the
+// same settings is reopened as it is, with the shard states of the checkpoint left in *saved (malloc'ed) for the
+// shards to pick up. one whose last checkpoint was cut short can't be trusted, and starts over empty like a new one.
+// returns EXIT_FAILURE if the file can't be used, with a message for the wrong kind of file.
+static int fileOpen(struct queue *Q, const char *path, size_t arenaSize, struct queue_file **saved) {
+    struct file_layout L;
+    fileLayout(Q, arenaSize, &L);
+    *saved = NULL;
+    Q->fileFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct queue_file *H = calloc(1, L.header);
+    if (Q->fileFd < 0 || H == NULL) {
+        free(H);
+        return EXIT_FAILURE;
+    }
+    ssize_t got = pread(Q->fileFd, H, L.header, 0);
+    if (got < 0) {
+        free(H);
+        return EXIT_FAILURE;
+    }
+    if (got > 0 && ((size_t) got < L.header || memcmp(H->magic, FILE_MAGIC, sizeof(H->magic)) != 0)) {
+        fprintf(stderr, "%s IS NOT A STORE FILE!\n", path);
+        free(H);
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+    if (got > 0 && (H->version != FILE_VERSION || H->shardCount != Q->shardCount || H->filter != (uint32_t) Q->filter ||
+                    H->maxItem != Q->maxItem || H->arenaSize != arenaSize ||
+                    H->itemHeader != sizeof(struct item) || H->tableHeader != sizeof(struct index_table))) {
+        fprintf(stderr, "%s WAS MADE WITH OTHER SETTINGS (%u SHARDS, %lu BYTE ITEMS, FILTER %s)!\n", path,
+                H->shardCount, (unsigned long) H->maxItem, H->filter ? "ON" : "OFF");
+        free(H);
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+
+    Q->restored = got > 0 && H->clean;
+    for (unsigned i = 0; Q->restored && i < Q->shardCount; i++) {
+        struct shard_file *F = &H->shards[i];
+        if (F->arenaUsed > arenaSize || F->indexSize < QUEUE_INDEX_MIN || (F->indexSize & (F->indexSize - 1)) != 0 ||
+            pageRound(tableBytesFor(F->indexSize, Q->filter)) > L.index) {
+            fprintf(stderr, "%s IS DAMAGED!\n", path);
+            free(H);
+            errno = EINVAL;
+            return EXIT_FAILURE;
+        }
+    }
+    if (got > 0 && !Q->restored) {
+        printf("store: %s holds no complete checkpoint, starting empty\n", path);
+    }
+    if (!Q->restored) {
+        // an empty store is all zeros, which a file cut back to nothing reads as. clean stays 0 until the first
+        // checkpoint, so a crash before that starts over empty again
+        memset(H, 0, L.header);
+        fileHeader(Q, arenaSize, H);
+        if (ftruncate(Q->fileFd, 0) < 0 || pwriteAll(Q->fileFd, (char *) H, L.header, 0) < 0) {
+            free(H);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the file is sparse: only pages that have held something take up disk space
+    Q->fileSize = L.header + Q->shardCount * L.shard;
+    if (ftruncate(Q->fileFd, (off_t) Q->fileSize) < 0) {
+        free(H);
+        return EXIT_FAILURE;
+    }
+    Q->file = mmap(NULL, Q->fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, Q->fileFd, 0);
+    if (Q->file == MAP_FAILED) {
+        Q->file = NULL;
+        free(H);
+        return EXIT_FAILURE;
+    }
+    Q->generation = H->generation;
+    Q->logId = Q->restored ? H->logId : 0;
+    Q->logOffset = Q->restored ? H->logOffset : 0;
+    if (Q->restored) {
+        *saved = H;
+    } else {
+        free(H);
+    }
+    return EXIT_SUCCESS;
+}
+
+// puts a freshly set up shard back in the state of the checkpoint. its index is the table in the file, which stays
+// mapped there until the shard outgrows it. nothing in the wheel survived, so the compactor fills it in later.
+static void shardRestore(struct shard *S, const struct shard_file *F) {
+    S->arenaUsed = F->arenaUsed;
+    memcpy(S->classes, F->classes, sizeof(S->classes));
+    S->count = F->count;
+    S->tombstones = F->tombstones;
+    S->itemVersion = F->itemVersion;
+    S->evictions = F->evictions;
+    S->pagesMoved = F->pagesMoved;
+    S->expired = F->expired;
+    munmap(S->index, tableBytes(S->index));
+    S->index = (struct index_table *) S->indexRegion;
+    tableSetup(S->index, F->indexSize, S->filter);
+    S->rebuilding = 1;
+    S->rebuildVersion = S->itemVersion;
+    S->rebuildTable = NULL;
+}
+
+// writes the pages of [start, start + len) of the mapping that differ from the file back to it. those are the ones
+// that were written to, which copied them (the mapping is private), and /proc/self/pagemap tells those apart: they
+// are anonymous now. without pagemap every page in the range is written. the copies are dropped once written, so the
+// pages are the file's again and the next checkpoint skips them unless they change; readers find the same bytes
+// either way. start is page aligned.
+static int fileWriteBack(struct queue *Q, int pagemap, char *start, size_t len) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uint64_t entries[512];
+    uintptr_t first = (uintptr_t) start / page;
+    uintptr_t last = ((uintptr_t) start + len + page - 1) / page;
+    for (uintptr_t p = first; p < last; ) {
+        size_t n = last - p < 512 ? last - p : 512;
+        int known = pagemap >= 0 &&
+                    pread(pagemap, entries, n * sizeof(uint64_t), (off_t) (p * sizeof(uint64_t))) ==
+                    (ssize_t) (n * sizeof(uint64_t));
+        uintptr_t run = p;  // first page of the run of changed pages being gathered
+        for (size_t k = 0; k <= n; k++) {
+            // bit 63: present, 62: swapped, 61: backed by a file (our pages the store never wrote to)
+            int changed = k < n && (!known || ((entries[k] >> 62) != 0 && !((entries[k] >> 61) & 1)));
+            if (!changed) {
+                char *from = (char *) (run * page);
+                if (run < p + k) {
+                    if (pwriteAll(Q->fileFd, from, (p + k - run) * page, (off_t) (from - Q->file)) < 0) {
+                        return -1;
+                    }
+                    madvise(from, (p + k - run) * page, MADV_DONTNEED);
+                }
+                run = p + k + 1;
+            }
+        }
+        p += n;
+    }
+    return 0;
+}
+
+// makes the store file hold exactly what Q holds now, so the next queue_init() of it picks up from here. logId and
+// logOffset name a change log and how much of it the store holds (see aof.h), so a reopen can replay just the rest;
+// 0 and 0 if there is none. only the pages written since the last checkpoint are written, plus each shard's index
+// table and allocator state, and the header is only marked clean once all of that is on disk. caller holds every
+// shard lock (queue_lock_all()), so nothing changes meanwhile; lock-free readers carry on. returns EXIT_SUCCESS, or
+// EXIT_FAILURE with the file marked as not clean.
+int queue_checkpoint(struct queue *Q, uint64_t logId, uint64_t logOffset) {
+    if (Q->file == NULL) {
+        return EXIT_SUCCESS;
+    }
+    struct file_layout L;
+    fileLayout(Q, Q->shards[0].arenaSize, &L);
+    struct queue_file *H = calloc(1, L.header);
+    if (H == NULL) {
+        return EXIT_FAILURE;
+    }
+    fileHeader(Q, L.arena, H);
+    H->generation = Q->generation;
+    // clean is 0 on disk before any page changes, so a checkpoint cut short is never taken for a complete one
+    if (pwriteAll(Q->fileFd, (char *) H, sizeof(struct queue_file), 0) < 0 || fdatasync(Q->fileFd) < 0) {
+        free(H);
+        return EXIT_FAILURE;
+    }
+
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    int failed = 0;
+    for (unsigned i = 0; i < Q->shardCount && !failed; i++) {
+        struct shard *S = &Q->shards[i];
+        if (S->oldIndex != NULL) {
+            writeBegin(S);
+            while (S->oldIndex != NULL) {
+                migrateStep(S, S->oldIndex->mask + 1);
+            }
+            writeEnd(S);
+        }
+        failed = fileWriteBack(Q, pagemap, (char *) S->pageClass, S->arenaUsed / Q->pageSize) < 0 ||
+                 fileWriteBack(Q, pagemap, S->arena, S->arenaUsed) < 0;
+        if (!failed && S->index == (struct index_table *) S->indexRegion) {
+            failed = fileWriteBack(Q, pagemap, S->indexRegion, tableBytes(S->index)) < 0;
+        } else if (!failed) {
+            // a table the shard grew into since lives in anonymous memory. the header's pointers are fixed up when
+            // the file is reopened
+            off_t at = (off_t) (S->indexRegion - Q->file);
+            failed = tableBytes(S->index) > L.index ||
+                     pwriteAll(Q->fileFd, (char *) S->index, tableBytes(S->index), at) < 0;
+        }
+        struct shard_file *F = &H->shards[i];
+        F->arenaUsed = S->arenaUsed;
+        memcpy(F->classes, S->classes, sizeof(F->classes));
+        F->indexSize = S->index->mask + 1;
+        F->count = S->count;
+        F->tombstones = S->tombstones;
+        F->itemVersion = S->itemVersion;
+        F->evictions = S->evictions;
+        F->pagesMoved = S->pagesMoved;
+        F->expired = S->expired;
+    }
+    if (pagemap >= 0) {
+        close(pagemap);
+    }
+
+    // the pages must be on disk before the header that vouches for them, or a crash in between could leave a clean
+    // header in front of pages that never made it
+    if (!failed) {
+        failed = fdatasync(Q->fileFd) < 0;
+    }
+    if (!failed) {
+        H->clean = 1;
+        H->generation = Q->generation + 1;
+        H->logId = logId;
+        H->logOffset = logOffset;
+        failed = pwriteAll(Q->fileFd, (char *) H, L.header, 0) < 0 || fdatasync(Q->fileFd) < 0;
+    }
+    if (!failed) {
+        Q->generation = H->generation;
+        Q->logId = logId;
+        Q->logOffset = logOffset;
+    }
+    free(H);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// ------------------------------- QUEUE STRUCTURE -------------------------------
+
+// reserves the address space a shard's slab pages are cut from. pages only cost memory once they are touched, but
+// some systems won't hand out that much address space, so settle for less if we have to.
+static char *arenaReserve(size_t *size, size_t minimum) {
+    while (*size >= minimum) {
+        void *arena = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena != MAP_FAILED) {
+            return arena;
+        }
+        *size /= 2;
+    }
+    return NULL;
+}
+
+// region is where the shard lives in the store file (see fileLayout()), NULL for anonymous memory.
+static int shard_init(struct shard *S, size_t arenaSize, size_t pageSize, size_t memoryLimit, int filter, uint32_t now,
+                      char *region, const struct file_layout *L) {
+    S->arenaSize = arenaSize;
+    if (region != NULL) {
+        S->pageClass = (unsigned char *) region;
+        S->arena = region + L->classes;
+        S->indexRegion = region + L->classes + L->arena;
+    } else {
+        S->arena = arenaReserve(&S->arenaSize, pageSize);
+        S->pageClass = calloc(S->arenaSize / pageSize + 1, 1);
+        S->indexRegion = NULL;
+    }
+    S->arenaUsed = 0;
+    S->evict = memoryLimit != 0;
+    S->pageLimit = S->evict && memoryLimit < S->arenaSize ? memoryLimit : S->arenaSize;
+    S->filter = filter;
+    S->index = tableCreate(QUEUE_INDEX_MIN, filter);
+    S->oldIndex = NULL;
+    S->migrateCursor = 0;
+    S->retired = NULL;
+    S->tombstones = 0;
+    S->count = 0;
+    S->compactCursor = 0;
+    S->clockHand = 0;
+    S->pageHand = 0;
+    S->evictions = 0;
+    S->pagesMoved = 0;
+    S->wheelTime = now;     // the slots themselves start out empty, the shard is calloc'ed
+    S->wheelLevel = QUEUE_WHEEL_LEVELS - 1;
+    S->wheelPos = 0;
+    S->itemVersion = 0;
+    S->expired = 0;
+    S->rebuilding = 0;
+    S->seq = 0;
+    int i = pthread_mutex_init(&S->lock, NULL);
+    int j = pthread_cond_init(&S->read_ready, NULL);
+
+    if (i != 0 || j != 0 || S->arena == NULL || S->index == NULL || S->pageClass == NULL) {
+        return EXIT_FAILURE;  // obtained from the init functions (code omitted)
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// lays out the size classes. the largest class is a whole page, and a page must fit the largest item.
+static void classesInit(struct queue *Q) {
+    size_t largest = (itemSize(0, Q->maxItem) + (1u << ITEM_SHIFT) - 1) & ~(size_t) ((1u << ITEM_SHIFT) - 1);
+    Q->pageSize = largest > QUEUE_SLAB_PAGE ? largest : QUEUE_SLAB_PAGE;
+    Q->classCount = 0;
+    size_t size = CHUNK_MIN;
+    while (size < Q->pageSize && Q->classCount < QUEUE_MAX_CLASSES - 1) {
+        Q->classSize[Q->classCount++] = (unsigned) size;
+        size = ((size_t) (size * CLASS_GROWTH) + (1u << ITEM_SHIFT) - 1) & ~(size_t) ((1u << ITEM_SHIFT) - 1);
+    }
+    Q->classSize[Q->classCount++] = (unsigned) Q->pageSize;
+}
+
+// config may be NULL for all the defaults.
+int queue_init(struct queue *Q, const struct queue_config *config)
+{
+    unsigned shards = config != NULL && config->shards != 0 ? config->shards : QUEUE_SHARDS;
+    size_t maxItem = config != NULL && config->maxItem != 0 ? config->maxItem : QUEUE_MAX_ITEM;
+    if (shards > QUEUE_MAX_SHARDS || (shards & (shards - 1)) != 0 || maxItem > QUEUE_MAX_ITEM_LIMIT) {
+        return EXIT_FAILURE;
+    }
+
+    Q->shardCount = shards;
+    Q->shardBits = 0;
+    while ((1u << Q->shardBits) < shards) {
+        ++Q->shardBits;
+    }
+    Q->maxItem = maxItem;
+    Q->maxMemory = config != NULL ? config->maxMemory : 0;
+    Q->filter = config != NULL && config->filter;
+    classesInit(Q);
+    Q->now = (uint32_t) time(NULL);
+    Q->compactorRunning = 0;
+    Q->journal = NULL;
+    Q->journalArg = NULL;
+    Q->fileFd = -1;
+    Q->file = NULL;
+    Q->restored = 0;
+    Q->generation = 0;
+    Q->logId = 0;
+    Q->logOffset = 0;
+    Q->shards = calloc(shards, sizeof(struct shard));
+    if (Q->shards == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // every shard gets its share of the address space, but always room for a good number of pages
+    size_t arenaSize = QUEUE_ARENA_SIZE / shards;
+    if (arenaSize < 16 * Q->pageSize) {
+        arenaSize = 16 * Q->pageSize;
+    }
+    if (arenaSize > ARENA_LIMIT) {
+        arenaSize = ARENA_LIMIT;
+    }
+
+    // a memory limit is split evenly, in whole pages. a shard that can't have a single page could store nothing
+    size_t memoryLimit = 0;
+    if (Q->maxMemory != 0) {
+        memoryLimit = Q->maxMemory / shards / Q->pageSize * Q->pageSize;
+        if (memoryLimit < Q->pageSize) {
+            memoryLimit = Q->pageSize;
+        }
+    }
+
+    // a store file has room for exactly this much arena per shard, in whole pages
+    struct file_layout L;
+    struct queue_file *saved = NULL;
+    if (config != NULL && config->path != NULL) {
+        arenaSize = pageRound(arenaSize);
+        fileLayout(Q, arenaSize, &L);
+        if (fileOpen(Q, config->path, arenaSize, &saved) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (unsigned i = 0; i < shards; i++) {
+        char *region = Q->file != NULL ? Q->file + L.header + i * L.shard : NULL;
+        if (shard_init(&Q->shards[i], arenaSize, Q->pageSize, memoryLimit, Q->filter, Q->now, region, &L) !=
+            EXIT_SUCCESS) {
+            free(saved);
+            return EXIT_FAILURE;
+        }
+        if (saved != NULL) {
+            shardRestore(&Q->shards[i], &saved->shards[i]);
+        }
+    }
+    free(saved);
+
+    Q->compactorRunning = 1;
+    if (pthread_create(&Q->compactor, NULL, compactor, Q) != 0) {
+        Q->compactorRunning = 0;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int queue_add(struct queue *Q, char * key, char * value)
+{
+    return queue_set(Q, key, strlen(key), value, strlen(value));
+}
+
+// tells Q's journal, if it has one, about a change. caller holds the lock of the shard key is in.
+static inline void journal(struct queue *Q, int op, const char *key, size_t keyLen, const char *value,
+                           size_t valueLen, uint32_t expire) {
+    if (Q->journal != NULL) {
+        Q->journal(Q->journalArg, op, key, keyLen, value, valueLen, expire);
+    }
+}
+
+// stores a copy of value under key, which hashes to hash and belongs in S, replacing any value and time to live the
+// key had. the pair expires at expire, or never if it is 0. caller holds S->lock and has checked the pair's length.
+// returns 0 on success, -1 if the shard has no memory left for it.
+static int setUNLOCKED(struct queue *Q, struct shard *S, const char *key, size_t keyLen, uint64_t hash,
+                       const char *value, size_t valueLen, uint32_t expire)
+{
+    unsigned cls = classFor(Q, itemSize(keyLen, valueLen));
+
+    // a duplicate key of the same size class gets its value overwritten in place. one that changes class is dropped
+    // and stored again from scratch, since making room for the new chunk may evict or move things around. if that
+    // fails the key is gone rather than stale, like in memcached
+    uint64_t *slot = findSlot(S, key, keyLen, hash);
+    if (slot != NULL) {
+        struct item *e = itemAt(S, slotPosition(*slot));
+        if (classFor(Q, itemSize(e->keyLen, e->valueLen)) == cls) {
+            writeBegin(S);
+            itemWrite(e, hash, key, keyLen, value, valueLen);
+            itemExpireAt(S, slotPosition(*slot), e, expire);
+            writeEnd(S);
+            journal(Q, QUEUE_OP_SET, key, keyLen, value, valueLen, e->expire);
+            return 0;
+        }
+        dropSlot(Q, S, slot);
+    }
+
+    writeBegin(S);
+
+    long ref = indexReserve(S) < 0 ? -1 : chunkAlloc(Q, S, cls);
+    if (ref < 0) {
+        writeEnd(S);
+        if (slot != NULL) {
+            journal(Q, QUEUE_OP_DEL, key, keyLen, "", 0, 0);    // the old value is gone too
+        }
+        return -1;
+    }
+    struct item *e = itemAt(S, (unsigned) ref);
+    itemWrite(e, hash, key, keyLen, value, valueLen);
+    e->expire = 0;  // whatever last lived in the chunk had its own
+    itemExpireAt(S, (unsigned) ref, e, expire);
+    insertSlot(S, hash, (unsigned) ref);
+    ++S->count;
+
+    writeEnd(S);
+    journal(Q, QUEUE_OP_SET, key, keyLen, value, valueLen, e->expire);
+    return 0;
+}
+
+// stores a copy of value under key, replacing any value and time to live the key had. the pair expires at expire, or
+// never if it is 0. returns 0 on success, -1 if the pair is longer than the maximum item size or the shard has no
+// memory left for it.
+static int setItem(struct queue *Q, const char *key, size_t keyLen, const char *value, size_t valueLen, uint32_t expire)
+{
+    if (keyLen > QUEUE_MAX_KEY || keyLen + valueLen > Q->maxItem) {
+        return -1;
+    }
+    uint64_t hash = queue_hash(key, keyLen);
+    struct shard *S = shardOf(Q, hash);
+
+    pthread_mutex_lock(&S->lock); // make sure no one else touches the shard until we're done
+    int stored = setUNLOCKED(Q, S, key, keyLen, hash, value, valueLen, expire);
+    pthread_mutex_unlock(&S->lock); // now we're done
+    if (stored == 0) {
+        pthread_cond_signal(&S->read_ready); // wake up a thread waiting to read (if any)
+    }
+    return stored;
+}
+
+// like queue_set, for a caller that holds the lock of shard s (queue_lock_shard()) and stores many pairs in a row,
+// such as a snapshot being loaded. the pair expires at expire (unix time), or never if it is 0. a key that belongs in
+// another shard is stored the usual way, taking that shard's lock.
+int queue_set_UNLOCKED(struct queue *Q, unsigned s, const char *key, size_t keyLen, const char *value, size_t valueLen,
+                       uint32_t expire)
+{
+    if (keyLen > QUEUE_MAX_KEY || keyLen + valueLen > Q->maxItem) {
+        return -1;
+    }
+    uint64_t hash = queue_hash(key, keyLen);
+    struct shard *S = shardOf(Q, hash);
+    if (S != &Q->shards[s]) {
+        return setItem(Q, key, keyLen, value, valueLen, expire);
+    }
+    return setUNLOCKED(Q, S, key, keyLen, hash, value, valueLen, expire);
+}
+
+// stores a copy of value under key, replacing any value and time to live the key had. returns 0 on success, -1 if
+// the pair is longer than the maximum item size or the shard has no memory left for it.
+int queue_set(struct queue *Q, const char *key, size_t keyLen, const char *value, size_t valueLen)
+{
+    return setItem(Q, key, keyLen, value, valueLen, 0);
+}
+
+// like queue_set, but the pair expires after seconds, between 1 and QUEUE_MAX_TTL. returns -1 for any other time to
+// live.
+int queue_setex(struct queue *Q, const char *key, size_t keyLen, const char *value, size_t valueLen, unsigned seconds)
+{
+    if (seconds == 0 || seconds > QUEUE_MAX_TTL) {
+        return -1;
+    }
+    return setItem(Q, key, keyLen, value, valueLen, queueNow(Q) + seconds);
+}
+
+// finds key for a writer. an expired item it comes across is reclaimed on the spot and reported as missing. caller
+// holds S->lock. returns the index slot, or NULL if the key is not stored.
+static uint64_t *findLive(struct queue *Q, struct shard *S, const char *key, size_t keyLen, uint64_t hash) {
+    uint64_t *slot = findSlot(S, key, keyLen, hash);
+    if (slot != NULL && itemExpired(itemAt(S, slotPosition(*slot)), queueNow(Q))) {
+        expireSlot(Q, S, slot);
+        return NULL;
+    }
+    return slot;
+}
+
+// makes key expire after seconds (capped at QUEUE_MAX_TTL), or deletes it right away if seconds is not positive.
+// returns 0 on success, -1 if the key is not stored.
+int queue_expire(struct queue *Q, const char *key, size_t keyLen, long seconds)
+{
+    uint64_t hash = queue_hash(key, keyLen);
+    struct shard *S = shardOf(Q, hash);
+
+    pthread_mutex_lock(&S->lock);
+    uint64_t *slot = findLive(Q, S, key, keyLen, hash);
+    if (slot == NULL) {
+        pthread_mutex_unlock(&S->lock);
+        return -1;
+    }
+    if (seconds <= 0) {
+        dropSlot(Q, S, slot);
+        journal(Q, QUEUE_OP_DEL, key, keyLen, "", 0, 0);
+    } else {
+        uint32_t expire = queueNow(Q) + (uint32_t) (seconds < QUEUE_MAX_TTL ? seconds : QUEUE_MAX_TTL);
+        writeBegin(S);
+        itemExpireAt(S, slotPosition(*slot), itemAt(S, slotPosition(*slot)), expire);
+        writeEnd(S);
+        journal(Q, QUEUE_OP_EXPIRE, key, keyLen, "", 0, expire);
+    }
+    pthread_mutex_unlock(&S->lock);
+    return 0;
+}
+
+// returns the seconds key has left to live, -1 if it doesn't expire or -2 if it is not stored.
+long queue_ttl(struct queue *Q, const char *key, size_t keyLen)
+{
+    uint64_t hash = queue_hash(key, keyLen);
+    struct shard *S = shardOf(Q, hash);
+
+    pthread_mutex_lock(&S->lock);
+    uint64_t *slot = findLive(Q, S, key, keyLen, hash);
+    long left = -2;
+    if (slot != NULL) {
+        struct item *e = itemAt(S, slotPosition(*slot));
+        left = e->expire == 0 ? -1 : (long) (e->expire - queueNow(Q));
+    }
+    pthread_mutex_unlock(&S->lock);
+    return left;
+}
+
+// tombstones key's index slot and frees its chunk, copying the old value to *buf first if buf is not NULL (see
+// readShard for grow). caller holds S->lock. returns the old value's length, -1 if the key was not there (or had
+// expired) or -2 if *buf could not grow, in which case nothing is removed.
+static long removeUNLOCKED(struct queue *Q, struct shard *S, const char *key, size_t keyLen, uint64_t hash,
+                           char **buf, size_t *bufSize, int grow) {
+    uint64_t *slot = findLive(Q, S, key, keyLen, hash);
+    if (slot == NULL) {
+        return -1;
+    }
+    struct item *e = itemAt(S, slotPosition(*slot));
+    size_t valueLen = e->valueLen;
+    if (buf != NULL) {
+        if (grow && growBuffer(buf, bufSize, valueLen + 1) < 0) {
+            return -2;
+        }
+        if (*bufSize > 0) {
+            size_t len = valueLen < *bufSize ? valueLen : *bufSize - 1;
+            memcpy(*buf, itemValue(e), len);
+            (*buf)[len] = '\0';
+        }
+    }
+
+    dropSlot(Q, S, slot);
+    journal(Q, QUEUE_OP_DEL, key, keyLen, "", 0, 0);
+    return (long) valueLen;
+}
+
+// caller must already hold the lock of the shard item hashes to. an empty shard just doesn't have the key: the shards
+// are independent, so waiting for it to fill up could wait forever. returns 0, or -1 if the key is not stored.
+int queue_remove_UNLOCKED(struct queue *Q, char *item)
+{
+    uint64_t hash = queue_hash(item, strlen(item));
+    struct shard *S = shardOf(Q, hash);
+
+    // check if key exists, if it does, delete it.
+    return removeUNLOCKED(Q, S, item, strlen(item), hash, NULL, NULL, 0) < 0 ? -1 : 0;
+}
+
+// returns 0, or -1 if the key is not stored.
+int queue_remove(struct queue *Q, char *item)
+{
+    struct shard *S = shardOf(Q, queue_hash(item, strlen(item)));
+    pthread_mutex_lock(&S->lock);
+
+    int removed = queue_remove_UNLOCKED(Q, item);
+
+    pthread_mutex_unlock(&S->lock);
+
+    return removed;
+}
+
+static long removeLocked(struct queue *Q, const char *key, size_t keyLen, char **buf, size_t *bufSize, int grow) {
+    uint64_t hash = queue_hash(key, keyLen);
+    struct shard *S = shardOf(Q, hash);
+
+    pthread_mutex_lock(&S->lock);
+    long removed = removeUNLOCKED(Q, S, key, keyLen, hash, buf, bufSize, grow);
+    pthread_mutex_unlock(&S->lock);
+    return removed;
+}
+
+// deletes key and copies the value it had into *buf in one step, so a concurrent SET can't slip in between reading
+// the value and removing it. *buf is realloc'ed to fit the whole value plus a NUL; buf may be NULL if the value is not
+// wanted. returns the old value's length, -1 if the key was not there or -2 if we ran out of memory.
+long queue_remove_value(struct queue *Q, const char *key, size_t keyLen, char **buf, size_t *bufSize) {
+    return removeLocked(Q, key, keyLen, buf, bufSize, 1);
+}
+
+// like queue_remove_value, but for a fixed buffer: copies at most outSize bytes, NUL terminated. returns 1 if the key
+// was there, 0 if not.
+int queue_remove_copy(struct queue *Q, const char *key, char *out, size_t outSize) {
+    return removeLocked(Q, key, strlen(key), &out, &outSize, 0) >= 0;
+}
+
+// copies the value stored at key into *buf, realloc'ing it to fit the whole value plus a NUL. never takes a lock
+// unless writers keep the shard busy, so it is safe and cheap to call while other threads SET and DEL. returns the
+// value's length, -1 if key is not stored or -2 if we ran out of memory.
+long queue_get_value(struct queue *Q, const char *key, size_t keyLen, char **buf, size_t *bufSize) {
+    uint64_t hash = queue_hash(key, keyLen);
+    return readShard(shardOf(Q, hash), key, keyLen, hash, queueNow(Q), buf, bufSize, 1);
+}
+
+// like queue_get_value, but for a fixed buffer: copies at most outSize bytes, NUL terminated. returns 1 if found, 0 if not.
+int queue_get_copy(struct queue *Q, const char *key, char *out, size_t outSize) {
+    uint64_t hash = queue_hash(key, strlen(key));
+    return readShard(shardOf(Q, hash), key, strlen(key), hash, queueNow(Q), &out, &outSize, 0) >= 0;
+}
+
+// returns the value stored at key, or NULL if there is no such key. the pointer goes straight into the shard, so this
+// is only safe when no other thread is writing. connection threads use queue_get_value instead.
+char* queue_get(struct queue *Q, char *key) {
+    uint64_t hash = queue_hash(key, strlen(key));
+    struct shard *S = shardOf(Q, hash);
+    uint64_t *slot = findSlot(S, key, strlen(key), hash);
+    if (slot == NULL || itemExpired(itemAt(S, slotPosition(*slot)), queueNow(Q))) {
+        return NULL;
+    }
+    return itemValue(itemAt(S, slotPosition(*slot)));
+}
+
+// hashes every key of a batch and links the keys of each shard together, in batch order, through their next field.
+// heads[s] is the first key of shard s, count if it has none. each key's home slot is prefetched on the way, so it is
+// in the cache by the time the key's shard gets to it.
+static void batchGroup(struct queue *Q, struct queue_batch_key *keys, unsigned count, unsigned *heads) {
+    unsigned tails[QUEUE_MAX_SHARDS];
+    for (unsigned s = 0; s < Q->shardCount; s++) {
+        heads[s] = count;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        struct queue_batch_key *k = &keys[i];
+        k->hash = queue_hash(k->key, k->keyLen);
+        k->next = count;
+        struct shard *S = shardOf(Q, k->hash);
+        struct index_table *T = __atomic_load_n(&S->index, __ATOMIC_RELAXED);
+        __builtin_prefetch(&T->slots[(unsigned) k->hash & T->mask]);
+        unsigned s = (unsigned) (S - Q->shards);
+        if (heads[s] == count) {
+            heads[s] = i;
+        } else {
+            keys[tails[s]].next = i;
+        }
+        tails[s] = i;
+    }
+}
+
+// prefetches the item the home slot of key k points at, which is most likely k's own. caller holds S->lock.
+static inline void batchPrefetch(struct shard *S, const struct queue_batch_key *k) {
+    uint64_t slot = S->index->slots[(unsigned) k->hash & S->index->mask];
+    if (slotLive(slot)) {
+        __builtin_prefetch(itemAt(S, slotPosition(slot)));
+    }
+}
+
+// runs op (BATCH_GET, QUEUE_OP_SET or QUEUE_OP_DEL) on every key of a batch, one shard at a time, with every shard
+// lock taken once. values a BATCH_GET finds are copied one after the other into *buf, which grows to fit. returns how
+// many keys were found (or stored).
+static unsigned batchRun(struct queue *Q, struct queue_batch_key *keys, unsigned count, int op, char **buf,
+                         size_t *bufSize) {
+    unsigned heads[QUEUE_MAX_SHARDS];
+    batchGroup(Q, keys, count, heads);
+    uint32_t now = queueNow(Q);
+    size_t used = 0;
+    unsigned done = 0;
+    for (unsigned s = 0; s < Q->shardCount; s++) {
+        if (heads[s] == count) {
+            continue;
+        }
+        struct shard *S = &Q->shards[s];
+        unsigned before = done;
+        pthread_mutex_lock(&S->lock);
+        unsigned ahead = heads[s];
+        for (unsigned n = 0; n < BATCH_PREFETCH && ahead < count; n++) {
+            batchPrefetch(S, &keys[ahead]);
+            ahead = keys[ahead].next;
+        }
+        for (unsigned i = heads[s]; i < count; i = keys[i].next) {
+            if (ahead < count) {
+                batchPrefetch(S, &keys[ahead]);
+                ahead = keys[ahead].next;
+            }
+            struct queue_batch_key *k = &keys[i];
+            k->result = -1;
+            if (op == QUEUE_OP_SET) {
+                if (k->keyLen <= QUEUE_MAX_KEY && k->keyLen + k->valueLen <= Q->maxItem &&
+                    setUNLOCKED(Q, S, k->key, k->keyLen, k->hash, k->value, k->valueLen, 0) == 0) {
+                    k->result = 0;
+                }
+            } else if (op == QUEUE_OP_DEL) {
+                if (removeUNLOCKED(Q, S, k->key, k->keyLen, k->hash, NULL, NULL, 0) >= 0) {
+                    k->result = 0;
+                }
+            } else {
+                uint64_t *slot = findSlot(S, k->key, k->keyLen, k->hash);
+                struct item *e = slot != NULL ? itemAt(S, slotPosition(*slot)) : NULL;
+                // an expired pair is left for the wheel, like a lock-free GET would
+                if (e != NULL && !itemExpired(e, now) && growBuffer(buf, bufSize, used + e->valueLen + 1) == 0) {
+                    memcpy(*buf + used, itemValue(e), e->valueLen);
+                    k->offset = used;
+                    k->valueLen = e->valueLen;
+                    used += e->valueLen;
+                    k->result = 0;
+                    if (S->evict) {
+                        __atomic_fetch_or(slot, SLOT_REF, __ATOMIC_RELAXED);
+                    }
+                }
+            }
+            done += k->result == 0;
+        }
+        pthread_mutex_unlock(&S->lock);
+        if (op == QUEUE_OP_SET && done > before) {
+            pthread_cond_signal(&S->read_ready);
+        }
+    }
+    return done;
+}
+
+// looks up every key of a batch, holding each shard lock once for all of the batch's keys in that shard. the values
+// found are copied one after the other into *buf, which is grown to fit them all; a key's result is 0 and its offset
+// and valueLen say where its value is, or its result is -1 if it is not stored. returns the keys found.
+unsigned queue_get_many(struct queue *Q, struct queue_batch_key *keys, unsigned count, char **buf, size_t *bufSize) {
+    return batchRun(Q, keys, count, BATCH_GET, buf, bufSize);
+}
+
+// stores every pair of a batch like queue_set(), holding each shard lock once. pairs of the same key are stored in
+// batch order. a pair's result is -1 if it is too long or its shard had no memory left. returns the pairs stored.
+unsigned queue_set_many(struct queue *Q, struct queue_batch_key *keys, unsigned count) {
+    return batchRun(Q, keys, count, QUEUE_OP_SET, NULL, NULL);
+}
+
+// deletes every key of a batch, holding each shard lock once. a key's result is -1 if it was not stored. returns the
+// keys deleted.
+unsigned queue_remove_many(struct queue *Q, struct queue_batch_key *keys, unsigned count) {
+    return batchRun(Q, keys, count, QUEUE_OP_DEL, NULL, NULL);
+}
+
+// writes one pair into out the way queuePrint() and queue_dump() show it, and returns its length: at most
+// PAIR_FORMAT_EXTRA bytes more than the key and value. keys and values may hold any bytes, NULs included, so they are
+// copied by their lengths rather than printed as strings.
+static size_t pairFormat(char *out, unsigned s, unsigned ref, struct item *e) {
+    size_t len = sprintf(out, "Value at %u:%u: KEY IS \'", s, ref);
+    memcpy(out + len, e->data, e->keyLen);
+    len += e->keyLen;
+    len += sprintf(out + len, "\' VALUE IS \'");
+    memcpy(out + len, itemValue(e), e->valueLen);
+    len += e->valueLen;
+    memcpy(out + len, "\'\n", 2);
+    return len + 2;
+}
+
+static void tablePrint(struct shard *S, unsigned s, struct index_table *T, unsigned cursor, char **buf,
+                       size_t *bufSize) {
+    for (unsigned i = cursor; i <= T->mask; i++) {
+        if (slotLive(T->slots[i])) {
+            unsigned ref = slotPosition(T->slots[i]);
+            struct item *e = itemAt(S, ref);
+            if (growBuffer(buf, bufSize, e->keyLen + e->valueLen + PAIR_FORMAT_EXTRA) == 0) {
+                fwrite(*buf, 1, pairFormat(*buf, s, ref, e), stdout);
+            }
+        }
+    }
+}
+
+void queuePrint(struct queue *Q) {
+    char *buf = NULL;
+    size_t bufSize = 0;
+    for (unsigned s = 0; s < Q->shardCount; s++) {
+        struct shard *S = &Q->shards[s];
+        tablePrint(S, s, S->index, 0, &buf, &bufSize);
+        if (S->oldIndex != NULL) {
+            tablePrint(S, s, S->oldIndex, S->migrateCursor, &buf, &bufSize);
+        }
+    }
+    free(buf);
+}
+
+// writes every pair to out, in the format queuePrint() uses. it walks the slab pages a batch of chunks at a time and
+// only holds a shard lock while it copies a batch, never while it writes, so it is safe (if slow) on a busy store.
+// pairs stored, deleted or moved to another size class while the dump runs may be missed or show up twice. returns
+// pairs written, or -1 if we ran out of memory.
+long queue_dump(struct queue *Q, FILE *out) {
+    char *buf = NULL;
+    size_t bufSize = 0;
+    long pairs = 0;
+    for (unsigned s = 0; s < Q->shardCount; s++) {
+        struct shard *S = &Q->shards[s];
+        size_t offset = 0;  // next chunk to look at, as an offset into the arena
+        for (;;) {
+            size_t len = 0;
+            pthread_mutex_lock(&S->lock);
+            if (offset >= S->arenaUsed) {
+                pthread_mutex_unlock(&S->lock);
+                break;
+            }
+            uint32_t now = queueNow(Q);
+            size_t page = offset / Q->pageSize;
+            size_t start = page * Q->pageSize;
+            size_t size = Q->classSize[S->pageClass[page]];
+            offset = start + (offset - start + size - 1) / size * size;  // the page may have changed class meanwhile
+            for (unsigned n = 0; n < DUMP_BATCH && offset + size <= start + Q->pageSize; n++, offset += size) {
+                // the same liveness check pageReclaim() uses
+                unsigned ref = (unsigned) (offset >> ITEM_SHIFT);
+                struct item *e = itemAt(S, ref);
+                if (e->keyLen > QUEUE_MAX_KEY || itemSize(e->keyLen, 0) > size || itemExpired(e, now)) {
+                    continue;
+                }
+                uint64_t *slot = findSlot(S, e->data, e->keyLen, e->hash);
+                if (slot == NULL || slotPosition(*slot) != ref) {
+                    continue;
+                }
+                if (growBuffer(&buf, &bufSize, len + e->keyLen + e->valueLen + PAIR_FORMAT_EXTRA) < 0) {
+                    pthread_mutex_unlock(&S->lock);
+                    free(buf);
+                    return -1;
+                }
+                len += pairFormat(buf + len, s, ref, e);
+                ++pairs;
+            }
+            if (offset + size > start + Q->pageSize) {
+                offset = start + Q->pageSize;
+            }
+            pthread_mutex_unlock(&S->lock);
+            fwrite(buf, 1, len, out);
+        }
+    }
+    free(buf);
+    fflush(out);
+    return pairs;
+}
+
+// takes every shard lock, so no change to Q is half done while the caller holds them (see snapshot_start()). readers
+// are not held up.
+void queue_lock_all(struct queue *Q) {
+    for (unsigned s = 0; s < Q->shardCount; s++) {
+        pthread_mutex_lock(&Q->shards[s].lock);
+    }
+}
+
+// takes the lock of shard s only, for queue_set_UNLOCKED().
+void queue_lock_shard(struct queue *Q, unsigned s) {
+    pthread_mutex_lock(&Q->shards[s].lock);
+}
+
+void queue_unlock_shard(struct queue *Q, unsigned s) {
+    pthread_mutex_unlock(&Q->shards[s].lock);
+}
+
+void queue_unlock_all(struct queue *Q) {
+    for (unsigned s = Q->shardCount; s-- > 0;) {
+        pthread_mutex_unlock(&Q->shards[s].lock);
+    }
+}
+
+// calls visit for every pair of shard s that hasn't expired, straight from its index and without any lock, so it is
+// only for a store nobody is changing, like the copy of it a forked child sees. stops early if visit returns
+// non-zero. returns pairs visited, or -1 if visit stopped it.
+long queue_walk_shard(struct queue *Q, unsigned s, int (*visit)(void *arguements, const char *key, size_t keyLen,
+                      const char *value, size_t valueLen, uint32_t expire), void *arguements) {
+    struct shard *S = &Q->shards[s];
+    uint32_t now = queueNow(Q);
+    long pairs = 0;
+    // a key being migrated lives in exactly one of the tables: the old one from the cursor on, or the new one
+    struct index_table *tables[2] = {S->index, S->oldIndex};
+    unsigned from[2] = {0, S->migrateCursor};
+    for (int t = 0; t < 2 && tables[t] != NULL; t++) {
+        struct index_table *T = tables[t];
+        for (unsigned i = from[t]; i <= T->mask; i++) {
+            if (!slotLive(T->slots[i])) {
+                continue;
+            }
+            struct item *e = itemAt(S, slotPosition(T->slots[i]));
+            if (itemExpired(e, now)) {
+                continue;
+            }
+            if (visit(arguements, e->data, e->keyLen, itemValue(e), e->valueLen, e->expire) != 0) {
+                return -1;
+            }
+            ++pairs;
+        }
+    }
+    return pairs;
+}
+
+// returns the chunk reference of currElement's item in its shard, or -1 if it is not stored.
+int indexOfElement(struct queue *Q, char * currElement) {
+    uint64_t hash = queue_hash(currElement, strlen(currElement));
+    uint64_t *slot = findSlot(shardOf(Q, hash), currElement, strlen(currElement), hash);
+    if (slot == NULL) {
+        return -1;
+    }
+    return (int) slotPosition(*slot);
+}
+
+int alreadyExists(struct queue *Q, char * currElement) {
+    uint64_t hash = queue_hash(currElement, strlen(currElement));
+    return readShard(shardOf(Q, hash), currElement, strlen(currElement), hash, queueNow(Q), NULL, NULL, 0) >= 0;
+}
+
+// number of pairs stored across all shards, counting expired ones that haven't been reclaimed yet.
+unsigned queue_count(struct queue *Q) {
+    unsigned count = 0;
+    for (unsigned i = 0; i < Q->shardCount; i++) {
+        count += __atomic_load_n(&Q->shards[i].count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+// bytes of slab pages handed out across all shards. this is what a memory limit caps.
+size_t queue_memory(struct queue *Q) {
+    size_t used = 0;
+    for (unsigned i = 0; i < Q->shardCount; i++) {
+        used += __atomic_load_n(&Q->shards[i].arenaUsed, __ATOMIC_RELAXED);
+    }
+    return used;
+}
+
+// items evicted to stay under the memory limit, across all shards.
+unsigned long queue_evictions(struct queue *Q) {
+    unsigned long evictions = 0;
+    for (unsigned i = 0; i < Q->shardCount; i++) {
+        evictions += __atomic_load_n(&Q->shards[i].evictions, __ATOMIC_RELAXED);
+    }
+    return evictions;
+}
+
+// pages taken from one size class for another, across all shards.
+unsigned long queue_pages_moved(struct queue *Q) {
+    unsigned long moved = 0;
+    for (unsigned i = 0; i < Q->shardCount; i++) {
+        moved += __atomic_load_n(&Q->shards[i].pagesMoved, __ATOMIC_RELAXED);
+    }
+    return moved;
+}
+
+// pairs reclaimed because their time to live ran out, across all shards.
+unsigned long queue_expired(struct queue *Q) {
+    unsigned long expired = 0;
+    for (unsigned i = 0; i < Q->shardCount; i++) {
+        expired += __atomic_load_n(&Q->shards[i].expired, __ATOMIC_RELAXED);
+    }
+    return expired;
+}
+
+// has journal called with arguements for every change made to Q from now on, see the top of queue.h. NULL stops it.
+// set it up before other threads use Q.
+void queue_set_journal(struct queue *Q, void (*journal)(void *arguements, int op, const char *key, size_t keyLen,
+                       const char *value, size_t valueLen, uint32_t expire), void *arguements) {
+    Q->journal = journal;
+    Q->journalArg = arguements;
+}
+
+void queueDestroy(struct queue *Q) {
+    if (Q->compactorRunning) {
+        __atomic_store_n(&Q->compactorRunning, 0, __ATOMIC_RELEASE);
+        pthread_join(Q->compactor, NULL);
+    }
+    for (unsigned i = 0; i < Q->shardCount; i++) {
+        struct shard *S = &Q->shards[i];
+        if (Q->file == NULL) {
+            munmap(S->arena, S->arenaSize);
+            free(S->pageClass);
+        }
+        if (S->oldIndex != NULL && (char *) S->oldIndex != S->indexRegion) {
+            munmap(S->oldIndex, tableBytes(S->oldIndex));
+        }
+        while (S->retired != NULL) {
+            struct index_table *T = S->retired;
+            S->retired = T->retired;
+            if ((char *) T != S->indexRegion) {
+                munmap(T, tableBytes(T));
+            }
+        }
+        if (S->index != (struct index_table *) S->indexRegion) {
+            munmap(S->index, tableBytes(S->index));
+        }
+        for (unsigned level = 0; level < QUEUE_WHEEL_LEVELS; level++) {
+            for (unsigned w = 0; w < WHEEL_SLOTS; w++) {
+                free(S->wheel[level][w].entries);
+            }
+        }
+    }
+    free(Q->shards);
+    if (Q->file != NULL) {
+        munmap(Q->file, Q->fileSize);   // the file itself only changes at a checkpoint
+        close(Q->fileFd);
+    }
+}
+
+// ------------------------------- END OF QUEUE STRUCTURE -------------------------------
@@ -0,0 +1,281 @@
+/*
+ * HashServer storage -- the key-value "queue" shared by every connection thread.
+ *
+ * IMPLEMENTATION AND SHORT DESCRIPTION:
+ *      Key-value pairs are items of any length: a small header followed by the key and the value. Items are carved out
+ *      of slab pages the way memcached does it. Every item size is rounded up to one of a few dozen size classes, each
+ *      class 1.25 times bigger than the one before, and each page is cut into chunks of a single class. A chunk given
+ *      back by a DEL goes on its class's free list for the next SET of that size, so storing a pair never calls malloc
+ *      and short pairs only take a few dozen bytes. The largest class is a whole page, which sets the maximum item size.
+ *
+ *      Next to the pages sits an open-addressing hash index (linear probing, power-of-two size) which maps a key to
+ *      its item. Each index slot packs the upper 32 bits of the key's hash (a "tag") together with the item's chunk
+ *      reference + 1, so most probes are rejected without ever touching the item itself. An empty slot is 0, a
+ *      deleted slot is a tombstone that lookups skip over.
+ *
+ *      Every shard's index starts out tiny and doubles whenever it gets half full, so an empty store takes a few KB
+ *      and a big one is only limited by memory. A resize never stops the world: the shard switches to the new table
+ *      at once and keeps looking keys up in both, while every write (and the compactor) moves a small batch of the
+ *      old table's entries over until it is empty. The compactor then gives the old table's memory back to the
+ *      system, but its address range stays reserved so a lock-free reader that is still walking it can't fault.
+ *
+ *      Optionally every index table carries a counting Bloom filter over its keys, so a lookup of a key that isn't
+ *      stored can usually be answered without probing the table at all. It is a blocked filter: one 64 byte block (a
+ *      cache line of 128 four-bit counters) per 32 index slots, and a key sets 4 counters in a single block, so checking
+ *      a key costs exactly one cache line. Counters are decremented again when a key is deleted; one that ever hits 15
+ *      stays there, which only costs a false positive. The filter is sized and rebuilt along with its table, so it never
+ *      needs resizing of its own. It pays off when most lookups miss and the index is big, and costs a cache line on
+ *      every hit, which is why it is off by default.
+ *
+ *      The store is split into a power-of-two number of shards, each with its own lock, slab pages, free lists and
+ *      index. The top bits of a key's hash pick its shard, so connection threads working on different keys rarely
+ *      contend. A shard's pages come from one big stretch of address space reserved when the shard is created; only
+ *      the pages actually handed out ever take up memory.
+ *
+ *      A store can be given a memory limit, which is split evenly across the shards and caps the slab pages each may
+ *      take. A full shard evicts instead of failing a SET, approximating LRU with the CLOCK algorithm: a GET that
+ *      finds a key sets a "referenced" bit in its index slot (only if it isn't set yet, so hot keys don't keep
+ *      dirtying cache lines), and the eviction hand sweeps the index, clearing set bits and evicting the first item
+ *      of the size class that needs room whose bit is clear. A class that has no page at all, or that keeps evicting
+ *      while another class doesn't, takes a page away from a class that has several, evicting whatever is left in it,
+ *      the way memcached rebalances its slabs.
+ *
+ *      A pair can be given a time to live. Its expiry time sits in the item, so a GET of an expired pair simply misses,
+ *      and every shard also keeps a hierarchical timing wheel (four levels of 64 slots: seconds, minutes, hours, days)
+ *      that lists what expires when. The compactor thread turns the wheels a bounded number of entries per lock hold,
+ *      so even millions of keys expiring in the same second are reclaimed without ever holding a lock for long. A
+ *      wheel entry is only a hint: it names an item and the version the item had when it was scheduled, and is thrown
+ *      away if the item has changed since. Pushing a key's expiry further out leaves its entry where it is; when the
+ *      entry comes due it finds the key still alive and moves itself to the new time.
+ *
+ *      Items don't move once they are stored, unless a SET changes their size class. Deleting one turns its index slot
+ *      into a tombstone and frees its chunk, so a DEL costs the same no matter how many keys are stored. A background
+ *      compactor thread walks the index a small batch at a time and clears tombstones out of probe chains.
+ *
+ *      Reads don't take the shard lock. Every shard carries a sequence counter that writers make odd while they change
+ *      the shard and even again when they are done; queue_get_copy() does its lookup and value copy optimistically and
+ *      simply tries again if the counter moved. Storage is never freed while the queue is alive, so a reader racing a
+ *      writer can at worst see stale bytes, which the sequence check then throws away.
+ *
+ *      A queue can be given a journal (queue_set_journal()), which is told about every change a caller makes: every
+ *      SET with the expiry it ended up with, every DEL and every EXPIRE, while the shard lock is still held, so the
+ *      changes to a key reach it in the order they happened. Pairs that expire or are evicted are not reported; a
+ *      journal replayed later comes to the same conclusion on its own, or keeps a pair the memory limit dropped.
+ *
+ *      Batches of keys (queue_get_many(), queue_set_many(), queue_remove_many()) are hashed up front and grouped by
+ *      shard, so every shard lock is taken once per batch rather than once per key. Hashing a key also prefetches its
+ *      home index slot, and while a shard's keys are worked through, the items the home slots of the next few keys
+ *      point at are prefetched too, so the cache misses of a batch overlap instead of coming one after another.
+ *
+ *      A store can live in a file (queue_config.path) instead of anonymous memory. The file holds a header, then one
+ *      region per shard with its page classes, its arena and room for its largest possible index table, all at offsets
+ *      that only depend on the store's settings. Nothing in the arena or the index is a pointer (items are found by
+ *      chunk reference), so the file is mapped wherever the kernel likes. It is mapped privately: pages the store
+ *      changes are copied on write, and the file itself only changes at a checkpoint (queue_checkpoint()), which writes
+ *      back just the copied pages, the index and every shard's allocator state, then marks the header clean and bumps
+ *      its generation. Reopening a clean file maps it and is done; pages come in from the file as they are touched, and
+ *      the compactor files the expiry times of the pairs in the timing wheels in the background. A file whose
+ *      checkpoint was cut short is not trusted and the store starts empty. A crash between checkpoints leaves the file
+ *      at the last one, and the header names the change log (see aof.h) position it holds, so replaying just the log
+ *      tail after it brings the store up to date.
+ */
+
+#ifndef HASHSERVER_QUEUE_H
+#define HASHSERVER_QUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Define parameters
+#define QUEUE_MAX_KEY 250    // longest key in bytes
+#define QUEUE_MAX_ITEM (1u << 20)   // default for the longest key + value in bytes
+#define QUEUE_MAX_ITEM_LIMIT (256u << 20)
+#define QUEUE_INDEX_MIN 64   // slots a shard's hash index starts out with. power of two
+#define QUEUE_SHARDS 16      // default number of shards
+#define QUEUE_MAX_SHARDS 1024
+#define QUEUE_SLAB_PAGE (1u << 20)  // smallest slab page. pages grow to the maximum item size if that is bigger
+#define QUEUE_MAX_CLASSES 64
+#define QUEUE_ARENA_SIZE (64ull << 30)  // address space reserved for slab pages, split across the shards
+#define QUEUE_MAX_TTL (10u * 365 * 24 * 3600)   // longest time to live in seconds
+#define QUEUE_WHEEL_BITS 6  // every timing wheel level has 64 slots
+#define QUEUE_WHEEL_LEVELS 4    // slots of 1 s, 64 s, 68 min and 3 days. anything later waits in the last level
+
+// Changes reported to a journal
+#define QUEUE_OP_SET 1      // key now holds value, expiring at expire (0 for never)
+#define QUEUE_OP_DEL 2      // key is gone
+#define QUEUE_OP_EXPIRE 3   // key now expires at expire
+
+// Key-Value pair structure. An item is this header followed by the key, a NUL, the value and another NUL.
+struct item {
+    uint64_t hash;      // queue_hash() of key, kept so the index can be repaired without rehashing strings
+    uint32_t keyLen;
+    uint32_t valueLen;
+    uint32_t expire;    // unix time the pair expires at, 0 if it doesn't
+    uint32_t version;   // changes whenever the pair gets a new timing wheel entry, see struct wheel_entry
+    char data[];
+};
+
+// One key of a batch. The caller fills in the key, and the value for queue_set_many(); the queue does the rest.
+struct queue_batch_key {
+    const char *key;
+    size_t keyLen;
+    const char *value;
+    size_t valueLen;    // queue_get_many(): the value's length, which is copied to offset of the buffer
+    size_t offset;
+    long result;        // 0 if the key was found (or stored), -1 if not
+    uint64_t hash;
+    unsigned next;      // next key of the same shard
+};
+
+// A timing wheel entry: "look at this item when the slot comes due". Stale if the item's version has moved on.
+struct wheel_entry {
+    uint32_t ref;       // chunk reference of the item
+    uint32_t version;
+};
+
+// One slot of a timing wheel
+struct wheel_slot {
+    struct wheel_entry *entries;
+    unsigned count;
+    unsigned cap;
+};
+
+// One size class of a shard's slab pages
+struct slab_class {
+    unsigned freeHead;  // chunk reference + 1 of the first free chunk, 0 if there is none. free chunks are linked
+                        // through their hash field
+    size_t next;        // next never used chunk in the class's newest page, as an offset into the arena
+    size_t end;         // where that page ends
+    unsigned pages;     // pages the class owns
+    unsigned evicted;   // items evicted to make room in the class since pages were last rebalanced
+};
+
+// One hash index table. The slots follow the header in the same mapping.
+struct index_table {
+    unsigned mask;      // slots - 1
+    int released;       // the slots' memory has been given back, see tableRelease()
+    struct index_table *retired;    // next older table the shard has finished draining
+    unsigned char *filter;          // counting Bloom filter over the table's keys, after the slots. NULL if unused
+    unsigned filterMask;            // filter blocks - 1
+    uint64_t slots[];   // (tag << 32) | (chunk reference + 1)
+};
+
+// One independently locked slice of the store
+struct shard {
+    char *arena;        // address space the slab pages are cut from
+    size_t arenaSize;
+    size_t arenaUsed;   // bytes of it handed out as pages so far
+    size_t pageLimit;   // arenaUsed never goes past this
+    int evict;          // whether a full shard evicts (the queue has a memory limit) or fails the SET
+    int filter;         // whether its index tables carry a Bloom filter
+    unsigned char *pageClass;   // size class every page handed out so far belongs to
+    struct slab_class classes[QUEUE_MAX_CLASSES];
+    struct index_table *index;      // hash index new keys go into
+    struct index_table *oldIndex;   // table being drained into index while the index is resized, NULL otherwise
+    unsigned migrateCursor;         // slots of oldIndex below this have been moved already
+    struct index_table *retired;    // drained tables, kept mapped for lock-free readers until the queue is destroyed
+    unsigned tombstones;  // deleted slots still sitting in the current index
+    unsigned count;  // number of items in shard
+    unsigned compactCursor;   // next index slot the compactor looks at
+    unsigned clockHand;     // next index slot the eviction clock looks at
+    size_t pageHand;        // next page considered when a size class needs a page taken from another
+    unsigned long evictions;    // items evicted to make room
+    unsigned long pagesMoved;   // pages taken from one size class for another
+    struct wheel_slot wheel[QUEUE_WHEEL_LEVELS][1u << QUEUE_WHEEL_BITS];
+    uint32_t wheelTime;     // last second the timing wheel has been turned through
+    unsigned wheelLevel;    // level of the slot being worked through for the second after that
+    unsigned wheelPos;      // entries of that slot done so far
+    uint32_t itemVersion;   // last version handed to an item
+    unsigned long expired;  // pairs reclaimed because their time to live ran out
+    char *indexRegion;      // where a checkpoint writes the index table in the store file, NULL without one
+    int rebuilding;         // the timing wheel is still being refilled after a reopen, see wheelRebuild()
+    uint32_t rebuildVersion;    // items with this version or an older one have no wheel entry yet
+    unsigned rebuildCursor;     // next index slot the refill looks at
+    struct index_table *rebuildTable;   // table the cursor belongs to
+    unsigned seq;   // odd while a writer is changing the shard, see queue_get_copy()
+    pthread_mutex_t lock;
+    pthread_cond_t read_ready;  // wait for count > 0
+};
+
+// Queue Structure
+struct queue {
+    struct shard *shards;
+    unsigned shardCount;    // power of two
+    unsigned shardBits;     // log2(shardCount)
+    size_t maxItem;         // longest key + value accepted
+    size_t maxMemory;       // bytes of slab pages the shards may take together before they evict, 0 for no limit
+    int filter;             // index tables carry a counting Bloom filter
+    size_t pageSize;        // bytes per slab page, also the chunk size of the largest class
+    unsigned classCount;
+    unsigned classSize[QUEUE_MAX_CLASSES];  // chunk size of every class, smallest first
+    uint32_t now;           // unix time, refreshed by the compactor thread so lookups don't have to ask the kernel
+    int compactorRunning;
+    pthread_t compactor;
+    void (*journal)(void *arguements, int op, const char *key, size_t keyLen, const char *value, size_t valueLen,
+                    uint32_t expire);   // told about every change, see queue_set_journal(). NULL for none
+    void *journalArg;
+    int fileFd;             // the store file, -1 without one
+    char *file;             // where it is mapped
+    size_t fileSize;
+    int restored;           // the store was reopened from a checkpoint of the file
+    uint64_t generation;    // checkpoints the file has been through
+    uint64_t logId;         // the change log the checkpoint or loaded snapshot holds changes of, see queue_checkpoint()
+    uint64_t logOffset;     // and how far into it
+};
+
+// How to set up a queue. Fields left at 0 get their default.
+struct queue_config {
+    unsigned shards;        // power of two, at most QUEUE_MAX_SHARDS
+    size_t maxItem;         // longest key + value, at most QUEUE_MAX_ITEM_LIMIT
+    size_t maxMemory;       // memory limit for keys and values, evicting when it is reached. 0 for no limit. every
+                            // shard gets at least one page
+    int filter;             // put a counting Bloom filter in front of every index table, for stores that see many
+                            // lookups of keys they don't have
+    const char *path;       // keep the store in this file, reopening it if it holds a checkpoint. NULL for memory only
+};
+
+// Method definitions
+int queue_init(struct queue *Q, const struct queue_config *config);
+int queue_add(struct queue *Q, char * key, char * value);
+int queue_set(struct queue *Q, const char *key, size_t keyLen, const char *value, size_t valueLen);
+int queue_setex(struct queue *Q, const char *key, size_t keyLen, const char *value, size_t valueLen, unsigned seconds);
+int queue_set_UNLOCKED(struct queue *Q, unsigned s, const char *key, size_t keyLen, const char *value, size_t valueLen,
+                       uint32_t expire);
+int queue_expire(struct queue *Q, const char *key, size_t keyLen, long seconds);
+long queue_ttl(struct queue *Q, const char *key, size_t keyLen);
+int queue_remove(struct queue *Q, char *item);
+int queue_remove_UNLOCKED(struct queue *Q, char *item);
+char* queue_get(struct queue *Q, char *key);
+long queue_get_value(struct queue *Q, const char *key, size_t keyLen, char **buf, size_t *bufSize);
+long queue_remove_value(struct queue *Q, const char *key, size_t keyLen, char **buf, size_t *bufSize);
+unsigned queue_get_many(struct queue *Q, struct queue_batch_key *keys, unsigned count, char **buf, size_t *bufSize);
+unsigned queue_set_many(struct queue *Q, struct queue_batch_key *keys, unsigned count);
+unsigned queue_remove_many(struct queue *Q, struct queue_batch_key *keys, unsigned count);
+int queue_get_copy(struct queue *Q, const char *key, char *out, size_t outSize);
+int queue_remove_copy(struct queue *Q, const char *key, char *out, size_t outSize);
+void queuePrint(struct queue *Q);
+long queue_dump(struct queue *Q, FILE *out);
+void queue_lock_all(struct queue *Q);
+void queue_unlock_all(struct queue *Q);
+void queue_lock_shard(struct queue *Q, unsigned s);
+void queue_unlock_shard(struct queue *Q, unsigned s);
+int queue_checkpoint(struct queue *Q, uint64_t logId, uint64_t logOffset);
+long queue_walk_shard(struct queue *Q, unsigned s, int (*visit)(void *arguements, const char *key, size_t keyLen,
+                      const char *value, size_t valueLen, uint32_t expire), void *arguements);
+int indexOfElement(struct queue *Q, char * currElement);
+int alreadyExists(struct queue *Q, char * currElement);
+void queueDestroy(struct queue *Q);
+unsigned queue_count(struct queue *Q);
+unsigned queue_compact(struct queue *Q, unsigned budget);
+size_t queue_memory(struct queue *Q);
+unsigned long queue_evictions(struct queue *Q);
+unsigned long queue_pages_moved(struct queue *Q);
+unsigned queue_expire_due(struct queue *Q, unsigned budget);
+unsigned long queue_expired(struct queue *Q);
+uint64_t queue_hash(const void *key, size_t len);
+void queue_set_journal(struct queue *Q, void (*journal)(void *arguements, int op, const char *key, size_t keyLen,
+                       const char *value, size_t valueLen, uint32_t expire), void *arguements);
+
+#endif
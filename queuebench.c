@@ -0,0 +1,598 @@
+/*
+ * queuebench -- in-process benchmark for the HashServer storage.
+ *
+ * "sizes" mode (the default) fills a fresh queue with 1K, 10K, 100K, 1M and 10M keys and reports the average cost of a
+ * SET, a GET (hit), a GET (miss) and a DEL at each size. With the hash index these numbers should stay flat as the store
+ * grows. It also reports the slowest single SET, which shows whether growing the index ever stalls a writer.
+ *
+ * "threads" mode preloads BENCH_KEYS keys and then runs SET-only and GET-only phases from 1 up to 32 threads at once,
+ * reporting total throughput and the speedup over one thread. Compare a run with 1 shard against one with many shards.
+ * A third phase repeats the GETs while one extra thread keeps writing, to show reads don't queue up behind writers.
+ *
+ * "evict" mode gives the store a BENCH_MEMORY limit and keeps SETting new keys, first until it is full and then for as
+ * many keys again, so every SET of the second phase has to evict. It compares SET throughput before and at full memory
+ * and checks how well the CLOCK eviction keeps a small set of keys that is read all the time.
+ *
+ * "expire" mode SETs new keys with a BENCH_TTL second time to live at BENCH_EXPIRE_RATE keys per second for
+ * BENCH_EXPIRE_SECONDS, printing once a second how many keys are stored and how many have been reclaimed. If the timing
+ * wheels keep up, the stored count levels off at about rate * ttl instead of growing for the whole run, and the slowest
+ * SET shows whether reclaiming ever holds a shard lock for long.
+ *
+ * "miss" mode fills a store without and then with the Bloom filter (queue_config.filter) in front of the index, with
+ * 100K, 1M and 10M keys, and times GETs that all hit, GETs that all miss, and a mix where BENCH_MISS_PERCENT of them
+ * miss. The filter should make misses cheaper on a big store, at the price of one more cache line on every hit.
+ *
+ * "suite" mode is for tracking the engine over time rather than reading by eye. It runs every combination of 10K, 100K
+ * and 1M keys, 16 and 64 byte keys, 32 and 1024 byte values and 1, 4 and 16 threads, timing SETs over the stored keys,
+ * GETs that hit 100%, 50% and 0% of the time and DELs, and writes one row per measurement to standard output as CSV
+ * (the default) or JSON. Progress goes to standard error, so "./queuebench suite 16 json > results.json" keeps the
+ * file clean. Each store also gets a "fill" row, for SETting all of its keys into it when it is new.
+ *
+ * USAGE: ./queuebench [sizes|threads|evict|expire|miss|suite] [shards] [csv|json]
+ */
+
+// Imports
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "queue.h"
+
+#define BENCH_GETS 1000000   // lookups timed per size
+#define BENCH_DELS 100       // deletes timed per size
+#define BENCH_KEYS 100000    // keys preloaded for the thread scaling runs
+#define BENCH_THREAD_OPS 200000  // operations per thread per phase
+#define BENCH_MAX_THREADS 32
+#define BENCH_KEY 32
+#define BENCH_VALUE 100
+#define BENCH_MEMORY (256u << 20)   // memory limit for the eviction run
+#define BENCH_HOT 10000     // keys the eviction run keeps reading
+#define BENCH_EXPIRE_RATE 100000    // SETs per second in the expiry run
+#define BENCH_EXPIRE_SECONDS 10
+#define BENCH_TTL 2
+#define BENCH_MISS_PERCENT 90   // share of the lookups in the mixed run that ask for keys not stored
+
+// holds arguements for one benchmark thread
+struct bench_args {
+    struct queue *Q;
+    unsigned seed;
+    int doSet;
+    volatile int *stop;     // set when a background writer should quit, NULL for counted phases
+};
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void makeKey(char *buff, unsigned i) {
+    snprintf(buff, BENCH_KEY, "key:%u", i);
+}
+
+static int benchSizes(unsigned shards) {
+    unsigned sizes[] = {1000, 10000, 100000, 1000000, 10000000};
+    char key[BENCH_KEY];
+    char value[BENCH_VALUE];
+    memset(value, 'v', 32);
+    value[32] = '\0';
+
+    printf("%10s %12s %12s %12s %12s %12s\n", "keys", "SET ns/op", "max SET us", "GET ns/op", "MISS ns/op", "DEL ns/op");
+
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        unsigned n = sizes[s];
+        struct queue Q;
+        struct queue_config config = {.shards = shards};
+        if (queue_init(&Q, &config) != EXIT_SUCCESS) {
+            perror("queue_init failed!\n");
+            return EXIT_FAILURE;
+        }
+
+        double start = nowNs();
+        double worst = 0;
+        for (unsigned i = 0; i < n; i++) {
+            makeKey(key, i);
+            double before = nowNs();
+            queue_add(&Q, key, value);
+            double took = nowNs() - before;
+            if (took > worst) {
+                worst = took;
+            }
+        }
+        double setNs = (nowNs() - start) / n;
+
+        unsigned seed = 12345;
+        start = nowNs();
+        for (unsigned i = 0; i < BENCH_GETS; i++) {
+            seed = seed * 1103515245 + 12345;
+            makeKey(key, seed % n);
+            if (!queue_get_copy(&Q, key, value, sizeof(value))) {
+                fprintf(stderr, "lost key %s!\n", key);
+                return EXIT_FAILURE;
+            }
+        }
+        double getNs = (nowNs() - start) / BENCH_GETS;
+
+        start = nowNs();
+        for (unsigned i = 0; i < BENCH_GETS; i++) {
+            makeKey(key, n + i);
+            queue_get_copy(&Q, key, value, sizeof(value));
+        }
+        double missNs = (nowNs() - start) / BENCH_GETS;
+
+        // deletes are spread over the whole key space. 7919 is prime, so the victims are all distinct.
+        unsigned dels = BENCH_DELS;
+        start = nowNs();
+        for (unsigned i = 0; i < dels; i++) {
+            makeKey(key, (i * 7919u) % n);
+            queue_remove(&Q, key);
+        }
+        double delNs = (nowNs() - start) / dels;
+
+        printf("%10u %12.1f %12.1f %12.1f %12.1f %12.1f\n", n, setNs, worst / 1000, getNs, missNs, delNs);
+        queueDestroy(&Q);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void * benchWorker(void *arguements) {
+    struct bench_args *args = (struct bench_args *) arguements;
+    char key[BENCH_KEY];
+    char value[BENCH_VALUE] = "some value";
+    unsigned seed = args->seed;
+
+    for (unsigned i = 0; args->stop != NULL ? !*args->stop : i < BENCH_THREAD_OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        makeKey(key, (seed >> 4) % BENCH_KEYS);
+        if (args->doSet) {
+            queue_add(args->Q, key, value);
+        } else {
+            queue_get_copy(args->Q, key, value, sizeof(value));
+        }
+    }
+    return NULL;
+}
+
+// runs one phase with the given number of threads and returns its throughput in operations per second. with
+// withWriter set, one extra thread keeps SETting for the whole phase and its operations are not counted.
+static double runPhase(struct queue *Q, unsigned threads, int doSet, int withWriter) {
+    pthread_t t[BENCH_MAX_THREADS];
+    struct bench_args args[BENCH_MAX_THREADS];
+    pthread_t writer;
+    volatile int stop = 0;
+    struct bench_args writerArgs = {Q, 999, 1, &stop};
+
+    if (withWriter) {
+        pthread_create(&writer, NULL, benchWorker, &writerArgs);
+    }
+
+    double start = nowNs();
+    for (unsigned i = 0; i < threads; i++) {
+        args[i].Q = Q;
+        args[i].seed = 1000 + i;
+        args[i].doSet = doSet;
+        args[i].stop = NULL;
+        pthread_create(&t[i], NULL, benchWorker, &args[i]);
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_join(t[i], NULL);
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    if (withWriter) {
+        stop = 1;
+        pthread_join(writer, NULL);
+    }
+    return threads * (double) BENCH_THREAD_OPS / seconds;
+}
+
+static int benchThreads(unsigned shards) {
+    struct queue Q;
+    char key[BENCH_KEY];
+    struct queue_config config = {.shards = shards};
+    if (queue_init(&Q, &config) != EXIT_SUCCESS) {
+        perror("queue_init failed!\n");
+        return EXIT_FAILURE;
+    }
+    for (unsigned i = 0; i < BENCH_KEYS; i++) {
+        makeKey(key, i);
+        queue_add(&Q, key, "some value");
+    }
+
+    printf("%u shards, %u keys\n", shards, BENCH_KEYS);
+    printf("%8s %14s %8s %14s %8s %16s %8s\n", "threads", "SET ops/s", "speedup", "GET ops/s", "speedup",
+           "GET+writer ops/s", "speedup");
+
+    double setOne = 0, getOne = 0, mixedOne = 0;
+    for (unsigned threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+        double set = runPhase(&Q, threads, 1, 0);
+        double get = runPhase(&Q, threads, 0, 0);
+        double mixed = runPhase(&Q, threads, 0, 1);
+        if (threads == 1) {
+            setOne = set;
+            getOne = get;
+            mixedOne = mixed;
+        }
+        printf("%8u %14.0f %8.2f %14.0f %8.2f %16.0f %8.2f\n", threads, set, set / setOne, get, get / getOne,
+               mixed, mixed / mixedOne);
+    }
+
+    queueDestroy(&Q);
+    return EXIT_SUCCESS;
+}
+
+// SETs keys from..to-1, reading one of the hot keys (the first BENCH_HOT) after every hot'th SET. returns the
+// slowest SET in ns and counts the hot reads that missed.
+static double evictPhase(struct queue *Q, unsigned from, unsigned to, unsigned hot, unsigned long *hotMisses) {
+    char key[BENCH_KEY];
+    char value[BENCH_VALUE];
+    memset(value, 'v', 64);
+    value[64] = '\0';
+    double worst = 0;
+    for (unsigned i = from; i < to; i++) {
+        makeKey(key, i);
+        double before = nowNs();
+        queue_add(Q, key, value);
+        double took = nowNs() - before;
+        if (took > worst) {
+            worst = took;
+        }
+        if (hot != 0 && i % hot == 0) {
+            // like a cache client, put back a hot key that went missing
+            makeKey(key, (i / hot) % BENCH_HOT);
+            if (!queue_get_copy(Q, key, value, sizeof(value))) {
+                ++*hotMisses;
+                queue_add(Q, key, value);
+            }
+        }
+    }
+    return worst;
+}
+
+static int benchEvict(unsigned shards) {
+    struct queue Q;
+    struct queue_config config = {.shards = shards, .maxMemory = BENCH_MEMORY};
+    if (queue_init(&Q, &config) != EXIT_SUCCESS) {
+        perror("queue_init failed!\n");
+        return EXIT_FAILURE;
+    }
+    printf("%u shards, %u MB limit, 64 byte values\n", shards, BENCH_MEMORY >> 20);
+    printf("%10s %12s %12s %12s %12s %12s\n", "phase", "keys", "SET ns/op", "max SET us", "evictions", "hot misses");
+
+    // fill until the first eviction, in steps so the check stays off the timed path
+    unsigned long misses = 0;
+    unsigned filled = 0;
+    double start = nowNs();
+    double worst = 0;
+    while (queue_evictions(&Q) == 0) {
+        double w = evictPhase(&Q, filled, filled + 10000, 0, &misses);
+        worst = w > worst ? w : worst;
+        filled += 10000;
+    }
+    double fillNs = (nowNs() - start) / filled;
+    printf("%10s %12u %12.1f %12.1f %12lu %12s\n", "fill", filled, fillNs, worst / 1000, queue_evictions(&Q), "-");
+
+    // as many new keys again: every one of them evicts. a hot key is read after every 10th SET
+    unsigned long evictions = queue_evictions(&Q);
+    start = nowNs();
+    worst = evictPhase(&Q, filled, 2 * filled, 10, &misses);
+    double fullNs = (nowNs() - start) / filled;
+    printf("%10s %12u %12.1f %12.1f %12lu %12lu\n", "full", filled, fullNs, worst / 1000,
+           queue_evictions(&Q) - evictions, misses);
+
+    printf("%u keys stored in %zu bytes, %lu pages moved between size classes\n", queue_count(&Q), queue_memory(&Q),
+           queue_pages_moved(&Q));
+    queueDestroy(&Q);
+    return EXIT_SUCCESS;
+}
+
+static int benchExpire(unsigned shards) {
+    struct queue Q;
+    struct queue_config config = {.shards = shards};
+    if (queue_init(&Q, &config) != EXIT_SUCCESS) {
+        perror("queue_init failed!\n");
+        return EXIT_FAILURE;
+    }
+    char key[BENCH_KEY];
+    char value[BENCH_VALUE];
+    memset(value, 'v', 64);
+    value[64] = '\0';
+    printf("%u shards, %u SETs/s with a %u s time to live\n", shards, BENCH_EXPIRE_RATE, BENCH_TTL);
+    printf("%8s %12s %12s %12s %12s %12s\n", "second", "written", "stored", "expired", "memory MB", "max SET us");
+
+    // SETs go out in small steps, each one waiting for its share of the second, so the rate stays even
+    double start = nowNs();
+    double step = 1e9 / BENCH_EXPIRE_RATE * 1000;
+    unsigned written = 0;
+    double worst = 0;
+    for (unsigned second = 1; second <= BENCH_EXPIRE_SECONDS; second++) {
+        while (nowNs() - start < second * 1e9) {
+            for (unsigned i = 0; i < 1000; i++, written++) {
+                makeKey(key, written);
+                double before = nowNs();
+                queue_setex(&Q, key, strlen(key), value, 64, BENCH_TTL);
+                double took = nowNs() - before;
+                if (took > worst) {
+                    worst = took;
+                }
+            }
+            struct timespec pause = {0, 0};
+            double due = start + written / 1000 * step;
+            if (due > nowNs()) {
+                pause.tv_nsec = (long) (due - nowNs());
+                nanosleep(&pause, NULL);
+            }
+        }
+        printf("%8u %12u %12u %12lu %12zu %12.1f\n", second, written, queue_count(&Q), queue_expired(&Q),
+               queue_memory(&Q) >> 20, worst / 1000);
+        worst = 0;
+    }
+
+    queueDestroy(&Q);
+    return EXIT_SUCCESS;
+}
+
+// times BENCH_GETS lookups of which missPercent ask for keys that aren't among the n stored. returns ns per lookup.
+static double lookupPhase(struct queue *Q, unsigned n, unsigned missPercent) {
+    char key[BENCH_KEY];
+    char value[BENCH_VALUE];
+    unsigned seed = 12345;
+    double start = nowNs();
+    for (unsigned i = 0; i < BENCH_GETS; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned k = (seed >> 4) % n;
+        makeKey(key, (seed >> 24) % 100 < missPercent ? n + k : k);
+        queue_get_copy(Q, key, value, sizeof(value));
+    }
+    return (nowNs() - start) / BENCH_GETS;
+}
+
+static int benchMiss(unsigned shards) {
+    unsigned sizes[] = {100000, 1000000, 10000000};
+    char key[BENCH_KEY];
+
+    printf("%10s %8s %12s %12s %16s\n", "keys", "filter", "hit ns/op", "miss ns/op", "90% miss ns/op");
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int filter = 0; filter <= 1; filter++) {
+            unsigned n = sizes[s];
+            struct queue Q;
+            struct queue_config config = {.shards = shards, .filter = filter};
+            if (queue_init(&Q, &config) != EXIT_SUCCESS) {
+                perror("queue_init failed!\n");
+                return EXIT_FAILURE;
+            }
+            for (unsigned i = 0; i < n; i++) {
+                makeKey(key, i);
+                queue_add(&Q, key, "some value");
+            }
+            double hit = lookupPhase(&Q, n, 0);
+            double miss = lookupPhase(&Q, n, 100);
+            double mixed = lookupPhase(&Q, n, BENCH_MISS_PERCENT);
+            printf("%10u %8s %12.1f %12.1f %16.1f\n", n, filter ? "on" : "off", hit, miss, mixed);
+            queueDestroy(&Q);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// ------------------------------- SUITE -------------------------------
+
+#define SUITE_OPS 200000    // operations per thread per timed phase
+#define SUITE_DELS 20000    // deletes per timed DEL phase, spread over the threads. at most half the keys
+#define SUITE_MAX_KEY 250
+
+#define SUITE_SET 0
+#define SUITE_GET 1
+#define SUITE_DEL 2
+#define SUITE_FILL 3    // a single thread SETting every key of a fresh store once, in order
+
+static const char *suiteOps[] = {"set", "get", "del", "fill"};
+
+// holds arguements for one suite thread
+struct suite_args {
+    struct queue *Q;
+    int op;
+    unsigned keys;          // keys stored. key i is "key:<i>" padded to keySize, keys from this on are never stored
+    unsigned keySize;
+    unsigned valueSize;
+    unsigned hitPercent;    // share of GETs that ask for a stored key
+    unsigned seed;
+    unsigned from;          // DEL: the thread deletes keys number from..to-1 of a spread out order
+    unsigned to;
+};
+
+// key number i, exactly size bytes long
+static size_t makeSizedKey(char *buff, unsigned i, unsigned size) {
+    int n = snprintf(buff, SUITE_MAX_KEY + 1, "key:%u:", i);
+    if ((unsigned) n < size) {
+        memset(buff + n, 'k', size - n);
+    }
+    buff[size] = '\0';
+    return size;
+}
+
+static void * suiteWorker(void *arguements) {
+    struct suite_args *args = (struct suite_args *) arguements;
+    char key[SUITE_MAX_KEY + 1];
+    char *value = malloc(args->valueSize + 1);
+    char *buf = NULL;
+    size_t bufSize = 0;
+    if (value == NULL) {
+        perror("out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(value, 'v', args->valueSize);
+    value[args->valueSize] = '\0';
+
+    if (args->op == SUITE_DEL) {
+        // 7919 is prime, so the victims are all distinct and spread over the whole key space
+        for (unsigned i = args->from; i < args->to; i++) {
+            size_t keyLen = makeSizedKey(key, (unsigned) ((i * 7919ull) % args->keys), args->keySize);
+            queue_remove_value(args->Q, key, keyLen, &buf, &bufSize);
+        }
+    } else {
+        unsigned seed = args->seed;
+        for (unsigned i = 0; i < SUITE_OPS; i++) {
+            seed = seed * 1103515245 + 12345;
+            unsigned k = (seed >> 4) % args->keys;
+            if (args->op == SUITE_GET && (seed >> 24) % 100 >= args->hitPercent) {
+                k += args->keys;
+            }
+            size_t keyLen = makeSizedKey(key, k, args->keySize);
+            if (args->op == SUITE_SET) {
+                queue_set(args->Q, key, keyLen, value, args->valueSize);
+            } else {
+                queue_get_value(args->Q, key, keyLen, &buf, &bufSize);
+            }
+        }
+    }
+    free(value);
+    free(buf);
+    return NULL;
+}
+
+// deletes a DEL phase does on a store of the given size with threads threads
+static unsigned suiteDels(unsigned keys, unsigned threads) {
+    unsigned dels = keys / 2 < SUITE_DELS ? keys / 2 : SUITE_DELS;
+    return dels / threads * threads;
+}
+
+// runs one timed phase on threads threads and returns how long it took in seconds
+static double suitePhase(struct suite_args *base, unsigned threads) {
+    pthread_t t[BENCH_MAX_THREADS];
+    struct suite_args args[BENCH_MAX_THREADS];
+    unsigned slice = suiteDels(base->keys, threads) / threads;
+    double start = nowNs();
+    for (unsigned i = 0; i < threads; i++) {
+        args[i] = *base;
+        args[i].seed = 1000 + i;
+        args[i].from = slice * i;
+        args[i].to = slice * (i + 1);
+        pthread_create(&t[i], NULL, suiteWorker, &args[i]);
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_join(t[i], NULL);
+    }
+    return (nowNs() - start) / 1e9;
+}
+
+// one line of results, as CSV or as an element of the JSON array
+static void suiteRow(int json, int *rows, unsigned shards, const struct suite_args *args, unsigned threads,
+                     unsigned long ops, double seconds) {
+    double opsPerSecond = ops / seconds;
+    double nsPerOp = seconds * 1e9 / ops * threads;
+    int hits = args->op == SUITE_GET ? (int) args->hitPercent : -1;
+    if (json) {
+        printf("%s\n    {\"op\": \"%s\", \"shards\": %u, \"keys\": %u, \"key_size\": %u, \"value_size\": %u, "
+               "\"threads\": %u, \"hit_percent\": %d, \"ops\": %lu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+               "\"ns_per_op\": %.1f}", *rows > 0 ? "," : "", suiteOps[args->op], shards, args->keys, args->keySize,
+               args->valueSize, threads, hits, ops, seconds, opsPerSecond, nsPerOp);
+    } else {
+        printf("%s,%u,%u,%u,%u,%u,%d,%lu,%.6f,%.0f,%.1f\n", suiteOps[args->op], shards, args->keys, args->keySize,
+               args->valueSize, threads, hits, ops, seconds, opsPerSecond, nsPerOp);
+    }
+    ++*rows;
+    fflush(stdout);
+}
+
+// every combination of store size, key size, value size, thread count and GET hit ratio, as machine readable rows.
+// ns_per_op is per thread, the time one operation takes the thread doing it.
+static int benchSuite(unsigned shards, const char *format) {
+    unsigned sizes[] = {10000, 100000, 1000000};
+    unsigned keySizes[] = {16, 64};
+    unsigned valueSizes[] = {32, 1024};
+    unsigned threadCounts[] = {1, 4, 16};
+    unsigned hitPercents[] = {100, 50, 0};
+    int json = strcmp(format, "json") == 0;
+    if (!json && strcmp(format, "csv") != 0) {
+        fprintf(stderr, "unknown format %s!\n", format);
+        return EXIT_FAILURE;
+    }
+
+    int rows = 0;
+    if (json) {
+        printf("{\"benchmark\": \"queuebench suite\", \"results\": [");
+    } else {
+        printf("op,shards,keys,key_size,value_size,threads,hit_percent,ops,seconds,ops_per_sec,ns_per_op\n");
+    }
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (unsigned ks = 0; ks < sizeof(keySizes) / sizeof(keySizes[0]); ks++) {
+            for (unsigned vs = 0; vs < sizeof(valueSizes) / sizeof(valueSizes[0]); vs++) {
+                struct queue Q;
+                struct queue_config config = {.shards = shards};
+                if (queue_init(&Q, &config) != EXIT_SUCCESS) {
+                    perror("queue_init failed!\n");
+                    return EXIT_FAILURE;
+                }
+                struct suite_args args = {.Q = &Q, .keys = sizes[s], .keySize = keySizes[ks],
+                                          .valueSize = valueSizes[vs]};
+                fprintf(stderr, "%u keys of %u bytes, %u byte values\n", args.keys, args.keySize, args.valueSize);
+
+                char key[SUITE_MAX_KEY + 1];
+                char *value = calloc(1, args.valueSize + 1);
+                memset(value, 'v', args.valueSize);
+                double start = nowNs();
+                for (unsigned i = 0; i < args.keys; i++) {
+                    queue_set(&Q, key, makeSizedKey(key, i, args.keySize), value, args.valueSize);
+                }
+                args.op = SUITE_FILL;
+                suiteRow(json, &rows, shards, &args, 1, args.keys, (nowNs() - start) / 1e9);
+
+                for (unsigned t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+                    unsigned threads = threadCounts[t];
+                    args.op = SUITE_SET;
+                    suiteRow(json, &rows, shards, &args, threads, (unsigned long) SUITE_OPS * threads,
+                             suitePhase(&args, threads));
+                    args.op = SUITE_GET;
+                    for (unsigned h = 0; h < sizeof(hitPercents) / sizeof(hitPercents[0]); h++) {
+                        args.hitPercent = hitPercents[h];
+                        suiteRow(json, &rows, shards, &args, threads, (unsigned long) SUITE_OPS * threads,
+                                 suitePhase(&args, threads));
+                    }
+                    args.op = SUITE_DEL;
+                    unsigned dels = suiteDels(args.keys, threads);
+                    suiteRow(json, &rows, shards, &args, threads, dels, suitePhase(&args, threads));
+                    // put the deleted keys back for the next thread count
+                    for (unsigned i = 0; i < dels; i++) {
+                        size_t keyLen = makeSizedKey(key, (unsigned) ((i * 7919ull) % args.keys), args.keySize);
+                        queue_set(&Q, key, keyLen, value, args.valueSize);
+                    }
+                }
+                free(value);
+                queueDestroy(&Q);
+            }
+        }
+    }
+    if (json) {
+        printf("\n]}\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[argc]) {
+    const char *mode = argc > 1 ? argv[1] : "sizes";
+    unsigned shards = argc > 2 ? (unsigned) atoi(argv[2]) : QUEUE_SHARDS;
+
+    if (strcmp(mode, "sizes") == 0) {
+        return benchSizes(shards);
+    }
+    if (strcmp(mode, "threads") == 0) {
+        return benchThreads(shards);
+    }
+    if (strcmp(mode, "evict") == 0) {
+        return benchEvict(shards);
+    }
+    if (strcmp(mode, "expire") == 0) {
+        return benchExpire(shards);
+    }
+    if (strcmp(mode, "miss") == 0) {
+        return benchMiss(shards);
+    }
+    if (strcmp(mode, "suite") == 0) {
+        return benchSuite(shards, argc > 3 ? argv[3] : "csv");
+    }
+    fprintf(stderr, "USAGE: %s [sizes|threads|evict|expire|miss|suite] [shards] [csv|json]\n", argv[0]);
+    return EXIT_FAILURE;
+}
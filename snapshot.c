@@ -0,0 +1,600 @@
+/*
+ * HashServer snapshots -- see snapshot.h for how they are taken and the file format.
+ */
+
+// Imports
+#define _GNU_SOURCE     // close_range()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "snapshot.h"
+#include "aof.h"
+#include "log.h"
+
+#define SNAPSHOT_MAGIC "HSSNAP2"    // with its NUL, the first 8 bytes of the file
+#define SNAPSHOT_MAGIC_V1 "HSSNAP1" // a file from before the log position was kept, still loaded
+#define SNAPSHOT_END 0xFFFFFFFFu    // shard of the chunk that ends the file. its pairs are the total
+#define VARINT_MAX 10               // longest variable-length integer
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t shards;    // of the store that was saved
+    uint32_t unused;
+    uint64_t created;   // unix time of the fork
+    uint64_t logId;     // the append-only file the snapshot holds changes of, 0 for none. not in version 1 files
+    uint64_t logOffset; // and how far into it, see aof_log_position()
+};
+
+// version 1 headers end where the log position starts
+#define SNAPSHOT_HEADER_V1 offsetof(struct snapshot_header, logId)
+
+struct snapshot_chunk {
+    uint32_t checksum;  // of everything after it and the pairs, see chunkChecksum()
+    uint32_t shard;
+    uint32_t pairs;
+    uint32_t bytes;     // of the pairs that follow
+};
+
+// everything writing a snapshot needs from the heap. the child of snapshot_start() is a copy of a process full of
+// threads, where only async-signal-safe calls are allowed, so all of it is allocated before the fork
+struct snapshot_target {
+    char *tmp;          // path.tmp, written and renamed over path
+    char *dir;          // dirname() of a copy of path, fsynced after the rename
+    char *dirCopy;
+    char *buf;          // chunk buffer with room for a full chunk plus the longest pair
+    size_t cap;
+};
+
+// what the child needs while it walks the store
+struct snapshot_writer {
+    int fd;
+    char *buf;          // a chunk header, then the chunk's pairs
+    size_t cap;
+    size_t len;         // bytes of pairs in buf
+    unsigned shard;
+    uint32_t pairs;     // in buf
+    unsigned long total;
+};
+
+// a child being waited for
+struct snapshot_job {
+    pid_t pid;
+    uint64_t started;
+    char path[];
+};
+
+static int snapshotRunning;     // a child is writing a snapshot
+static unsigned long snapshots; // written successfully since the server started
+static uint64_t stallNs;        // how long the last fork held the shard locks
+
+static uint64_t monoNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// ------------------------------- ENCODING -------------------------------
+
+static size_t putVarint(char *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (char) (v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (char) v;
+    return n;
+}
+
+// returns where the integer ends, or NULL if it runs past end or is too long.
+static const char *getVarint(const char *in, const char *end, uint64_t *v) {
+    *v = 0;
+    for (unsigned shift = 0; in < end && shift < 7 * VARINT_MAX; shift += 7) {
+        unsigned char byte = (unsigned char) *in++;
+        *v |= (uint64_t) (byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t chunkChecksum(const struct snapshot_chunk *chunk, const char *pairs) {
+    uint64_t h = queue_hash((const char *) chunk + sizeof(chunk->checksum), sizeof(*chunk) - sizeof(chunk->checksum));
+    h ^= queue_hash(pairs, chunk->bytes) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+// ------------------------------- SAVING -------------------------------
+
+static int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// writes out the pairs in the buffer as one chunk of the given shard, with its header in front, in a single write.
+static int chunkWrite(struct snapshot_writer *W, uint32_t shard, uint32_t pairs) {
+    struct snapshot_chunk chunk = {.shard = shard, .pairs = pairs, .bytes = (uint32_t) W->len};
+    chunk.checksum = chunkChecksum(&chunk, W->buf + sizeof(chunk));
+    memcpy(W->buf, &chunk, sizeof(chunk));
+    if (writeAll(W->fd, W->buf, sizeof(chunk) + W->len) < 0) {
+        return -1;
+    }
+    W->len = 0;
+    W->pairs = 0;
+    return 0;
+}
+
+// adds one pair to the chunk being filled, writing the chunk out first if the pair would make it too long. the
+// buffer always has room for the pair then (see targetInit()), so it never grows.
+static int savePair(void *arguements, const char *key, size_t keyLen, const char *value, size_t valueLen,
+                    uint32_t expire) {
+    struct snapshot_writer *W = (struct snapshot_writer *) arguements;
+    size_t need = 3 * VARINT_MAX + keyLen + valueLen;
+    if (W->pairs > 0 && W->len + need > SNAPSHOT_CHUNK && chunkWrite(W, W->shard, W->pairs) < 0) {
+        return -1;
+    }
+    if (sizeof(struct snapshot_chunk) + W->len + need > W->cap) {
+        errno = EOVERFLOW;  // longer than the store's maximum item
+        return -1;
+    }
+    char *out = W->buf + sizeof(struct snapshot_chunk) + W->len;
+    size_t n = putVarint(out, keyLen);
+    n += putVarint(out + n, valueLen);
+    n += putVarint(out + n, expire);
+    memcpy(out + n, key, keyLen);
+    memcpy(out + n + keyLen, value, valueLen);
+    W->len += n + keyLen + valueLen;
+    ++W->pairs;
+    ++W->total;
+    return 0;
+}
+
+static void targetFree(struct snapshot_target *T) {
+    free(T->tmp);
+    free(T->dirCopy);
+    free(T->buf);
+}
+
+// allocates what snapshotWrite() needs to write a snapshot of Q to path. returns -1 if we ran out of memory.
+static int targetInit(struct snapshot_target *T, struct queue *Q, const char *path) {
+    size_t pathLen = strlen(path);
+    T->cap = sizeof(struct snapshot_chunk) + SNAPSHOT_CHUNK + 3 * VARINT_MAX + Q->maxItem;
+    T->tmp = malloc(pathLen + 5);
+    T->dirCopy = malloc(pathLen + 1);
+    T->buf = malloc(T->cap);    // mostly untouched address space, only what a chunk fills in gets pages
+    if (T->tmp == NULL || T->dirCopy == NULL || T->buf == NULL) {
+        targetFree(T);
+        return -1;
+    }
+    memcpy(T->tmp, path, pathLen);
+    memcpy(T->tmp + pathLen, ".tmp", 5);
+    memcpy(T->dirCopy, path, pathLen + 1);
+    T->dir = dirname(T->dirCopy);
+    return 0;
+}
+
+// writes every pair of Q to path with the buffers of T, through T->tmp, which is renamed over path once it is complete
+// and on disk. logId and logOffset say how much of which append-only file Q holds (0 for none), so a load only needs
+// the log after that. nobody may change Q meanwhile. calls nothing but system calls, so the child of a fork() can run
+// it. returns EXIT_SUCCESS or EXIT_FAILURE.
+static int snapshotWrite(struct queue *Q, const char *path, struct snapshot_target *T, uint64_t logId,
+                         uint64_t logOffset) {
+    const char *tmp = T->tmp;
+    struct snapshot_writer W = {.fd = -1, .buf = T->buf, .cap = T->cap};
+
+    W.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (W.fd < 0) {
+        return EXIT_FAILURE;
+    }
+    struct snapshot_header header = {.shards = Q->shardCount, .created = (uint64_t) time(NULL), .logId = logId,
+                                     .logOffset = logOffset};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    if (writeAll(W.fd, (const char *) &header, sizeof(header)) < 0) {
+        goto failed;
+    }
+    for (unsigned s = 0; s < Q->shardCount; s++) {
+        W.shard = s;
+        if (queue_walk_shard(Q, s, savePair, &W) < 0 || (W.pairs > 0 && chunkWrite(&W, s, W.pairs) < 0)) {
+            goto failed;
+        }
+    }
+    if (chunkWrite(&W, SNAPSHOT_END, (uint32_t) W.total) < 0 || fsync(W.fd) < 0) {
+        goto failed;
+    }
+    int closed = close(W.fd);
+    W.fd = -1;
+    if (closed < 0 || rename(tmp, path) < 0) {
+        goto failed;
+    }
+
+    // the rename only sticks once the directory is on disk too
+    int dirFd = open(T->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return EXIT_SUCCESS;
+
+failed:
+    // a half written snapshot is no use to anybody, and left behind it would eat the space a retry needs
+    if (W.fd >= 0) {
+        close(W.fd);
+    }
+    unlink(tmp);
+    return EXIT_FAILURE;
+}
+
+// writes every pair of Q to path, like the child of snapshot_start() does but right here. logId and logOffset are as
+// for snapshotWrite(). nobody may change Q meanwhile. returns EXIT_SUCCESS or EXIT_FAILURE.
+int snapshot_save(struct queue *Q, const char *path, uint64_t logId, uint64_t logOffset) {
+    struct snapshot_target T;
+    if (targetInit(&T, Q, path) < 0) {
+        return EXIT_FAILURE;
+    }
+    int saved = snapshotWrite(Q, path, &T, logId, logOffset);
+    targetFree(&T);
+    return saved;
+}
+
+// background thread of the parent. waits for the child to finish the snapshot and says how it went.
+static void * snapshotReaper(void *arguements) {
+    struct snapshot_job *job = (struct snapshot_job *) arguements;
+    int status = 0;
+    while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    double seconds = (monoNs() - job->started) / 1e9;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+        struct stat st;
+        long long bytes = stat(job->path, &st) == 0 ? (long long) st.st_size : -1;
+        __atomic_add_fetch(&snapshots, 1, __ATOMIC_RELAXED);
+        LOG(LOG_LEVEL_INFO, "msg=\"snapshot saved\" path=\"%s\" bytes=%lld seconds=%.2f", job->path, bytes, seconds);
+    } else {
+        LOG(LOG_LEVEL_ERROR, "msg=\"snapshot failed\" path=\"%s\" status=%d", job->path, status);
+    }
+    free(job);
+    __atomic_store_n(&snapshotRunning, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// forks a child that writes a snapshot of Q to path, unless one is being written already, in which case that one
+// answers the request too. the caller is held up for the fork only. returns 0, or -1 if the child couldn't be started.
+int snapshot_start(struct queue *Q, const char *path) {
+    int idle = 0;
+    if (!__atomic_compare_exchange_n(&snapshotRunning, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    struct snapshot_job *job = malloc(sizeof(struct snapshot_job) + strlen(path) + 1);
+    if (job == NULL) {
+        __atomic_store_n(&snapshotRunning, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    strcpy(job->path, path);
+    struct snapshot_target T;
+    if (targetInit(&T, Q, path) < 0) {
+        free(job);
+        __atomic_store_n(&snapshotRunning, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    // no change may be half done in the copy the child gets. readers carry on, writers wait for the fork
+    job->started = monoNs();
+    queue_lock_all(Q);
+    // changes are logged under the shard locks, so the log is exactly as far along as the copy the child gets
+    uint64_t logOffset = aof_log_position();
+    uint64_t logId = logOffset != 0 ? aof_log_id() : 0;
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the child is this one thread and a frozen copy of the store. its copies of the sockets would keep clients
+        // the parent hangs up on connected, so they go first. it leaves without running any exit handlers, which
+        // belong to the parent
+        if (close_range(3, ~0u, 0) < 0) {
+            for (long fd = sysconf(_SC_OPEN_MAX) - 1; fd >= 3; fd--) {
+                close((int) fd);
+            }
+        }
+        _exit(snapshotWrite(Q, path, &T, logId, logOffset));
+    }
+    queue_unlock_all(Q);
+    targetFree(&T);     // the child has its own copy
+    uint64_t stall = monoNs() - job->started;
+    __atomic_store_n(&stallNs, stall, __ATOMIC_RELAXED);
+    if (pid < 0) {
+        LOG(LOG_LEVEL_ERROR, "msg=\"snapshot fork error\" error=\"%s\"", strerror(errno));
+        free(job);
+        __atomic_store_n(&snapshotRunning, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    job->pid = pid;
+    LOG(LOG_LEVEL_INFO, "msg=\"snapshot started\" pid=%d stall_us=%lu", (int) pid, (unsigned long) (stall / 1000));
+
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&t, &attr, snapshotReaper, job) != 0) {
+        snapshotReaper(job);    // no thread to spare, so wait right here rather than leave a zombie behind
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+// snapshots written successfully since the server started.
+unsigned long snapshot_count(void) {
+    return __atomic_load_n(&snapshots, __ATOMIC_RELAXED);
+}
+
+// how long the last snapshot_start() held up the store's writers, in ns.
+uint64_t snapshot_stall_ns(void) {
+    return __atomic_load_n(&stallNs, __ATOMIC_RELAXED);
+}
+
+// ------------------------------- LOADING -------------------------------
+
+// where a chunk of the file is, as the scan in snapshot_load() found it
+struct snapshot_entry {
+    off_t offset;       // of its pairs
+    struct snapshot_chunk chunk;
+    unsigned target;    // shard of the loading store its pairs (mostly) go into
+};
+
+// what the loader threads share
+struct snapshot_loader {
+    struct queue *Q;
+    int fd;
+    struct snapshot_entry *entries;
+    size_t count;
+    unsigned threads;
+    uint32_t now;
+    unsigned long loaded;   // pairs stored so far
+    uint64_t bytesDone;     // bytes of pairs decoded so far
+    unsigned running;       // threads still at it
+    int failed;             // a chunk was unreadable or malformed
+};
+
+struct snapshot_thread {
+    struct snapshot_loader *L;
+    unsigned id;
+    pthread_t thread;
+    int started;
+};
+
+// stores the pairs of one chunk in Q, holding the lock of shard s for all of them. returns -1 if the chunk is
+// malformed.
+static int loadChunk(struct queue *Q, unsigned s, const struct snapshot_chunk *chunk, const char *pairs, uint32_t now,
+                     unsigned long *loaded) {
+    const char *in = pairs;
+    const char *end = pairs + chunk->bytes;
+    queue_lock_shard(Q, s);
+    for (uint32_t i = 0; i < chunk->pairs; i++) {
+        uint64_t keyLen, valueLen, expire;
+        if ((in = getVarint(in, end, &keyLen)) == NULL || (in = getVarint(in, end, &valueLen)) == NULL ||
+            (in = getVarint(in, end, &expire)) == NULL || keyLen > (uint64_t) (end - in) ||
+            valueLen > (uint64_t) (end - in) - keyLen) {
+            break;
+        }
+        const char *key = in;
+        const char *value = in + keyLen;
+        in = value + valueLen;
+        if (expire != 0 && (expire <= now || expire > now + QUEUE_MAX_TTL)) {
+            continue;   // ran out of time while the server was down, or was never a valid one
+        }
+        if (queue_set_UNLOCKED(Q, s, key, keyLen, value, valueLen, (uint32_t) expire) == 0) {
+            ++*loaded;
+        }
+    }
+    queue_unlock_shard(Q, s);
+    return in == end ? 0 : -1;
+}
+
+static int readAll(int fd, char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t r = pread(fd, data, len, offset);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += r;
+        len -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+// loader thread. takes the chunks whose shard is its own, so no two threads ever want the same shard lock, and every
+// lock is taken once per chunk rather than once per pair.
+static void * snapshotLoader(void *arguements) {
+    struct snapshot_thread *T = (struct snapshot_thread *) arguements;
+    struct snapshot_loader *L = T->L;
+    char *pairs = NULL;
+    size_t pairsCap = 0;
+    unsigned long loaded = 0;
+    for (size_t i = 0; i < L->count && !__atomic_load_n(&L->failed, __ATOMIC_RELAXED); i++) {
+        const struct snapshot_entry *E = &L->entries[i];
+        if (E->target % L->threads != T->id) {
+            continue;
+        }
+        if (E->chunk.bytes > pairsCap) {
+            char *grown = realloc(pairs, E->chunk.bytes);
+            if (grown == NULL) {
+                __atomic_store_n(&L->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            pairs = grown;
+            pairsCap = E->chunk.bytes;
+        }
+        unsigned long before = loaded;
+        if (readAll(L->fd, pairs, E->chunk.bytes, E->offset) < 0 || chunkChecksum(&E->chunk, pairs) != E->chunk.checksum ||
+            loadChunk(L->Q, E->target, &E->chunk, pairs, L->now, &loaded) < 0) {
+            __atomic_store_n(&L->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_add_fetch(&L->loaded, loaded - before, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&L->bytesDone, E->chunk.bytes, __ATOMIC_RELAXED);
+    }
+    free(pairs);
+    __atomic_sub_fetch(&L->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// reads the file's header into *header, and finds every chunk of the file by hopping from chunk header to chunk
+// header, and checks the end chunk is there and adds up. returns the number of chunks (*entries is malloc'ed), or -1
+// if the file is not a complete snapshot.
+static long snapshotScan(struct queue *Q, int fd, struct snapshot_header *header, struct snapshot_entry **entries,
+                         unsigned long *saved, uint64_t *bytes) {
+    struct stat st;
+    memset(header, 0, sizeof(*header));
+    if (fstat(fd, &st) < 0 || readAll(fd, (char *) header, SNAPSHOT_HEADER_V1, 0) < 0) {
+        return -1;
+    }
+    off_t at = SNAPSHOT_HEADER_V1;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0) {
+        if (readAll(fd, (char *) header + at, sizeof(*header) - at, at) < 0) {
+            return -1;
+        }
+        at = sizeof(*header);
+    } else if (memcmp(header->magic, SNAPSHOT_MAGIC_V1, sizeof(header->magic)) != 0) {
+        return -1;
+    }
+    if (header->shards == 0 || (header->shards & (header->shards - 1)) != 0) {
+        return -1;
+    }
+    unsigned savedBits = 0, bits = 0;
+    while ((1u << savedBits) < header->shards) {
+        ++savedBits;
+    }
+    while ((1u << bits) < Q->shardCount) {
+        ++bits;
+    }
+
+    size_t count = 0, cap = 0;
+    struct snapshot_chunk chunk;
+    *entries = NULL;
+    *saved = 0;
+    *bytes = 0;
+    while (readAll(fd, (char *) &chunk, sizeof(chunk), at) == 0) {
+        at += sizeof(chunk);
+        if (chunk.shard == SNAPSHOT_END) {
+            if (chunk.bytes == 0 && chunk.pairs == (uint32_t) *saved && chunkChecksum(&chunk, "") == chunk.checksum) {
+                return (long) count;
+            }
+            break;
+        }
+        if (chunk.shard >= header->shards || chunk.bytes > st.st_size - at) {
+            break;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            struct snapshot_entry *grown = realloc(*entries, cap * sizeof(struct snapshot_entry));
+            if (grown == NULL) {
+                break;
+            }
+            *entries = grown;
+        }
+        // the top bits of a key's hash pick its shard, in the saved store and in this one
+        unsigned target = bits <= savedBits ? chunk.shard >> (savedBits - bits) : chunk.shard << (bits - savedBits);
+        (*entries)[count++] = (struct snapshot_entry) {at, chunk, target};
+        *saved += chunk.pairs;
+        *bytes += chunk.bytes;
+        at += chunk.bytes;
+    }
+    free(*entries);
+    *entries = NULL;
+    return -1;
+}
+
+// stores every pair of the snapshot at path in Q, with a pool of loader threads (one per core, at most one per shard)
+// that decode chunks in parallel, and prints how far along it is every SNAPSHOT_PROGRESS_MS. call before any client
+// can change Q. returns the pairs stored (pairs that have expired meanwhile or don't fit the store's limits are left
+// out), or -1 with errno set: ENOENT if there is no snapshot, EINVAL if the file is not a complete snapshot.
+long snapshot_load(struct queue *Q, const char *path) {
+    uint64_t start = monoNs();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct snapshot_loader L = {.Q = Q, .fd = fd, .now = (uint32_t) time(NULL)};
+    struct snapshot_header header;
+    unsigned long saved = 0;
+    uint64_t bytes = 0;
+    long count = snapshotScan(Q, fd, &header, &L.entries, &saved, &bytes);
+    if (count < 0) {
+        close(fd);
+        fprintf(stderr, "%s IS NOT A COMPLETE SNAPSHOT!\n", path);
+        errno = EINVAL;
+        return -1;
+    }
+    L.count = (size_t) count;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    L.threads = cores < 1 ? 1 : cores > SNAPSHOT_MAX_LOADERS ? SNAPSHOT_MAX_LOADERS : (unsigned) cores;
+    if (L.threads > Q->shardCount) {
+        L.threads = Q->shardCount;
+    }
+    struct snapshot_thread threads[SNAPSHOT_MAX_LOADERS];
+    L.running = L.threads;
+    for (unsigned i = 0; i < L.threads; i++) {
+        threads[i] = (struct snapshot_thread) {.L = &L, .id = i};
+        threads[i].started = pthread_create(&threads[i].thread, NULL, snapshotLoader, &threads[i]) == 0;
+        if (!threads[i].started) {
+            snapshotLoader(&threads[i]);    // no thread to spare, so do its share right here
+        }
+    }
+
+    // nobody is served until the store is complete, so tell whoever is waiting how long that will be
+    struct timespec pause = {0, 100000000};
+    uint64_t reported = start;
+    while (__atomic_load_n(&L.running, __ATOMIC_ACQUIRE) > 0) {
+        nanosleep(&pause, NULL);
+        uint64_t now = monoNs();
+        if (now - reported >= SNAPSHOT_PROGRESS_MS * 1000000ull && bytes > 0) {
+            reported = now;
+            unsigned long loaded = __atomic_load_n(&L.loaded, __ATOMIC_RELAXED);
+            printf("snapshot: %.0f%% of %s, %lu pairs, %.0f keys/s\n",
+                   100.0 * __atomic_load_n(&L.bytesDone, __ATOMIC_RELAXED) / bytes, path, loaded,
+                   loaded / ((now - start) / 1e9));
+            fflush(stdout);
+        }
+    }
+    for (unsigned i = 0; i < L.threads; i++) {
+        if (threads[i].started) {
+            pthread_join(threads[i].thread, NULL);
+        }
+    }
+    free(L.entries);
+    close(fd);
+    if (L.failed) {
+        fprintf(stderr, "%s IS NOT A COMPLETE SNAPSHOT!\n", path);
+        errno = EINVAL;
+        return -1;
+    }
+    // the append-only file only has to be replayed from where the snapshot was taken, see aof_open()
+    Q->logId = header.logId;
+    Q->logOffset = header.logOffset;
+    double seconds = (monoNs() - start) / 1e9;
+    printf("snapshot: loaded %lu of %lu pairs from %s in %.2f s with %u threads, %.0f keys/s\n", L.loaded, saved, path,
+           seconds, L.threads, seconds > 0 ? L.loaded / seconds : 0.0);
+    return (long) L.loaded;
+}
+
+// ------------------------------- END OF SNAPSHOTS -------------------------------
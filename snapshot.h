@@ -0,0 +1,47 @@
+/*
+ * HashServer snapshots -- a point-in-time copy of the whole store in one compact file, written without stopping the
+ * server.
+ *
+ * IMPLEMENTATION AND SHORT DESCRIPTION:
+ *      snapshot_start() takes every shard lock, so no change is half done, forks, and lets go of the locks again. The
+ *      child has a frozen copy of the store: the kernel only copies a page once the parent writes to it, so the fork
+ *      itself costs no more than copying the page tables (a few ms for ten million pairs), and that is the whole stall
+ *      the server sees. The child walks the index of every shard, writes the pairs to a temporary file, fsyncs it and
+ *      renames it over the snapshot, so the file at the path is always a complete snapshot. A thread in the parent
+ *      waits for the child and logs how it went.
+ *
+ *      The file is an 8 byte magic and a header, which also says how far into the append-only file (see aof.h) the
+ *      snapshot goes, so only the log after that is replayed on top of it at startup. Then come chunks of at most
+ *      SNAPSHOT_CHUNK bytes of pairs from one shard each, then an end chunk with the total number of pairs. A chunk
+ *      header holds a checksum of the chunk, the shard, the number of pairs and the length of the pairs. Every pair is
+ *      the key length, value length and expiry time (unix time, 0 for none) as variable-length integers, then the key
+ *      and the value; a short pair takes 3 bytes more than its key and value. Pairs that have expired by the time the
+ *      snapshot is loaded are skipped.
+ *
+ *      A chunk needs nothing from the rest of the file to be decoded, so snapshot_load() loads them in parallel. It
+ *      first hops through the chunk headers to find every chunk and checks the end chunk adds up, which rejects a cut
+ *      short file before anything is stored. Then a pool of loader threads, one per core but at most one per shard,
+ *      share out the chunks by shard: a thread takes only the chunks of its own shards, so it takes each shard lock
+ *      once per chunk and no other loader ever waits for it. The caller is told how far along the load is as it goes.
+ */
+
+#ifndef HASHSERVER_SNAPSHOT_H
+#define HASHSERVER_SNAPSHOT_H
+
+#include <stdint.h>
+#include "queue.h"
+
+// Define parameters
+#define SNAPSHOT_PATH "hashserver.snap"     // default file
+#define SNAPSHOT_CHUNK (1u << 20)   // most bytes of pairs in one chunk
+#define SNAPSHOT_MAX_LOADERS 64     // most threads loading a snapshot
+#define SNAPSHOT_PROGRESS_MS 1000   // time between progress lines while loading
+
+// Method definitions
+int snapshot_start(struct queue *Q, const char *path);
+int snapshot_save(struct queue *Q, const char *path, uint64_t logId, uint64_t logOffset);
+long snapshot_load(struct queue *Q, const char *path);
+unsigned long snapshot_count(void);
+uint64_t snapshot_stall_ns(void);
+
+#endif